@@ -0,0 +1,309 @@
+// bench_chat.c — LAB3 Q2 CHAT throughput benchmark for server2
+// Build: gcc -O2 -Wall -Wextra -o bench_chat xk3_bench_chat.c -lpthread
+// Run:   ./bench_chat [-s ip] [-p port] [-c clients] [-n chats per client]
+//                    [-w in-flight per client] [-b body bytes] [-S server pid]
+//        ./bench_chat -R reconnects [-m login|resume] [-c clients] ...
+//
+// Method: each client SIGNUPs a fresh account, LOGINs, then keeps up to -w
+// CHATs in flight: it sends "CHAT\n<seq>:<padding>\n" and counts one
+// completion each time its own message comes back in the broadcast. Every
+// client also reads everyone else's broadcasts, so the server does the full
+// fan-out. Reported: aggregate CHATs/s and the send-to-own-echo latency.
+// With -S (a server on this host), also the server's CPU time over the run,
+// whole process and its xk3-writer thread, per GB the clients received.
+//
+// Reconnect mode (-R): each client logs in once, then -R times closes its
+// connection, dials again and re-authenticates with LOGIN (full credentials)
+// or RESUME (the token from the previous OK), timing dial-to-OK.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    int fd;
+    size_t len;
+    uint64_t rx;        // bytes received
+    char buf[262144];   // more than one maximal CHAT line
+} conn_t;
+
+typedef struct {
+    int id;
+    int count, window, body;
+    int reconnects, resume;
+    uint64_t *lat;      // one sample per completed CHAT
+    uint64_t rx;
+    int ok;
+} worker_t;
+
+static const char *g_ip = "127.0.0.1";
+static int g_port = 5678;
+static unsigned g_run;   // makes account names unique per run
+static pthread_barrier_t g_start;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int safe_send(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+// Buffered line read; returns line length without '\n', -1 on EOF/error.
+static ssize_t read_line(conn_t *c, char *out, size_t cap) {
+    while (1) {
+        char *nl = memchr(c->buf, '\n', c->len);
+        if (nl) {
+            size_t L = (size_t)(nl - c->buf);
+            size_t k = L < cap - 1 ? L : cap - 1;
+            memcpy(out, c->buf, k); out[k] = '\0';
+            memmove(c->buf, nl + 1, c->len - L - 1);
+            c->len -= L + 1;
+            return (ssize_t)k;
+        }
+        if (c->len == sizeof(c->buf)) c->len = 0; // drop an over-long line
+        ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c->len += (size_t)n;
+        c->rx += (uint64_t)n;
+    }
+}
+
+static int dial(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in sa; memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET; sa.sin_port = htons((uint16_t)g_port);
+    if (inet_pton(AF_INET, g_ip, &sa.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) { close(fd); return -1; }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Send req and wait for a line starting with "OK <what>" (or FAIL). If tok
+// is given, the reply's "token:" value is copied there.
+static int expect_ok(conn_t *c, const char *req, const char *what, char *tok, size_t tokcap) {
+    char line[4096];
+    if (safe_send(c->fd, req, strlen(req)) < 0) return -1;
+    while (read_line(c, line, sizeof(line)) >= 0) {
+        if (strncmp(line, "OK ", 3) == 0 && strncmp(line + 3, what, strlen(what)) == 0) {
+            const char *t = strstr(line, "token:");
+            if (tok) snprintf(tok, tokcap, "%s", t ? t + 6 : "");
+            return 0;
+        }
+        if (strncmp(line, "FAIL", 4) == 0) { fprintf(stderr, "%s\n", line); return -1; }
+    }
+    return -1;
+}
+
+static void *worker(void *arg) {
+    worker_t *w = (worker_t*)arg;
+    conn_t *c = calloc(1, sizeof(*c));
+    char acc[32], req[256], line[8192];
+    int started = 0;
+    if (!c || (c->fd = dial()) < 0) { fprintf(stderr, "client %d: connect failed\n", w->id); goto out; }
+    snprintf(acc, sizeof(acc), "b%05u%05d", g_run % 100000, w->id);
+    snprintf(req, sizeof(req), "SIGNUP\nSID:%s\nACC:%s\nPWD:Passw0rd!\n", acc, acc);
+    if (expect_ok(c, req, "SIGNUP", NULL, 0) < 0) goto out;
+    char login[128], tok[160];
+    snprintf(login, sizeof(login), "LOGIN\nACC:%s\nPWD:Passw0rd!\n", acc);
+    if (expect_ok(c, login, "LOGIN", tok, sizeof(tok)) < 0) goto out;
+
+    if (w->reconnects) {
+        pthread_barrier_wait(&g_start);
+        started = 1;
+        for (int i = 0; i < w->reconnects; ++i) {
+            close(c->fd);
+            c->len = 0;
+            uint64_t t0 = now_ns();
+            int rc = -1;
+            // The server frees our previous slot asynchronously, so a redial
+            // can briefly see "Server is full!": back off and try again.
+            for (int attempt = 0; attempt < 200 && rc < 0; ++attempt) {
+                if (attempt) { close(c->fd); c->len = 0; usleep(500); }
+                if ((c->fd = dial()) < 0) continue;
+                if (w->resume) {
+                    snprintf(req, sizeof(req), "RESUME\nTOKEN:%s\n", tok);
+                    rc = expect_ok(c, req, "RESUME", tok, sizeof(tok));
+                } else {
+                    rc = expect_ok(c, login, "LOGIN", tok, sizeof(tok));
+                }
+            }
+            if (rc < 0) { fprintf(stderr, "client %d: reconnect failed\n", w->id); goto out; }
+            w->lat[i] = now_ns() - t0;
+        }
+        w->ok = 1;
+        goto out;
+    }
+
+    char *body = malloc((size_t)w->body + 64);
+    uint64_t *sent_at = calloc((size_t)w->count, sizeof(uint64_t));
+    if (!body || !sent_at) goto out;
+    char tag[64];
+    int tl = snprintf(tag, sizeof(tag), "[%s]: ", acc);
+
+    pthread_barrier_wait(&g_start);
+    started = 1;
+    int sent = 0, done = 0;
+    while (done < w->count) {
+        while (sent < w->count && sent - done < w->window) {
+            int L = snprintf(body, 64, "CHAT\n%d:", sent);
+            memset(body + L, 'x', (size_t)w->body);
+            body[L + w->body] = '\n';
+            sent_at[sent] = now_ns();
+            if (safe_send(c->fd, body, (size_t)L + (size_t)w->body + 1) < 0) goto out;
+            sent++;
+        }
+        if (read_line(c, line, sizeof(line)) < 0) { fprintf(stderr, "client %d: connection lost\n", w->id); goto out; }
+        if (strncmp(line, tag, (size_t)tl) == 0) {
+            int seq = atoi(line + tl);
+            if (seq >= 0 && seq < w->count) w->lat[done++] = now_ns() - sent_at[seq];
+        }
+    }
+    w->ok = 1;
+    free(body);
+    free(sent_at);
+out:
+    if (!started) pthread_barrier_wait(&g_start); // don't strand the others
+    if (c) w->rx = c->rx;
+    if (c && c->fd >= 0) close(c->fd);
+    free(c);
+    return NULL;
+}
+
+// utime + stime from a /proc/.../stat file, in seconds; -1 if unreadable.
+static double proc_cpu(const char *path) {
+    char buf[1024];
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')'); // comm may contain spaces
+    unsigned long long ut, st;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &ut, &st) != 2) return -1;
+    return (double)(ut + st) / (double)sysconf(_SC_CLK_TCK);
+}
+
+// CPU seconds of the whole server and of its writer thread.
+static void server_cpu(int pid, double *all, double *writer) {
+    char path[300], comm[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    *all = proc_cpu(path);
+    *writer = -1;
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    DIR *d = opendir(path);
+    for (struct dirent *e; d && (e = readdir(d));) {
+        snprintf(path, sizeof(path), "/proc/%d/task/%.20s/comm", pid, e->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        bool hit = fgets(comm, sizeof(comm), f) && strncmp(comm, "xk3-writer", 10) == 0;
+        fclose(f);
+        if (hit) {
+            snprintf(path, sizeof(path), "/proc/%d/task/%.20s/stat", pid, e->d_name);
+            *writer = proc_cpu(path);
+            break;
+        }
+    }
+    if (d) closedir(d);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    int clients = 4, count = 5000, window = 1, body = 64, reconnects = 0, resume = 0, spid = 0, opt;
+    while ((opt = getopt(argc, argv, "s:p:c:n:w:b:R:m:S:")) != -1) {
+        switch (opt) {
+        case 's': g_ip = optarg; break;
+        case 'p': g_port = atoi(optarg); break;
+        case 'c': clients = atoi(optarg); break;
+        case 'n': count = atoi(optarg); break;
+        case 'w': window = atoi(optarg); break;
+        case 'b': body = atoi(optarg); break;
+        case 'R': reconnects = atoi(optarg); break;
+        case 'm': resume = strcmp(optarg, "resume") == 0; break;
+        case 'S': spid = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s ip] [-p port] [-c clients] [-n chats] [-w window] [-b bytes] [-S pid]\n"
+                            "       %s -R reconnects [-m login|resume] [-c clients]\n", argv[0], argv[0]);
+            return 2;
+        }
+    }
+    if (clients < 1 || count < 1 || window < 1 || body < 0 || body > 65000 || reconnects < 0) { fprintf(stderr, "bad arguments\n"); return 2; }
+    if (reconnects) count = reconnects; // one sample per reconnect
+    signal(SIGPIPE, SIG_IGN);
+    g_run = (unsigned)getpid() ^ (unsigned)time(NULL);
+
+    worker_t *ws = calloc((size_t)clients, sizeof(worker_t));
+    pthread_t *th = calloc((size_t)clients, sizeof(pthread_t));
+    if (!ws || !th) return 1;
+    pthread_barrier_init(&g_start, NULL, (unsigned)clients + 1);
+    for (int i = 0; i < clients; ++i) {
+        ws[i] = (worker_t){ .id = i, .count = count, .window = window, .body = body,
+                            .reconnects = reconnects, .resume = resume,
+                            .lat = malloc(sizeof(uint64_t) * (size_t)count) };
+        pthread_create(&th[i], NULL, worker, &ws[i]);
+    }
+    double cpu0 = 0, wcpu0 = 0, cpu1 = 0, wcpu1 = 0;
+    pthread_barrier_wait(&g_start);
+    if (spid) server_cpu(spid, &cpu0, &wcpu0);
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < clients; ++i) pthread_join(th[i], NULL);
+    double secs = (double)(now_ns() - t0) / 1e9;
+    if (spid) server_cpu(spid, &cpu1, &wcpu1);
+
+    size_t total = 0;
+    uint64_t rx = 0;
+    for (int i = 0; i < clients; ++i) {
+        if (!ws[i].ok) { fprintf(stderr, "client %d failed\n", i); return 1; }
+        total += (size_t)count;
+        rx += ws[i].rx;
+    }
+    uint64_t *all = malloc(sizeof(uint64_t) * total);
+    size_t k = 0;
+    for (int i = 0; i < clients; ++i) { memcpy(all + k, ws[i].lat, sizeof(uint64_t) * (size_t)count); k += (size_t)count; }
+    qsort(all, total, sizeof(uint64_t), cmp_u64);
+    if (reconnects) {
+        printf("clients=%d %s reconnects=%zu  %.0f reconnects/s  p50=%.1fus p99=%.1fus max=%.1fus\n",
+               clients, resume ? "RESUME" : "LOGIN", total, (double)total / secs,
+               all[total / 2] / 1e3, all[(size_t)(total * 0.99)] / 1e3, all[total - 1] / 1e3);
+        return 0;
+    }
+    printf("clients=%d window=%d body=%d chats=%zu  %.0f chats/s  p50=%.1fus p99=%.1fus max=%.1fus\n",
+           clients, window, body, total, (double)total / secs,
+           all[total / 2] / 1e3, all[(size_t)(total * 0.99)] / 1e3, all[total - 1] / 1e3);
+    if (spid) {
+        double gb = (double)rx / 1e9;
+        if (cpu0 < 0 || cpu1 < 0) { fprintf(stderr, "pid %d: cannot read /proc\n", spid); return 1; }
+        printf("delivered %.3f GB  server cpu %.2fs (%.2f s/GB)", gb, cpu1 - cpu0, (cpu1 - cpu0) / gb);
+        if (wcpu0 >= 0 && wcpu1 >= 0) printf("  writer %.2fs (%.2f s/GB)", wcpu1 - wcpu0, (wcpu1 - wcpu0) / gb);
+        printf("\n");
+    }
+    return 0;
+}
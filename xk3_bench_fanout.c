@@ -0,0 +1,95 @@
+// bench_fanout.c — LAB3 Q2 broadcast sweep cost per recipient in server2
+// Build: gcc -O2 -Wall -Wextra -o bench_fanout xk3_bench_fanout.c -lpthread
+// Run:   ./bench_fanout [members ...]        default: 10000 100000
+//
+// Method: server2 is compiled in (its main renamed) and broadcast_msg() is
+// driven directly against N sessions that are in the broadcast set but have
+// no socket and no writer thread, so what is timed is exactly the sweep: the
+// RCU read section, one queue push per member and one ready-stack hand-off.
+// Sessions are allocated up front and joined in random order, so consecutive
+// members are not adjacent in memory, as after real churn. Each round queues
+// ROUND_MSGS broadcasts, then the queues are emptied off the clock.
+//
+// Also reported: the cost of one leave + join pair once the set is full
+// (LOGIN/disconnect churn), timed over CHURN_OPS pairs.
+
+#define main xk3_server2_main
+#include "xk3_server2.c"
+#undef main
+
+#define ROUNDS 20
+#define ROUND_MSGS 256      // stays below OUTQ_SLOTS, so nothing is dropped
+#define CHURN_OPS 2000
+
+static void reset_queues(session_t **ss, int n) {
+    for (int i = 0; i < n; ++i) {
+        pthread_mutex_lock(&ss[i]->q_mtx);
+        outq_discard_locked(ss[i]);
+        pthread_mutex_unlock(&ss[i]->q_mtx);
+        __atomic_store_n(&ss[i]->on_ready, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&ready_top, NULL, __ATOMIC_RELAXED);
+    uint64_t v;
+    ssize_t r = read(writer_evfd, &v, sizeof(v));
+    (void)r;
+}
+
+static int run(int n) {
+    session_t **ss = (session_t **)malloc((size_t)n * sizeof(*ss));
+    if (!ss) return -1;
+    for (int i = 0; i < n; ++i) if (!(ss[i] = session_alloc(-1))) return -1;
+    for (int i = n - 1; i > 0; --i) { // Fisher-Yates with a fixed seed
+        int j = rand() % (i + 1);
+        session_t *t = ss[i]; ss[i] = ss[j]; ss[j] = t;
+    }
+    for (int i = 0; i < n; ++i) if (!bset_add(ss[i])) return -1;
+
+    char line[80];
+    int L = snprintf(line, sizeof(line), "[bench]: %060d\n", 0);
+    msg_t *m = msg_new(line, (size_t)L);
+    if (!m) return -1;
+    double best = 1e30, sum = 0;
+    for (int r = 0; r < ROUNDS; ++r) {
+        uint64_t t0 = now_ns();
+        for (int k = 0; k < ROUND_MSGS; ++k) broadcast_msg(m, false);
+        double per = (double)(now_ns() - t0) / ROUND_MSGS / n;
+        if (per < best) best = per;
+        sum += per;
+        reset_queues(ss, n);
+    }
+
+    uint64_t t0 = now_ns();
+    for (int k = 0; k < CHURN_OPS; ++k) {
+        session_t *s = ss[rand() % n];
+        bset_del(s);
+        bset_add(s);
+    }
+    double churn_us = (double)(now_ns() - t0) / CHURN_OPS / 1e3;
+
+    printf("members=%-7d broadcast: %.1f ns/recipient (best %.1f)  %.0f us/broadcast   leave+join: %.1f us\n",
+           n, sum / ROUNDS, best, sum / ROUNDS * n / 1e3, churn_us);
+
+    for (int i = 0; i < n; ++i) bset_del(ss[i]);
+    reset_queues(ss, n);
+    for (int i = 0; i < n; ++i) { pthread_mutex_destroy(&ss[i]->q_mtx); free(ss[i]); }
+    free(ss);
+    msg_put(m);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    bset = (bset_t *)calloc(1, sizeof(*bset) + BSET_MIN * sizeof(bset->m[0]));
+    writer_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!bset || writer_evfd < 0) { perror("init"); return 1; }
+    bset->cap = BSET_MIN;
+    rcu_register_thread();
+    srand(1);
+
+    int def[] = { 10000, 100000 };
+    int cnt = argc > 1 ? argc - 1 : 2;
+    for (int i = 0; i < cnt; ++i) {
+        int n = argc > 1 ? atoi(argv[i + 1]) : def[i];
+        if (n < 1 || run(n) < 0) { fprintf(stderr, "members=%d: setup failed\n", n); return 1; }
+    }
+    return 0;
+}
@@ -0,0 +1,188 @@
+// bench_lat.c — LAB3 Q1 UNICAST sender-to-receiver latency benchmark
+// Build: gcc -O2 -Wall -Wextra -o bench_lat xk3_bench_lat.c
+// Run:   ./bench_lat [ip] [port] [count]        measure a running server1
+//        ./bench_lat --compare ./server1 [cpu] [count]
+//           starts server1 twice on 127.0.0.1:5678 (default mode, then
+//           XK3_LOWLAT=<cpu>) and prints both latency distributions.
+//
+// Method: two connections, tx and rx. rx learns its SockID from the prefix of
+// its own BROADCAST. tx then sends "UNICAST <rx>\n<t_send_ns>\n" one message at
+// a time and waits for rx to read "[SockID tx]: <t_send_ns>", so every sample
+// is one unqueued trip client -> server -> client over loopback, timed with
+// CLOCK_MONOTONIC on both ends.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WARMUP 1000
+#define DEFAULT_COUNT 20000
+
+typedef struct {
+    int fd;
+    size_t len;
+    char buf[4096];
+} conn_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int safe_send(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(fd, buf + off, len - off, 0);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+// Buffered line read; returns line length without '\n', -1 on EOF/error.
+static ssize_t read_line(conn_t *c, char *out, size_t cap) {
+    while (1) {
+        char *nl = memchr(c->buf, '\n', c->len);
+        if (nl) {
+            size_t L = (size_t)(nl - c->buf);
+            size_t k = L < cap - 1 ? L : cap - 1;
+            memcpy(out, c->buf, k); out[k] = '\0';
+            memmove(c->buf, nl + 1, c->len - L - 1);
+            c->len -= L + 1;
+            return (ssize_t)k;
+        }
+        if (c->len == sizeof(c->buf)) c->len = 0; // drop an over-long line
+        ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        c->len += (size_t)n;
+    }
+}
+
+static int dial(const char *ip, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in sa; memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET; sa.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, ip, &sa.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) { close(fd); return -1; }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct { uint64_t p50, p90, p99, p999, max; int n; } lat_t;
+
+// Run one measurement against ip:port; returns 0 and fills *r on success.
+static int measure(const char *ip, int port, int count, lat_t *r) {
+    conn_t tx = { .fd = dial(ip, port) }, rx = { .fd = dial(ip, port) };
+    if (tx.fd < 0 || rx.fd < 0) { fprintf(stderr, "connect failed\n"); return -1; }
+
+    char line[4096];
+    // Learn rx's SockID from its own broadcast (tx sees it too; discard)
+    if (safe_send(rx.fd, "BROADCAST\nbench_lat\n", 20) < 0) return -1;
+    int rx_id = -1;
+    while (rx_id < 0) {
+        if (read_line(&rx, line, sizeof(line)) < 0) return -1;
+        if (strstr(line, "]: bench_lat")) sscanf(line, "[SockID %d]", &rx_id);
+    }
+    while (read_line(&tx, line, sizeof(line)) >= 0 && !strstr(line, "]: bench_lat")) {}
+
+    uint64_t *samples = malloc(sizeof(uint64_t) * (size_t)count);
+    if (!samples) return -1;
+    char msg[128];
+    for (int i = 0; i < WARMUP + count; ++i) {
+        uint64_t t0 = now_ns();
+        int L = snprintf(msg, sizeof(msg), "UNICAST %d\n%llu\n", rx_id, (unsigned long long)t0);
+        if (safe_send(tx.fd, msg, (size_t)L) < 0) { free(samples); return -1; }
+        unsigned long long echoed = 0;
+        do {
+            if (read_line(&rx, line, sizeof(line)) < 0) { free(samples); return -1; }
+            const char *p = strstr(line, "]: ");
+            echoed = p ? strtoull(p + 3, NULL, 10) : 0;
+        } while (echoed != t0);
+        uint64_t dt = now_ns() - t0;
+        if (i >= WARMUP) samples[i - WARMUP] = dt;
+    }
+    close(tx.fd); close(rx.fd);
+
+    qsort(samples, (size_t)count, sizeof(uint64_t), cmp_u64);
+    r->n = count;
+    r->p50 = samples[(size_t)(count * 0.50)];
+    r->p90 = samples[(size_t)(count * 0.90)];
+    r->p99 = samples[(size_t)(count * 0.99)];
+    r->p999 = samples[(size_t)(count * 0.999)];
+    r->max = samples[count - 1];
+    free(samples);
+    return 0;
+}
+
+static void print_row(const char *name, const lat_t *r) {
+    printf("%-12s n=%-7d p50=%7.1fus p90=%7.1fus p99=%7.1fus p999=%7.1fus max=%8.1fus\n",
+           name, r->n, r->p50 / 1e3, r->p90 / 1e3, r->p99 / 1e3, r->p999 / 1e3, r->max / 1e3);
+}
+
+// Start server_path with XK3_LOWLAT=lowlat (NULL for default mode), measure, stop it.
+static int run_server_and_measure(const char *server_path, const char *lowlat, int count, lat_t *r) {
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return -1; }
+    if (pid == 0) {
+        if (lowlat) setenv("XK3_LOWLAT", lowlat, 1); else unsetenv("XK3_LOWLAT");
+        freopen("/dev/null", "w", stdout);
+        execl(server_path, server_path, (char*)NULL);
+        perror("execl");
+        _exit(127);
+    }
+    // Wait for the listener
+    int ok = -1;
+    for (int i = 0; i < 100 && ok < 0; ++i) {
+        int fd = dial("127.0.0.1", 5678);
+        if (fd >= 0) { close(fd); ok = 0; } else usleep(20000);
+    }
+    usleep(50000); // let the probe connection be reaped
+    if (ok == 0) ok = measure("127.0.0.1", 5678, count, r);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+
+    if (argc >= 3 && strcmp(argv[1], "--compare") == 0) {
+        const char *cpu = argc >= 4 ? argv[3] : "0";
+        int count = argc >= 5 ? atoi(argv[4]) : DEFAULT_COUNT;
+        lat_t def, ll;
+        if (run_server_and_measure(argv[2], NULL, count, &def) < 0) { fprintf(stderr, "default run failed\n"); return 1; }
+        if (run_server_and_measure(argv[2], cpu, count, &ll) < 0) { fprintf(stderr, "low-latency run failed\n"); return 1; }
+        print_row("default", &def);
+        print_row("lowlat", &ll);
+        return 0;
+    }
+
+    const char *ip = argc >= 2 ? argv[1] : "127.0.0.1";
+    int port = argc >= 3 ? atoi(argv[2]) : 5678;
+    int count = argc >= 4 ? atoi(argv[3]) : DEFAULT_COUNT;
+    lat_t r;
+    if (measure(ip, port, count, &r) < 0) return 1;
+    print_row("unicast", &r);
+    return 0;
+}
@@ -0,0 +1,292 @@
+// bench_mux.c — LAB3 Q2 logical sessions per connection: plain vs MULTIPLEX
+// Build: gcc -O2 -Wall -Wextra -o bench_mux xk3_bench_mux.c
+// Run:   ./bench_mux [-s ip] [-p port] [-n sessions] [-c connections]
+//                   [-k broadcasts] [-S server pid]
+//        -c 0 (default) opens one plain connection per session; -c N carries
+//        the sessions as channels of N MULTIPLEX connections. Plain runs need
+//        a server built with -DMAX_CLIENTS above -n.
+//
+// Method: every session SIGNUPs a fresh account and LOGINs, one session at a
+// time (plain: dial, frame, wait for OK LOGIN; multiplexed: the channels of
+// a connection in pipelined batches of MUX_BATCH). Once all replies and
+// presence digests have been drained, the first session sends -k CHATs and
+// the run ends when every connection has received all of them.
+//
+// Reported:
+// - sessions per connection, and for the whole setup the growth of the
+//   kernel's slab and kernel stacks (/proc/meminfo) and of TCP buffer pages
+//   (/proc/net/sockstat). On loopback both ends are on this host, so this
+//   counts the client's sockets too; it is what a bot fleet and the server
+//   pay together. With -S, also the server's threads, fds and RSS;
+// - the broadcasts: time until the last connection had them all, the copies
+//   the server queued and wrote (one per connection), bytes received, and
+//   with -S the server's CPU time.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MUX_BATCH 100       // channels authed per round trip; 200 replies stay below OUTQ_SLOTS
+#define QUIET_MS 500        // drained once nothing arrived for this long
+
+typedef struct {
+    int fd;
+    size_t len;
+    uint64_t rx;        // bytes received
+    int got;            // broadcasts of this run seen
+    char buf[65536];
+} conn_t;
+
+typedef struct {
+    long slab_kb, kstack_kb, tcp_pages;
+    long threads, fds, rss_kb;
+} snap_t;
+
+static const char *g_ip = "127.0.0.1";
+static int g_port = 5678;
+static unsigned g_run;   // makes account names unique per run
+static char g_tag[64];   // "[<first session's sid>]: bench ", what the broadcasts start with
+static size_t g_tag_len;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int safe_send(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+static int dial(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in sa; memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET; sa.sin_port = htons((uint16_t)g_port);
+    if (inet_pton(AF_INET, g_ip, &sa.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) { close(fd); return -1; }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Receive once (blocking unless nonblock) and hand every whole line to
+// on_line. Returns -1 once the connection is gone.
+static int pump(conn_t *c, bool nonblock, void (*on_line)(conn_t *, const char *, size_t, void *), void *arg) {
+    ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, nonblock ? MSG_DONTWAIT : 0);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return 0;
+    if (n <= 0) return -1;
+    c->len += (size_t)n;
+    c->rx += (uint64_t)n;
+    char *s = c->buf, *nl;
+    while ((nl = memchr(s, '\n', c->len - (size_t)(s - c->buf)))) {
+        on_line(c, s, (size_t)(nl - s), arg);
+        s = nl + 1;
+    }
+    c->len -= (size_t)(s - c->buf);
+    memmove(c->buf, s, c->len);
+    if (c->len == sizeof(c->buf)) c->len = 0; // drop an over-long line
+    return 0;
+}
+
+// Setup replies: count OK LOGINs, stop on a FAIL.
+static void count_ok(conn_t *c, const char *l, size_t len, void *arg) {
+    (void)c;
+    int *ok = (int *)arg;
+    const char *r = l;
+    if (len && l[0] == '@') { r = memchr(l, ' ', len); r = r ? r + 1 : l + len; } // a channel's reply
+    size_t rl = len - (size_t)(r - l);
+    if (rl >= 8 && memcmp(r, "OK LOGIN", 8) == 0) ++*ok;
+    else if (rl >= 4 && memcmp(r, "FAIL", 4) == 0) { fprintf(stderr, "%.*s\n", (int)len, l); *ok = -1000000; }
+}
+
+static void count_bench(conn_t *c, const char *l, size_t len, void *arg) {
+    (void)arg;
+    if (len >= g_tag_len && memcmp(l, g_tag, g_tag_len) == 0) c->got++;
+}
+
+static long meminfo_kb(const char *key) {
+    FILE *f = fopen("/proc/meminfo", "r");
+    char line[256];
+    long v = 0;
+    size_t kl = strlen(key);
+    while (f && fgets(line, sizeof(line), f)) if (strncmp(line, key, kl) == 0 && line[kl] == ':') { v = atol(line + kl + 1); break; }
+    if (f) fclose(f);
+    return v;
+}
+
+static void snap(snap_t *s, int pid) {
+    memset(s, 0, sizeof(*s));
+    s->slab_kb = meminfo_kb("Slab");
+    s->kstack_kb = meminfo_kb("KernelStack");
+    FILE *f = fopen("/proc/net/sockstat", "r");
+    char line[256];
+    while (f && fgets(line, sizeof(line), f)) {
+        const char *m = strstr(line, " mem ");
+        if (strncmp(line, "TCP:", 4) == 0 && m) s->tcp_pages = atol(m + 5);
+    }
+    if (f) fclose(f);
+    if (pid <= 0) return;
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((f = fopen(path, "r"))) {
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "Threads:", 8) == 0) s->threads = atol(line + 8);
+            else if (strncmp(line, "VmRSS:", 6) == 0) s->rss_kb = atol(line + 6);
+        }
+        fclose(f);
+    }
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *d = opendir(path);
+    struct dirent *e;
+    while (d && (e = readdir(d))) if (e->d_name[0] != '.') s->fds++;
+    if (d) closedir(d);
+}
+
+static double cpu_s(int pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    const char *p = strrchr(buf, ')');
+    unsigned long ut = 0, st = 0;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) != 2) return 0;
+    return (double)(ut + st) / (double)sysconf(_SC_CLK_TCK);
+}
+
+// SIGNUP + LOGIN frames for session i, prefixed with its channel if ch >= 0.
+static int auth_frame(char *out, size_t cap, int i, int ch) {
+    char acc[32], pre[16] = "";
+    snprintf(acc, sizeof(acc), "m%05u%06d", g_run % 100000, i);
+    if (ch >= 0) snprintf(pre, sizeof(pre), "@%d ", ch);
+    return snprintf(out, cap, "%sSIGNUP\n%sSID:%s\n%sACC:%s\n%sPWD:Passw0rd!\n%sLOGIN\n%sACC:%s\n%sPWD:Passw0rd!\n",
+                    pre, pre, acc, pre, acc, pre, pre, pre, acc, pre);
+}
+
+// Authenticate sessions [first, first + n) on c, as channels if mux.
+static int setup_conn(conn_t *c, int first, int n, bool mux) {
+    static char req[MUX_BATCH * 256];
+    for (int b = 0; b < n; b += MUX_BATCH) {
+        int m = n - b < MUX_BATCH ? n - b : MUX_BATCH, L = 0, ok = 0;
+        for (int k = 0; k < m; ++k) L += auth_frame(req + L, sizeof(req) - (size_t)L, first + b + k, mux ? b + k : -1);
+        if (safe_send(c->fd, req, (size_t)L) < 0) return -1;
+        while (ok >= 0 && ok < m) if (pump(c, false, count_ok, &ok) < 0) return -1;
+        if (ok < 0) return -1;
+    }
+    return 0;
+}
+
+static void drain(conn_t *cs, int ep) {
+    struct epoll_event ev[256];
+    int k;
+    while ((k = epoll_wait(ep, ev, 256, QUIET_MS)) > 0)
+        for (int i = 0; i < k; ++i) pump(&cs[ev[i].data.u32], true, count_bench, NULL);
+}
+
+int main(int argc, char **argv) {
+    int n = 1000, nc = 0, k = 100, pid = 0, opt;
+    while ((opt = getopt(argc, argv, "s:p:n:c:k:S:")) != -1) {
+        switch (opt) {
+        case 's': g_ip = optarg; break;
+        case 'p': g_port = atoi(optarg); break;
+        case 'n': n = atoi(optarg); break;
+        case 'c': nc = atoi(optarg); break;
+        case 'k': k = atoi(optarg); break;
+        case 'S': pid = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-s ip] [-p port] [-n sessions] [-c connections] [-k broadcasts] [-S pid]\n", argv[0]);
+            return 2;
+        }
+    }
+    bool mux = nc > 0;
+    if (!mux) nc = n;
+    if (n < 1 || nc > n || k < 1) { fprintf(stderr, "need 1 <= connections <= sessions and -k >= 1\n"); return 2; }
+    g_run = (unsigned)(now_ns() / 1000) ^ (unsigned)getpid();
+    g_tag_len = (size_t)snprintf(g_tag, sizeof(g_tag), "[m%05u%06d]: bench ", g_run % 100000, 0);
+
+    conn_t *cs = (conn_t *)calloc((size_t)nc, sizeof(*cs));
+    int ep = epoll_create1(0);
+    if (!cs || ep < 0) { perror("setup"); return 1; }
+    snap_t s0, s1;
+    snap(&s0, pid);
+    uint64_t t0 = now_ns();
+    for (int i = 0, first = 0; i < nc; ++i) {
+        int per = n / nc + (i < n % nc);
+        conn_t *c = &cs[i];
+        if ((c->fd = dial()) < 0) { fprintf(stderr, "connection %d: connect failed\n", i); return 1; }
+        if (mux) {
+            char line[64];
+            if (safe_send(c->fd, "MULTIPLEX\n", 10) < 0) return 1;
+            ssize_t r = recv(c->fd, line, sizeof(line), 0); // the OK comes alone
+            if (r < 12 || memcmp(line, "OK MULTIPLEX", 12) != 0) { fprintf(stderr, "connection %d: no OK MULTIPLEX\n", i); return 1; }
+        }
+        if (setup_conn(c, first, per, mux) < 0) { fprintf(stderr, "connection %d: setup failed\n", i); return 1; }
+        first += per;
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+        epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+    double setup_s = (double)(now_ns() - t0) / 1e9;
+    drain(cs, ep);
+    snap(&s1, pid);
+
+    printf("%s: %d sessions over %d connections (%.1f per connection), set up in %.2f s\n",
+           mux ? "multiplexed" : "plain", n, nc, (double)n / nc, setup_s);
+    long kmem = (s1.slab_kb - s0.slab_kb) + (s1.kstack_kb - s0.kstack_kb);
+    printf("  kernel: slab %+ld kB, stacks %+ld kB, TCP buffers %+ld pages  => %.2f kB per session (both ends)\n",
+           s1.slab_kb - s0.slab_kb, s1.kstack_kb - s0.kstack_kb, s1.tcp_pages - s0.tcp_pages, (double)kmem / n);
+    if (pid > 0)
+        printf("  server: threads %+ld, fds %+ld, RSS %+ld kB (%.2f kB per session)\n",
+               s1.threads - s0.threads, s1.fds - s0.fds, s1.rss_kb - s0.rss_kb, (double)(s1.rss_kb - s0.rss_kb) / n);
+
+    for (int i = 0; i < nc; ++i) { cs[i].got = 0; cs[i].rx = 0; }
+    double cpu0 = pid > 0 ? cpu_s(pid) : 0;
+    t0 = now_ns();
+    static char req[256];
+    for (int i = 0; i < k; ++i) {
+        int L = mux ? snprintf(req, sizeof(req), "@0 CHAT\n@0 bench %d\n", i) : snprintf(req, sizeof(req), "CHAT\nbench %d\n", i);
+        if (safe_send(cs[0].fd, req, (size_t)L) < 0) { perror("send"); return 1; }
+    }
+    int done = 0;
+    struct epoll_event ev[256];
+    while (done < nc) {
+        int m = epoll_wait(ep, ev, 256, 10000);
+        if (m <= 0) { fprintf(stderr, "timed out: %d of %d connections have every broadcast\n", done, nc); return 1; }
+        for (int i = 0; i < m; ++i) {
+            conn_t *c = &cs[ev[i].data.u32];
+            bool had = c->got >= k;
+            if (pump(c, true, count_bench, NULL) < 0) { fprintf(stderr, "connection lost\n"); return 1; }
+            if (!had && c->got >= k) done++;
+        }
+    }
+    double fan_ms = (double)(now_ns() - t0) / 1e6;
+    uint64_t rx = 0;
+    for (int i = 0; i < nc; ++i) rx += cs[i].rx;
+    printf("  %d broadcasts to %d sessions: %.1f ms, %d copies queued and written (%lld per broadcast), %.0f kB received",
+           k, n, fan_ms, k * nc, (long long)nc, rx / 1024.0);
+    if (pid > 0) printf(", server CPU %.0f ms", (cpu_s(pid) - cpu0) * 1e3);
+    printf("\n");
+    for (int i = 0; i < nc; ++i) close(cs[i].fd);
+    free(cs);
+    return 0;
+}
@@ -0,0 +1,116 @@
+// bench_rooms.c — LAB3 Q3 private room create/lookup/leave cost in server3
+// Build: gcc -O2 -Wall -Wextra -o bench_rooms xk3_bench_rooms.c -lpthread
+// Run:   ./bench_rooms [rooms ...]        default: 1000 10000 100000
+//
+// Method: server3 is compiled in (its main renamed, MAX_CLIENTS raised) and
+// the functions its commands call are driven directly for clients with fds
+// that are not open, so sends fail at once and what is timed is the room
+// bookkeeping. Each size first fills that many two-member rooms and keeps
+// them open; the operations are then timed at that population over OPS runs:
+// - create: room_create_with_members(), owner plus one accepted;
+// - lookup: room_get() for a random live id, what say_to_room() does, and
+//   for reference the rooms[] scan it replaced, over the same rooms;
+// - leave: leave_room_to_hall() of one member (LEAVE);
+// - disconnect: remove_client() of the last member, which frees the room,
+//   then add_client() again for the next round.
+// Sizes are cumulative: each one adds rooms on top of the previous size's.
+// After the runs every room and client is checked against its back-pointers.
+
+#define MAX_CLIENTS 400000
+#define main xk3_server3_main
+#include "xk3_server3.c"
+#undef main
+#include <time.h>
+
+#define OPS 200000
+#define SCANS 2000
+#define FD_BASE 100000 // above any fd this process has open
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rng = 88172645463325252ull;
+static uint64_t xorshift(void) {
+    rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+    return rng;
+}
+
+static int live_ids[MAX_ROOMS];
+static int next_fd = FD_BASE;
+
+static int pair_room(int *a, int *b) {
+    *a = next_fd++; *b = next_fd++;
+    if (add_client(*a) < 0 || add_client(*b) < 0) return -1;
+    return room_create_with_members(*a, b, 1);
+}
+
+// The loop say_to_room() ran before the slab: every slot until the id matches.
+static room_t *scan_room(int id) {
+    for (uint32_t s = 0; s < rooms_top; ++s) { room_t *rm = room_slot(s); if (rm->in_use && rm->id == id) return rm; }
+    return NULL;
+}
+
+static int check(void) {
+    uint32_t rooms = 0, seated = 0;
+    for (uint32_t s = 0; s < rooms_top; ++s) {
+        room_t *rm = room_slot(s);
+        if (!rm->in_use) continue;
+        ++rooms;
+        if (room_get(rm->id) != rm || rm->mcount < 1 || rm->mcount > ROOM_SEATS) return -1;
+        for (int i = 0; i < rm->mcount; ++i) if (rm->members[i]->room != rm || rm->members[i]->seat != i) return -1;
+    }
+    for (int i = 0; i < client_top; ++i) {
+        client_t *c = &clients[i];
+        if (!c->in_use) continue;
+        if (client_of(c->fd) != c) return -1;
+        if (c->room) { ++seated; if (c->where != PLACE_ROOM || c->room->members[c->seat] != c) return -1; }
+    }
+    uint32_t n = 0;
+    for (uint32_t f = rooms_free; f; f = room_slot(f - 1)->next_free) if (room_slot(f - 1)->in_use || ++n > rooms_top) return -1;
+    return n + rooms == rooms_top ? (int)seated : -1;
+}
+
+int main(int argc, char **argv) {
+    int cnt = argc > 1 ? argc - 1 : 3, live = 0;
+    for (int i = 0; i < cnt; ++i) {
+        long v = argc > 1 ? atol(argv[i + 1]) : (i == 0 ? 1000 : i == 1 ? 10000 : 100000);
+        if (v <= live || 2 * v + 2 > MAX_CLIENTS) { fprintf(stderr, "rooms=%ld: sizes must increase, up to %d\n", v, MAX_CLIENTS / 2 - 1); return 1; }
+        for (; live < v; ++live) {
+            int a, b;
+            if ((live_ids[live] = pair_room(&a, &b)) <= 0) { fprintf(stderr, "room %d not created\n", live); return 1; }
+        }
+
+        uint64_t t_create = 0, t_leave = 0, t_gone = 0;
+        for (int k = 0; k < OPS; ++k) {
+            int a = next_fd++, b = next_fd++;
+            if (add_client(a) < 0 || add_client(b) < 0) { fprintf(stderr, "add_client\n"); return 1; }
+            uint64_t t0 = now_ns();
+            int rid = room_create_with_members(a, &b, 1);
+            uint64_t t1 = now_ns();
+            leave_room_to_hall(a);
+            uint64_t t2 = now_ns();
+            remove_client(b);
+            uint64_t t3 = now_ns();
+            remove_client(a);
+            if (rid <= 0 || room_get(rid)) { fprintf(stderr, "room %d: create or free failed\n", rid); return 1; }
+            t_create += t1 - t0; t_leave += t2 - t1; t_gone += t3 - t2;
+        }
+
+        uint64_t found = 0, t0 = now_ns();
+        for (int k = 0; k < OPS; ++k) found += room_get(live_ids[xorshift() % (uint64_t)live]) != NULL;
+        double get_ns = (double)(now_ns() - t0) / OPS;
+        t0 = now_ns();
+        for (int k = 0; k < SCANS; ++k) found += scan_room(live_ids[xorshift() % (uint64_t)live]) != NULL;
+        double scan_ns = (double)(now_ns() - t0) / SCANS;
+        if (found != OPS + SCANS) { fprintf(stderr, "lookup: %llu found\n", (unsigned long long)found); return 1; }
+
+        int seated = check();
+        if (seated != 2 * live) { fprintf(stderr, "rooms=%d: inconsistent rooms or clients (%d)\n", live, seated); return 1; }
+        printf("rooms=%-7d create %.0f ns, lookup %.1f ns (scan %.0f ns), leave %.0f ns, disconnect %.0f ns\n",
+               live, (double)t_create / OPS, get_ns, scan_ns, (double)t_leave / OPS, (double)t_gone / OPS);
+    }
+    return 0;
+}
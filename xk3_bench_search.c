@@ -0,0 +1,149 @@
+// bench_search.c — LAB3 Q2 SEARCH index cost and query latency in server2
+// Build: gcc -O2 -Wall -Wextra -o bench_search xk3_bench_search.c -lpthread
+//        add -U__SSE2__ for the scalar intersection, to compare
+// Run:   ./bench_search [history [messages]]   default: 1000000 3000000
+//
+// Method: server2 is compiled in (its main renamed) and the index thread's
+// own index_msg() is called directly with "[sid]: ..." lines of 6 to 15
+// words drawn from a VOCAB-word vocabulary with Zipf(1) frequencies, so a
+// few words are in most lines and most words are rare. The ring holds
+// `history` lines (XK3_HISTORY_BYTES is lifted); `messages` are indexed in
+// all, so once the ring is full the rest exercise expiry and the sweeps.
+//
+// Reported:
+// - indexing: mean ns per line (the index thread's work, off the CHAT path)
+//   and the worst INDEX_BATCH-line write-lock hold, sweeps included;
+// - memory: posting bytes per retained line and per posting, against 4
+//   bytes per posting for plain id arrays, plus the dictionary; and the
+//   sealed blocks alone (what a long-lived list costs);
+// - queries: search_run() as SEARCH calls it, for words picked by frequency
+//   rank, mean us over QUERY_RUNS runs each with the number of hits.
+
+#define main xk3_server2_main
+#include "xk3_server2.c"
+#undef main
+
+#define VOCAB 100000
+#define QUERY_RUNS 200
+
+static double zipf_cdf[VOCAB];
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t xorshift(void) {
+    rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+    return rng;
+}
+
+static int zipf_word(void) {
+    double u = (double)(xorshift() >> 11) / (double)(1ull << 53);
+    int lo = 0, hi = VOCAB - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static int word_text(int rank, char *out) { return sprintf(out, "w%x", rank); }
+
+static msg_t *make_line(uint32_t i) {
+    char buf[512];
+    int n = sprintf(buf, "[%09u]:", i % 50000);
+    int words = 6 + (int)(xorshift() % 10);
+    for (int k = 0; k < words; ++k) { buf[n++] = ' '; n += word_text(zipf_word(), buf + n); }
+    buf[n++] = '\n';
+    return msg_new(buf, (size_t)n);
+}
+
+// All posting memory, and the sealed blocks alone with the ids in them.
+static void posting_bytes(size_t *bytes, uint64_t *ids, size_t *terms, size_t *blk_bytes, uint64_t *blk_ids) {
+    *bytes = 0; *ids = 0; *terms = 0; *blk_bytes = 0; *blk_ids = 0;
+    for (size_t i = 0; i <= term_mask; ++i) {
+        const term_t *t = term_slot[i];
+        if (!t) continue;
+        ++*terms;
+        *ids += t->ids;
+        *bytes += sizeof(*t) + t->len + t->blk_cap * sizeof(*t->blk) + t->tail_cap * sizeof(*t->tail);
+        for (uint32_t k = 0; k < t->nblk; ++k) {
+            *blk_bytes += sizeof(*t->blk[k]) + t->blk[k]->bytes;
+            *blk_ids += t->blk[k]->n;
+        }
+    }
+}
+
+static void query(const int *ranks, int n) {
+    char w[SEARCH_TERMS][TERM_MAX], label[128];
+    size_t wl[SEARCH_TERMS];
+    int L = 0;
+    for (int i = 0; i < n; ++i) {
+        char tmp[16];
+        wl[i] = (size_t)word_text(ranks[i], tmp);
+        memcpy(w[i], tmp, wl[i]);
+        L += snprintf(label + L, sizeof(label) - (size_t)L, "%s#%d", i ? " & " : "", ranks[i]);
+    }
+    uint32_t hits[SEARCH_HITS];
+    size_t nh = 0;
+    uint64_t t0 = now_ns();
+    for (int r = 0; r < QUERY_RUNS; ++r) {
+        pthread_rwlock_rdlock(&index_lock);
+        nh = search_run(w, wl, (size_t)n, hits, SEARCH_HITS);
+        pthread_rwlock_unlock(&index_lock);
+    }
+    double us = (double)(now_ns() - t0) / QUERY_RUNS / 1e3;
+    term_t *t = term_find(w[0], wl[0], str_hash(w[0], wl[0]));
+    printf("  %-26s %8.1f us  %2zu hits   (df of first: %u)\n", label, us, nh, t ? t->ids : 0);
+}
+
+int main(int argc, char **argv) {
+    uint32_t history = argc > 1 ? (uint32_t)atol(argv[1]) : 1000000;
+    uint32_t total = argc > 2 ? (uint32_t)atol(argv[2]) : 3 * history;
+    if (!history || total < history) { fprintf(stderr, "need 0 < history <= messages\n"); return 1; }
+    setenv("XK3_HISTORY", "0", 1); // index_start() without its thread: this one indexes
+    if (index_start() < 0) { perror("index_start"); return 1; }
+    hist_cap = history;
+    hist_bytes_max = UINT64_MAX; // the ring holds `history` lines whatever their size
+    hist_ring = (hist_doc_t *)calloc(hist_cap, sizeof(*hist_ring));
+    if (!hist_ring || !term_rehash(TERM_TAB_MIN)) { perror("calloc"); return 1; }
+
+    double h = 0, c = 0;
+    for (int i = 0; i < VOCAB; ++i) h += 1.0 / (i + 1);
+    for (int i = 0; i < VOCAB; ++i) zipf_cdf[i] = c += 1.0 / (i + 1) / h;
+
+    uint64_t worst = 0, busy = 0;
+    for (uint32_t i = 0; i < total; i += INDEX_BATCH) {
+        msg_t *batch[INDEX_BATCH];
+        uint32_t n = total - i < INDEX_BATCH ? total - i : INDEX_BATCH;
+        for (uint32_t k = 0; k < n; ++k) batch[k] = make_line(i + k);
+        uint64_t t0 = now_ns();
+        pthread_rwlock_wrlock(&index_lock);
+        for (uint32_t k = 0; k < n; ++k) { index_msg(batch[k]); msg_put(batch[k]); }
+        pthread_rwlock_unlock(&index_lock);
+        uint64_t dt = now_ns() - t0;
+        busy += dt;
+        if (dt > worst) worst = dt;
+    }
+    size_t bytes, terms, blk_bytes;
+    uint64_t ids, blk_ids;
+    posting_bytes(&bytes, &ids, &terms, &blk_bytes, &blk_ids);
+    bytes += blk_bytes;
+    printf("history=%u lines, %u indexed: %.0f ns/line, worst batch of %d %.2f ms\n",
+           history, total, (double)busy / total, INDEX_BATCH, worst / 1e6);
+    printf("postings: %llu for %zu words, %.1f B/line, %.2f B/posting (plain ids: 4), dictionary %.1f B/line\n",
+           (unsigned long long)ids, terms, (double)bytes / history, (double)bytes / (double)ids,
+           (double)(term_mask + 1) * sizeof(*term_slot) / history);
+    printf("          sealed blocks: %.2f B/posting with headers, the rest is tails and per-word overhead\n",
+           (double)blk_bytes / (double)blk_ids);
+
+    printf("queries (#rank by frequency):\n");
+    query((const int[]){ 0 }, 1);
+    query((const int[]){ 5000 }, 1);
+    query((const int[]){ 90000 }, 1);
+    query((const int[]){ 1, 2 }, 2);
+    query((const int[]){ 10, 20 }, 2);
+    query((const int[]){ 100, 200 }, 2);
+    query((const int[]){ 1000, 2000 }, 2);
+    query((const int[]){ 0, 5000 }, 2);
+    query((const int[]){ 5, 50, 500 }, 3);
+    query((const int[]){ 100, 99999 }, 2);
+    return 0;
+}
@@ -0,0 +1,110 @@
+// bench_users.c — LAB3 Q2 user store size and lookup cost in server2
+// Build: gcc -O2 -Wall -Wextra -o bench_users xk3_bench_users.c -lpthread
+// Run:   ./bench_users [users ...]        default: 1000000 10000000
+//
+// Method: server2 is compiled in (its main renamed) and users_add(), the
+// SIGNUP path, is called directly: account "a<9 digits>", password
+// "Pw!<6 digits>", and one SID per two accounts, as for students with a
+// second account. Sizes are cumulative: each one adds users on top of the
+// previous size's.
+//
+// Reported per size:
+// - bytes per user: records, arena, account table and SID table as
+//   allocated, and the process RSS growth over the run;
+// - SIGNUP: mean and worst single users_add(), the worst showing that no
+//   insert rehashes the whole table;
+// - LOGIN lookup: users_find_by_acc() for random existing accounts (hit)
+//   and absent ones (miss), mean ns over LOOKUPS calls each.
+
+#define main xk3_server2_main
+#include "xk3_server2.c"
+#undef main
+
+#define LOOKUPS 2000000
+
+static long rss_bytes(void) {
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) { if (fscanf(f, "%ld %ld", &pages, &rss) != 2) rss = 0; fclose(f); }
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+static int fill(uint32_t from, uint32_t to, uint64_t *worst) {
+    char sid[16], acc[16], pwd[16];
+    for (uint32_t i = from; i < to; ++i) {
+        int ls = snprintf(sid, sizeof(sid), "%09u", i / 2);
+        int la = snprintf(acc, sizeof(acc), "a%09u", i);
+        int lp = snprintf(pwd, sizeof(pwd), "Pw!%06u", i % 1000000);
+        uint64_t t0 = now_ns();
+        users_add_t r = users_add((view_t){ sid, (size_t)ls }, (view_t){ acc, (size_t)la }, (view_t){ pwd, (size_t)lp });
+        uint64_t dt = now_ns() - t0;
+        if (dt > *worst) *worst = dt;
+        if (r != USERS_OK) { fprintf(stderr, "users_add %u: %d\n", i, (int)r); return -1; }
+    }
+    return 0;
+}
+
+static double lookups(uint32_t n, bool hit) {
+    char acc[16];
+    uint64_t x = 88172645463325252ull, found = 0;
+    uint64_t t0 = now_ns();
+    for (int k = 0; k < LOOKUPS; ++k) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17; // xorshift
+        uint32_t i = (uint32_t)(x % n);
+        int la = hit ? snprintf(acc, sizeof(acc), "a%09u", i) : snprintf(acc, sizeof(acc), "b%09u", i);
+        found += users_find_by_acc(acc, (size_t)la) != NULL;
+    }
+    double ns = (double)(now_ns() - t0) / LOOKUPS;
+    if (found != (hit ? (uint64_t)LOOKUPS : 0)) fprintf(stderr, "lookup: %llu found\n", (unsigned long long)found);
+    return ns;
+}
+
+// The same loop with the lookup left out: what lookups() spends around it.
+static double lookup_overhead(uint32_t n) {
+    char acc[16];
+    uint64_t x = 88172645463325252ull, sum = 0;
+    uint64_t t0 = now_ns();
+    for (int k = 0; k < LOOKUPS; ++k) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        sum += (uint64_t)snprintf(acc, sizeof(acc), "a%09u", (uint32_t)(x % n)) + (unsigned char)acc[3];
+    }
+    double ns = (double)(now_ns() - t0) / LOOKUPS;
+    if (sum == 1) putchar(' ');
+    return ns;
+}
+
+int main(int argc, char **argv) {
+    users_tab = strtab_new(USERS_TAB_MIN, ~((1u << USER_ID_BITS) - 1));
+    sid_tab = strtab_new(SID_TAB_MIN, 0);
+    if (!users_tab || !sid_tab) { perror("calloc"); return 1; }
+    rcu_register_thread();
+
+    int cnt = argc > 1 ? argc - 1 : 2;
+    uint32_t done = 0;
+    long rss0 = rss_bytes();
+    for (int i = 0; i < cnt; ++i) {
+        long v = argc > 1 ? atol(argv[i + 1]) : (i ? 10000000 : 1000000);
+        if (v <= (long)done || v > (long)MAX_USERS) { fprintf(stderr, "users=%ld: sizes must increase, up to %u\n", v, MAX_USERS); return 1; }
+        uint32_t n = (uint32_t)v;
+        uint64_t worst = 0, t0 = now_ns();
+        if (fill(done, n, &worst) < 0) return 1;
+        double add_ns = (double)(now_ns() - t0) / (n - done);
+        done = n;
+
+        const strtab_t *t = users_tab, *st = sid_tab;
+        size_t rec = (size_t)((n + (1u << USER_CHUNK_BITS) - 1) >> USER_CHUNK_BITS) << USER_CHUNK_BITS;
+        double b_rec = (double)rec * sizeof(user_t) / n;
+        double b_arena = (double)((arena_top >> ARENA_CHUNK_BITS) + 1) * (1u << ARENA_CHUNK_BITS) / n;
+        double b_tab = (double)((t->mask + 1) + (t->old ? t->old->mask + 1 : 0)) * sizeof(t->slot[0]) / n;
+        double b_sid = (double)((st->mask + 1) + (st->old ? st->old->mask + 1 : 0)) * sizeof(st->slot[0]) / n;
+        double b_rss = (double)(rss_bytes() - rss0) / n;
+        printf("users=%-9u bytes/user: %.1f (records %.1f, arena %.1f, table %.1f, sids %.1f; rss %.1f)\n",
+               n, b_rec + b_arena + b_tab + b_sid, b_rec, b_arena, b_tab, b_sid, b_rss);
+
+        double base = lookup_overhead(n);
+        double hit = lookups(n, true) - base, miss = lookups(n, false) - base;
+        printf("               signup: %.0f ns mean, %.1f us worst   lookup: hit %.1f ns, miss %.1f ns\n",
+               add_ns, worst / 1e3, hit, miss);
+    }
+    return 0;
+}
@@ -0,0 +1,558 @@
+// replay.c — LAB3 Q2 traffic replay for server2 captures (XK3_TRACE)
+// Build: gcc -O2 -Wall -Wextra -o replay xk3_replay.c -lpthread
+// Run:   ./replay [-s ip] [-p port] [-x speed|max] [-g grace_ms] trace.bin
+//        ./replay -d trace.bin           print the trace as text
+//
+// Method: the trace is loaded whole and split per recorded connection. Each
+// connection is re-opened at its recorded offset (divided by -x; "max" sends
+// as fast as the server reads) on its own thread and sends its inbound lines
+// on the same schedule while reading replies. Direct replies (anything that
+// is not a "[sid]: ..." chat line or a "SYSTEM:" notice) are matched in order
+// against the recorded ones:
+//   - latency is from sending the line a reply followed (the last line of its
+//     command) to receiving it; CHAT is timed to the sender's own echo;
+//   - a reply that differs from the recording, once token values are masked,
+//     counts as diverged, as does a missing or extra one.
+// Tokens differ between runs: when a reply that carried a token in the
+// capture carries one now, the recorded token is mapped to the live one, and
+// a RESUME presenting a recorded token waits (up to -g) until the reply that
+// issued it has been replayed, then presents the live one. Captures hold
+// placeholders, not secrets: passwords are replaced by stand-ins that pass
+// the signup policy exactly when the originals did (equal passwords get
+// equal stand-ins), and tokens by a hash that is still mapped as above, so
+// they are replayed as recorded. After its
+// last line a connection stays open until its recorded close, then up to -g
+// ms (default 2000) more for outstanding replies.
+//
+// Notes:
+// - Connections are replayed in capture order but not synchronized with each
+//   other; at high speed a LOGIN can overtake the SIGNUP it depended on on
+//   another connection, which shows up as divergence.
+// - The server's connection cap applies: "Server is full!" is reported as a
+//   rejected connection and all its replies as missing. A connection the
+//   server closes or resets while replies are outstanding is reported as cut;
+//   besides a full server's close racing our input, that is usually the
+//   kernel dropping connections the accept loop has not caught up with
+//   (check TcpExtListenOverflows).
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+enum { TR_OPEN = 1, TR_CLOSE = 2, TR_IN = 3, TR_REPLY = 4 };
+enum { C_SIGNUP, C_LOGIN, C_RESUME, C_CHAT, C_SEARCH, C_EXIT, C_OTHER, C_COUNT };
+static const char *cmd_name[C_COUNT] = { "SIGNUP", "LOGIN", "RESUME", "CHAT", "SEARCH", "EXIT!", "other" };
+
+#define THREAD_STACK (256 * 1024)
+#define TOKENS_SLOTS 4096    // recorded -> live token buckets
+#define SHOW_DIVERGED 5
+
+typedef struct {
+    uint64_t t_us;          // since the start of the trace
+    const char *data;       // points into the loaded trace
+    uint32_t len;
+    uint8_t cmd;            // command this line belongs to
+    bool last;              // final line of its command: the server acts on it
+} tline_t;
+
+typedef struct {
+    uint64_t t_us;
+    const char *data;
+    uint32_t len;
+    uint32_t after;         // inbound lines recorded before it, 0 for a reply's later lines
+} treply_t;
+
+typedef struct {
+    uint8_t cmd;
+    uint64_t ns;
+} sample_t;
+
+typedef struct {
+    unsigned id;
+    bool seen;
+    uint64_t open_us, close_us;
+    tline_t *in; size_t nin, capin;
+    treply_t *rep; size_t nrep, caprep;
+    int args_left; uint8_t cur_cmd; // protocol state while loading
+
+    // Replay results (owned by the connection's thread until it is joined)
+    pthread_t th;
+    bool failed, rejected, cut;
+    uint64_t *sent_ns;
+    size_t nrecv, matched, diverged, extra;
+    sample_t *lat; size_t nlat, caplat;
+    char *echo_q; size_t echo_len, echo_cap, echo_head; // bodies of CHATs awaiting their echo
+    size_t *echo_idx; size_t necho, echo_first;          // and the line each came from
+    char first_diff[256];
+    int first_diff_k;
+} conn_t;
+
+static const char *g_ip = "127.0.0.1";
+static int g_port = 5678;
+static double g_speed = 1.0;        // 0 = max
+static uint64_t g_grace_ns = 2000000000ull;
+static uint64_t g_t0;               // replay start, CLOCK_MONOTONIC ns
+
+static conn_t *conns;
+static size_t nconns;
+
+typedef struct tok { struct tok *next; char rec[160]; char live[160]; } tok_t;
+static tok_t *tokens[TOKENS_SLOTS];
+static pthread_mutex_t tokens_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tokens_cv = PTHREAD_COND_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t due_ns(uint64_t t_us) {
+    return g_speed > 0 ? g_t0 + (uint64_t)((double)t_us * 1000.0 / g_speed) : 0;
+}
+
+static void sleep_until(uint64_t t) {
+    uint64_t now = now_ns();
+    if (t <= now) return;
+    struct timespec d = { (time_t)((t - now) / 1000000000ull), (long)((t - now) % 1000000000ull) };
+    while (nanosleep(&d, &d) < 0 && errno == EINTR) {}
+}
+
+static void *grow(void *p, size_t *cap, size_t need, size_t elem) {
+    if (need <= *cap) return p;
+    size_t ncap = *cap ? *cap * 2 : 16;
+    while (ncap < need) ncap *= 2;
+    void *np = realloc(p, ncap * elem);
+    if (!np) { perror("realloc"); exit(1); }
+    *cap = ncap;
+    return np;
+}
+
+// ---- Loading ----
+
+static bool get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    uint64_t x = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t b = *(*p)++;
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) { *v = x; return true; }
+    }
+    return false;
+}
+
+static conn_t *conn_get(unsigned id) {
+    if (id >= nconns) {
+        size_t n = nconns ? nconns : 64;
+        while (n <= id) n *= 2;
+        conn_t *nc = realloc(conns, n * sizeof(*nc));
+        if (!nc) { perror("realloc"); exit(1); }
+        memset(nc + nconns, 0, (n - nconns) * sizeof(*nc));
+        conns = nc;
+        nconns = n;
+    }
+    conn_t *c = &conns[id];
+    if (!c->seen) { c->seen = true; c->id = id; }
+    return c;
+}
+
+// Mirror the server's parser: which command does this line belong to?
+static void classify(conn_t *c, tline_t *l) {
+    if (c->args_left > 0) {
+        l->cmd = c->cur_cmd;
+        l->last = --c->args_left == 0;
+        return;
+    }
+    int args = 0;
+    uint8_t cmd = C_OTHER;
+    size_t n = l->len; // the command word is the whole line
+    while (n && (l->data[n - 1] == '\n' || l->data[n - 1] == '\r')) n--;
+#define IS(w) (n == sizeof(w) - 1 && memcmp(l->data, w, n) == 0)
+    if (IS("SIGNUP")) { cmd = C_SIGNUP; args = 3; }
+    else if (IS("LOGIN")) { cmd = C_LOGIN; args = 2; }
+    else if (IS("RESUME")) { cmd = C_RESUME; args = 1; }
+    else if (IS("CHAT")) { cmd = C_CHAT; args = 1; }
+    else if (IS("SEARCH")) { cmd = C_SEARCH; args = 1; }
+    else if (IS("EXIT!")) cmd = C_EXIT;
+#undef IS
+    l->cmd = c->cur_cmd = cmd;
+    c->args_left = args;
+    l->last = args == 0;
+}
+
+// Returns the number of records loaded, -1 if this is not a trace.
+static long load_trace(const uint8_t *buf, size_t size, bool dump) {
+    if (size < 16 || memcmp(buf, "XK3TRC1\n", 8) != 0) return -1;
+    const uint8_t *p = buf + 16, *end = buf + size;
+    uint64_t t_us = 0;
+    long n = 0;
+    while (p < end) {
+        const uint8_t *rec = p;
+        uint8_t type = *p++;
+        uint64_t id, dt, len = 0;
+        if (!get_varint(&p, end, &id) || !get_varint(&p, end, &dt)) { p = rec; break; }
+        if (type == TR_IN || type == TR_REPLY) {
+            if (!get_varint(&p, end, &len) || (uint64_t)(end - p) < len) { p = rec; break; }
+        }
+        if (type < TR_OPEN || type > TR_REPLY || id == 0 || id > 100000000) { fprintf(stderr, "corrupt record at offset %zu\n", (size_t)(rec - buf)); return -1; }
+        t_us += dt;
+        const char *data = (const char *)p;
+        p += len;
+        n++;
+        if (dump) {
+            static const char *tn[] = { "", "OPEN", "CLOSE", "IN", "REPLY" };
+            int L = (int)len;
+            while (L && (data[L - 1] == '\n' || data[L - 1] == '\r')) L--;
+            printf("%12.6f %6llu %-5s %.*s\n", t_us / 1e6, (unsigned long long)id, tn[type], L, data);
+            continue;
+        }
+        conn_t *c = conn_get((unsigned)id);
+        switch (type) {
+        case TR_OPEN: c->open_us = c->close_us = t_us; break;
+        case TR_CLOSE: c->close_us = t_us; break;
+        case TR_IN:
+            c->in = grow(c->in, &c->capin, c->nin + 1, sizeof(*c->in));
+            c->in[c->nin] = (tline_t){ .t_us = t_us, .data = data, .len = (uint32_t)len };
+            classify(c, &c->in[c->nin]);
+            c->nin++;
+            c->close_us = t_us;
+            break;
+        case TR_REPLY:
+            // Replies are matched line by line; a multi-line one (SEARCH) is
+            // timed by its first line only.
+            for (size_t o = 0, k; o < len; o = k) {
+                const char *nl = (const char *)memchr(data + o, '\n', len - o);
+                k = nl ? (size_t)(nl - data) + 1 : len;
+                c->rep = grow(c->rep, &c->caprep, c->nrep + 1, sizeof(*c->rep));
+                c->rep[c->nrep++] = (treply_t){ .t_us = t_us, .data = data + o, .len = (uint32_t)(k - o), .after = o ? 0 : (uint32_t)c->nin };
+            }
+            c->close_us = t_us;
+            break;
+        }
+    }
+    if (p < end) fprintf(stderr, "trace ends in a partial record (%zu bytes ignored)\n", (size_t)(end - p));
+    return n;
+}
+
+// ---- Resume tokens ----
+
+static unsigned tok_slot(const char *t, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) { h ^= (uint8_t)t[i]; h *= 16777619u; }
+    return h % TOKENS_SLOTS;
+}
+
+// Length of the "token:" value at t (up to a space or the end).
+static size_t tok_len(const char *t, const char *end) {
+    size_t n = 0;
+    while (t + n < end && t[n] != ' ' && t[n] != '\n' && t[n] != '\r') n++;
+    return n;
+}
+
+static void token_map(const char *rec, size_t rl, const char *live, size_t ll) {
+    if (rl >= sizeof(((tok_t *)0)->rec) || ll >= sizeof(((tok_t *)0)->live)) return;
+    tok_t *t = calloc(1, sizeof(*t));
+    if (!t) return;
+    memcpy(t->rec, rec, rl);
+    memcpy(t->live, live, ll);
+    unsigned b = tok_slot(rec, rl);
+    pthread_mutex_lock(&tokens_mtx);
+    t->next = tokens[b];
+    tokens[b] = t;
+    pthread_cond_broadcast(&tokens_cv);
+    pthread_mutex_unlock(&tokens_mtx);
+}
+
+// "TOKEN:<recorded>\n" -> "TOKEN:<live>\n" into out, once the reply that
+// issued it has been replayed; the recorded line if that never happens.
+static size_t token_rewrite(const tline_t *l, char *out, size_t cap) {
+    const char *rec = l->data + 6, *end = l->data + l->len;
+    size_t rl = l->len > 6 ? tok_len(rec, end) : 0;
+    int w = -1;
+    if (rl) {
+        unsigned b = tok_slot(rec, rl);
+        uint64_t give_up = now_ns() + g_grace_ns;
+        struct timespec dl;
+        clock_gettime(CLOCK_REALTIME, &dl);
+        dl.tv_sec += (time_t)(g_grace_ns / 1000000000ull);
+        dl.tv_nsec += (long)(g_grace_ns % 1000000000ull);
+        if (dl.tv_nsec >= 1000000000L) { dl.tv_sec++; dl.tv_nsec -= 1000000000L; }
+        pthread_mutex_lock(&tokens_mtx);
+        while (w < 0) {
+            for (tok_t *t = tokens[b]; t; t = t->next) {
+                if (strlen(t->rec) == rl && memcmp(t->rec, rec, rl) == 0) { w = snprintf(out, cap, "TOKEN:%s\n", t->live); break; }
+            }
+            if (w >= 0 || now_ns() >= give_up || pthread_cond_timedwait(&tokens_cv, &tokens_mtx, &dl) == ETIMEDOUT) break;
+        }
+        pthread_mutex_unlock(&tokens_mtx);
+    }
+    if (w < 0 || (size_t)w >= cap) {
+        size_t k = l->len < cap ? l->len : cap;
+        memcpy(out, l->data, k);
+        return k;
+    }
+    return (size_t)w;
+}
+
+// ---- Replaying one connection ----
+
+// Copy a reply with every "token:<value>" masked, for comparison.
+static size_t mask_tokens(const char *s, size_t len, char *out, size_t cap) {
+    size_t o = 0;
+    for (size_t i = 0; i < len && o + 1 < cap; ) {
+        if (len - i >= 6 && memcmp(s + i, "token:", 6) == 0) {
+            if (o + 7 >= cap) break;
+            memcpy(out + o, "token:*", 7); o += 7; i += 6;
+            while (i < len && s[i] != ' ' && s[i] != '\n' && s[i] != '\r') i++;
+        } else {
+            out[o++] = s[i++];
+        }
+    }
+    while (o && (out[o - 1] == '\n' || out[o - 1] == '\r')) o--;
+    out[o] = '\0';
+    return o;
+}
+
+static void add_sample(conn_t *c, uint8_t cmd, uint64_t ns) {
+    c->lat = grow(c->lat, &c->caplat, c->nlat + 1, sizeof(*c->lat));
+    c->lat[c->nlat++] = (sample_t){ cmd, ns };
+}
+
+static void on_line(conn_t *c, const char *l, size_t len, uint64_t now) {
+    if (c->nrecv == 0 && len >= 15 && memcmp(l, "Server is full!", 15) == 0) { c->rejected = true; return; }
+    if (l[0] == '[') { // a chat line: is it our oldest CHAT coming back?
+        const char *body = memmem(l, len, "]: ", 3);
+        if (!body || c->echo_first == c->necho) return;
+        body += 3;
+        const char *want = c->echo_q + c->echo_head;
+        size_t wl = strlen(want);
+        if ((size_t)(l + len - body) == wl && memcmp(body, want, wl) == 0) {
+            add_sample(c, C_CHAT, now - c->sent_ns[c->echo_idx[c->echo_first]]);
+            c->echo_first++;
+            c->echo_head += wl + 1;
+        }
+        return;
+    }
+    if (len >= 7 && memcmp(l, "SYSTEM:", 7) == 0) return;
+
+    size_t k = c->nrecv++;
+    if (k >= c->nrep) { c->extra++; return; }
+    const treply_t *r = &c->rep[k];
+    const char *lt = memmem(l, len, "token:", 6), *rt = memmem(r->data, r->len, "token:", 6);
+    if (lt && rt) token_map(rt + 6, tok_len(rt + 6, r->data + r->len), lt + 6, tok_len(lt + 6, l + len));
+    if (r->after > 0 && c->sent_ns[r->after - 1]) add_sample(c, c->in[r->after - 1].cmd, now - c->sent_ns[r->after - 1]);
+    char a[4096], b[4096];
+    mask_tokens(r->data, r->len, a, sizeof(a));
+    mask_tokens(l, len, b, sizeof(b));
+    if (strcmp(a, b) == 0) { c->matched++; return; }
+    if (c->diverged++ == 0) {
+        c->first_diff_k = (int)k;
+        snprintf(c->first_diff, sizeof(c->first_diff), "expected \"%.110s\", got \"%.110s\"", a, b);
+    }
+}
+
+typedef struct { int fd; size_t len; char buf[262144]; } rx_t; // > one maximal CHAT line
+
+// Read and handle replies until `until` (or once without blocking if it has
+// passed). Returns -1 once the connection is gone.
+static int pump(conn_t *c, rx_t *rx, uint64_t until) {
+    do {
+        uint64_t now = now_ns();
+        int ms = until > now ? (int)((until - now + 999999) / 1000000) : 0;
+        struct pollfd pf = { .fd = rx->fd, .events = POLLIN };
+        int pr = poll(&pf, 1, ms);
+        if (pr < 0) { if (errno == EINTR) continue; return -1; }
+        if (pr == 0) return 0;
+        ssize_t n = recv(rx->fd, rx->buf + rx->len, sizeof(rx->buf) - rx->len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        rx->len += (size_t)n;
+        now = now_ns();
+        char *s = rx->buf, *nl;
+        while ((nl = memchr(s, '\n', rx->len - (size_t)(s - rx->buf)))) {
+            on_line(c, s, (size_t)(nl - s), now);
+            s = nl + 1;
+        }
+        rx->len -= (size_t)(s - rx->buf);
+        memmove(rx->buf, s, rx->len);
+        if (rx->len == sizeof(rx->buf)) rx->len = 0; // drop an over-long line
+    } while (now_ns() < until);
+    return 0;
+}
+
+static int dial(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    struct sockaddr_in sa; memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET; sa.sin_port = htons((uint16_t)g_port);
+    if (inet_pton(AF_INET, g_ip, &sa.sin_addr) != 1 ||
+        connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) { close(fd); return -1; }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        off += (size_t)n;
+    }
+    return 0;
+}
+
+static void *conn_main(void *arg) {
+    conn_t *c = (conn_t *)arg;
+    rx_t *rx = calloc(1, sizeof(*rx));
+    c->sent_ns = calloc(c->nin + 1, sizeof(uint64_t));
+    c->echo_idx = calloc(c->nin + 1, sizeof(size_t));
+    if (!rx || !c->sent_ns || !c->echo_idx || (rx->fd = dial()) < 0) { c->failed = true; free(rx); return NULL; }
+    bool gone = false;
+    for (size_t i = 0; i < c->nin && !c->rejected; ++i) {
+        const tline_t *l = &c->in[i];
+        if (pump(c, rx, due_ns(l->t_us)) < 0) { gone = true; break; }
+        char tmp[4096];
+        const char *out = l->data;
+        size_t len = l->len;
+        if (l->cmd == C_RESUME && l->last) { len = token_rewrite(l, tmp, sizeof(tmp)); out = tmp; }
+        if (l->cmd == C_CHAT && l->last) { // the server echoes it back stripped of CR/LF
+            size_t bl = len;
+            while (bl && (out[bl - 1] == '\n' || out[bl - 1] == '\r')) bl--;
+            c->echo_q = grow(c->echo_q, &c->echo_cap, c->echo_len + bl + 1, 1);
+            memcpy(c->echo_q + c->echo_len, out, bl);
+            c->echo_q[c->echo_len + bl] = '\0';
+            c->echo_len += bl + 1;
+            c->echo_idx[c->necho++] = i;
+        }
+        c->sent_ns[i] = now_ns();
+        if (send_all(rx->fd, out, len) < 0) { gone = true; break; }
+    }
+    // Hold the connection as long as the capture did, then give outstanding
+    // replies a grace period.
+    if (!gone && !c->rejected && pump(c, rx, due_ns(c->close_us)) < 0) gone = true;
+    uint64_t give_up = now_ns() + g_grace_ns;
+    while (!gone && !c->rejected && (c->nrecv < c->nrep || c->echo_first < c->necho) && now_ns() < give_up) {
+        uint64_t step = now_ns() + 10000000ull;
+        if (pump(c, rx, step < give_up ? step : give_up) < 0) gone = true;
+    }
+    c->cut = gone && !c->rejected && (c->nrecv < c->nrep || c->echo_first < c->necho);
+    close(rx->fd);
+    free(rx);
+    return NULL;
+}
+
+// ---- Report ----
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(double secs) {
+    size_t lines = 0, cmds = 0, nconn = 0, failed = 0, rejected = 0, cut = 0;
+    size_t expected = 0, matched = 0, diverged = 0, missing = 0, extra = 0, nlat = 0;
+    for (size_t i = 0; i < nconns; ++i) {
+        conn_t *c = &conns[i];
+        if (!c->seen) continue;
+        nconn++;
+        failed += c->failed;
+        cut += c->cut;
+        rejected += c->rejected;
+        lines += c->nin;
+        for (size_t k = 0; k < c->nin; ++k) cmds += c->in[k].last;
+        expected += c->nrep;
+        matched += c->matched;
+        diverged += c->diverged;
+        extra += c->extra;
+        if (c->nrecv < c->nrep) missing += c->nrep - c->nrecv;
+        nlat += c->nlat;
+    }
+    printf("connections=%zu (failed %zu, rejected %zu, cut %zu)  lines=%zu commands=%zu in %.2fs  %.0f lines/s  %.0f commands/s\n",
+           nconn, failed, rejected, cut, lines, cmds, secs, lines / secs, cmds / secs);
+
+    uint64_t *v = malloc((nlat + 1) * sizeof(uint64_t));
+    if (!v) return;
+    printf("%-8s %8s %10s %10s %10s\n", "command", "samples", "p50", "p99", "max");
+    for (int k = 0; k < C_COUNT; ++k) {
+        size_t n = 0;
+        for (size_t i = 0; i < nconns; ++i)
+            for (size_t j = 0; j < conns[i].nlat; ++j)
+                if (conns[i].lat[j].cmd == k) v[n++] = conns[i].lat[j].ns;
+        if (!n) continue;
+        qsort(v, n, sizeof(uint64_t), cmp_u64);
+        printf("%-8s %8zu %8.1fus %8.1fus %8.1fus\n", cmd_name[k], n,
+               v[n / 2] / 1e3, v[(size_t)(n * 0.99)] / 1e3, v[n - 1] / 1e3);
+    }
+    free(v);
+
+    printf("replies: expected=%zu matched=%zu diverged=%zu missing=%zu extra=%zu\n",
+           expected, matched, diverged, missing, extra);
+    int shown = 0;
+    for (size_t i = 0; i < nconns && shown < SHOW_DIVERGED; ++i) {
+        if (!conns[i].seen || !conns[i].diverged) continue;
+        printf("  conn %u reply %d: %s\n", conns[i].id, conns[i].first_diff_k, conns[i].first_diff);
+        shown++;
+    }
+}
+
+int main(int argc, char **argv) {
+    bool dump = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:x:g:d")) != -1) {
+        switch (opt) {
+        case 's': g_ip = optarg; break;
+        case 'p': g_port = atoi(optarg); break;
+        case 'x': g_speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg); break;
+        case 'g': g_grace_ns = (uint64_t)atol(optarg) * 1000000ull; break;
+        case 'd': dump = true; break;
+        default: goto usage;
+        }
+    }
+    if (optind != argc - 1 || g_speed < 0) goto usage;
+    signal(SIGPIPE, SIG_IGN);
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) { perror(argv[optind]); return 1; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    uint8_t *buf = malloc(size > 0 ? (size_t)size : 1);
+    if (!buf || fread(buf, 1, (size_t)size, f) != (size_t)size) { perror("read"); return 1; }
+    fclose(f);
+    long recs = load_trace(buf, (size_t)size, dump);
+    if (recs < 0) { fprintf(stderr, "%s: not an XK3 trace\n", argv[optind]); return 1; }
+    if (dump) return 0;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    g_t0 = now_ns();
+    // Connection ids are assigned at open, so id order is open order.
+    for (size_t i = 0; i < nconns; ++i) {
+        conn_t *c = &conns[i];
+        if (!c->seen) continue;
+        sleep_until(due_ns(c->open_us));
+        if (pthread_create(&c->th, &attr, conn_main, c) != 0) { perror("pthread_create"); c->failed = true; c->seen = false; }
+    }
+    for (size_t i = 0; i < nconns; ++i) if (conns[i].seen) pthread_join(conns[i].th, NULL);
+    report((double)(now_ns() - g_t0) / 1e9);
+    return 0;
+
+usage:
+    fprintf(stderr, "usage: %s [-s ip] [-p port] [-x speed|max] [-g grace_ms] trace.bin\n"
+                    "       %s -d trace.bin\n", argv[0], argv[0]);
+    return 2;
+}
@@ -6,11 +6,51 @@
 //  - Two request types from client: BROADCAST + message, UNICAST <sockid> + message
 //  - Broadcast throttled: >= 5 seconds between a client's broadcasts, else "broadcast request denied!"
 //  - Every delivered message is prefixed with sender SockID (the socket FD)
+//  - UNICASTN <sockid> <len> + exactly <len> raw bytes: large-payload unicast.
+//    Target receives "[SockID n]: BLOB <len>\n" followed by the raw bytes; the
+//    body is relayed socket -> pipe -> socket with splice() and never copied
+//    into user space. A sender that stops for RELAY_STALL_MS or disconnects
+//    mid-body is cut off; the target gets the rest as zero bytes followed by
+//    "[SockID n]: BLOB ABORTED". A target that takes nothing for
+//    RELAY_STALL_MS is disconnected and the rest of the body discarded.
+//    Messages for the target that arrive during a relay are held and sent
+//    after it, up to RELAY_DEFER_MAX; STATS RELAY counts what was dropped.
+//  - Delivery latency tracing: receive/parse/lock/first-send/last-send points are
+//    timestamped per message into per-thread log-linear histograms. "STATS" from
+//    a loopback client, or SIGUSR1 (dumped to stdout), prints p50/p99/p999/max.
+//  - Low-latency mode (opt-in, XK3_LOWLAT=<cpu>): instead of one blocking thread
+//    per client, a single thread pinned to <cpu> drives all client sockets
+//    non-blocking with SO_BUSY_POLL/SO_PREFER_BUSY_POLL, spinning before it
+//    parks in poll(). UNICASTN is not available in this mode.
+//  - MULTICAST <sockid> [sockid ...] + message: one body to a set of SockIDs
+//    (up to MULTICAST_MAX), resolved under a single lock acquisition; the
+//    sender gets one "OK MULTICAST delivered=a queued=b dropped=c" reply.
+//  - Duplicate-content suppression: BROADCAST bodies are counted in a
+//    sliding-window count-min sketch; a body seen more than $XK3_SPAM_THRESHOLD
+//    times (default 3, 0 = off) in SPAM_WINDOW_S seconds is dropped before
+//    fan-out and the sender gets "broadcast suppressed (duplicate content)".
+//  - Overload: at capacity the accept loop stops polling the listener and
+//    resumes once the count falls to a low-water mark. Meanwhile queued
+//    connections are drained in batches every SHED_DRAIN_MS and each gets
+//    one precomputed "Server is full!" write. XK3_SHED_BACKLOG=<n> also
+//    shrinks the listen backlog while full so the kernel sheds the excess.
+//  - Store-and-forward: "SESSION" gives a connection a resume key
+//    ("SESSION <sockid> <key>"). When a connection that holds one leaves, a
+//    UNICAST or MULTICAST to its SockID is queued (in memory up to a budget,
+//    then in mmap'd spool segments under $XK3_SPOOL, default ./spool) until
+//    the fd number is reused or PQ_TTL_S pass. "RESUME <key>" on a later
+//    connection gets the backlog in one writev, then "OK RESUME <n>". Any
+//    other offline SockID gets the plain "not online" note. SockIDs are fds,
+//    so the number alone never names the same person twice: only the key
+//    does. Queue depths are part of STATS.
 
 #define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -18,23 +58,226 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
 #define PORT 5678
-#define MAX_CLIENTS 5
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 5           // override with -DMAX_CLIENTS=N for soak runs
+#endif
+#define CLIENT_STACK_SZ (256 * 1024) // per-client thread stack; default 8 MiB caps thread count
 #define BUF_SZ 2048
+#define LISTEN_BACKLOG 16
+#define LOW_WATER (MAX_CLIENTS > 8 ? MAX_CLIENTS - MAX_CLIENTS / 8 : MAX_CLIENTS - 1)
+#define ACCEPT_BATCH 64         // accept4() calls per listener wakeup
+#define SHED_DRAIN_MS 200       // backlog drain period while at capacity
+#define SHED_BATCH 256          // connections rejected per drain
+#define BLOB_MAX (256u << 20)   // UNICASTN payload cap (256 MiB)
+#define RELAY_PIPE_SZ (1 << 20) // requested pipe capacity for splice relays
+#define RELAY_STALL_MS 5000     // a UNICASTN sender or target idle this long is cut off mid-body
+#define RELAY_DEFER_MAX (256u << 10) // deliveries held per client while a relay owns its socket
+#define LL_BUSY_POLL_US 50      // SO_BUSY_POLL budget per socket in low-latency mode
+#define LL_SPINS 20000          // empty sweeps / EAGAIN retries before parking
+#define LL_PARK_MS 1            // poll() timeout once parked
+
+#define MULTICAST_MAX 128               // distinct SockIDs per MULTICAST
+#define SPAM_WINDOW_S 10                // duplicate-content window (two half-window generations)
+#define SPAM_DEPTH 4                    // count-min rows
+#define SPAM_WIDTH 4096                 // counters per row (power of two)
+#define PQ_MAX_TARGETS 256              // departed sessions with a pending queue
+#define PQ_TTL_S 300                    // a departed session's queue is dropped after this
+#define PQ_MEM_PER_TARGET (64u << 10)   // in-memory bytes per target before spilling
+#define PQ_MEM_TOTAL (16u << 20)        // in-memory bytes across all targets
+#define PQ_SEG_SZ (4u << 20)            // spool segment size
+#define PQ_DISK_PER_TARGET (64u << 20)  // spooled bytes per target
+#define PQ_DISK_TOTAL (1024ull << 20)   // spooled bytes across all targets
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69  // Linux 5.11+, may be missing from older headers
+#endif
 
 typedef struct {
     int fd;
     time_t last_broadcast; // last broadcast timestamp for rate limiting
     bool in_use;
+    pthread_mutex_t wr;    // serializes writes to fd (keeps blobs contiguous)
+    uint64_t key;          // SESSION resume key, 0 until asked for
+    int relays;            // UNICASTN relays into this slot started and not finished
+    char *defer;           // deliveries held meanwhile, sent when the relay ends
+    size_t defer_len, defer_cap;
 } client_t;
 
 static client_t clients[MAX_CLIENTS];
 static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static int devnull_fd = -1; // sink for blob bytes that have nowhere to go
+
+// Capacity tracking for the accept loop: maintained by add/remove_client so
+// the hot accept path never scans clients[].
+static unsigned n_online;
+static bool shedding;           // accept loop is not polling the listener
+static int shed_wake_fd = -1;   // eventfd: count fell to LOW_WATER while shedding
+static unsigned long long acc_accepted, acc_rejected, acc_shed_episodes;
+
+// ---- Delivery latency tracing ----
+// Each client thread owns a trace_t and is its only writer, so recording is
+// a handful of clock reads and plain stores. Readers (STATS / SIGUSR1) merge
+// all live threads plus the totals of exited ones under trace_mtx.
+//
+// Histograms are HDR-style log-linear: values < 16ns get exact buckets, above
+// that each power of two is split into 16 sub-buckets (~6% resolution).
+#define H_SUB_BITS 4
+#define H_SUB (1 << H_SUB_BITS)
+#define H_MAX_BIT 40                       // clamp at 2^40 ns (~18 min)
+#define H_BUCKETS ((H_MAX_BIT - H_SUB_BITS + 2) * H_SUB)
+
+typedef enum { MT_BROADCAST = 0, MT_UNICAST, MT_UNICASTN, MT_MULTICAST, MT_COUNT } msg_type_t;
+static const char *const mt_name[MT_COUNT] = { "BROADCAST", "UNICAST", "UNICASTN", "MULTICAST" };
+
+// Trace points, in order; spans are reported relative to TP_RECV.
+typedef enum { TP_RECV = 0, TP_PARSE, TP_LOCK, TP_FIRST, TP_LAST, TP_COUNT } trace_point_t;
+static const char *const tp_name[TP_COUNT] = { "recv", "parse", "lock", "first_send", "last_send" };
+
+typedef struct {
+    uint64_t n;
+    uint64_t max;
+    uint64_t b[H_BUCKETS];
+} hist_t;
+
+typedef struct trace {
+    hist_t h[MT_COUNT][TP_COUNT];   // [type][point], TP_RECV slot unused
+    struct trace *next;
+} trace_t;
+
+static pthread_mutex_t trace_mtx = PTHREAD_MUTEX_INITIALIZER;
+static trace_t *trace_live;          // registered per-thread blocks
+static trace_t trace_retired;        // merged totals of exited threads
+
+static __thread trace_t *tls_trace;
+static __thread uint64_t tls_tp[TP_COUNT]; // timestamps of the message in flight
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void trace_mark(trace_point_t tp) { tls_tp[tp] = now_ns(); }
+
+static inline unsigned hist_index(uint64_t v) {
+    if (v < H_SUB) return (unsigned)v;
+    unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+    if (msb > H_MAX_BIT) return H_BUCKETS - 1;
+    unsigned sub = (unsigned)(v >> (msb - H_SUB_BITS)) & (H_SUB - 1);
+    return (msb - H_SUB_BITS + 1) * H_SUB + sub;
+}
+
+// Lowest value that lands in bucket i (inverse of hist_index).
+static uint64_t hist_value(unsigned i) {
+    if (i < H_SUB) return i;
+    unsigned msb = i / H_SUB + H_SUB_BITS - 1;
+    return ((uint64_t)(H_SUB + i % H_SUB)) << (msb - H_SUB_BITS);
+}
+
+// Single writer: relaxed stores keep concurrent merges tear-free without
+// paying for a locked read-modify-write on the hot path.
+static inline void hist_add(hist_t *h, uint64_t v) {
+    unsigned i = hist_index(v);
+    __atomic_store_n(&h->b[i], h->b[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->n, h->n + 1, __ATOMIC_RELAXED);
+    if (v > h->max) __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+static void hist_merge(hist_t *dst, const hist_t *src) {
+    dst->n += __atomic_load_n(&src->n, __ATOMIC_RELAXED);
+    uint64_t m = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (m > dst->max) dst->max = m;
+    for (unsigned i = 0; i < H_BUCKETS; ++i)
+        dst->b[i] += __atomic_load_n(&src->b[i], __ATOMIC_RELAXED);
+}
+
+static uint64_t hist_percentile(const hist_t *h, double q) {
+    if (h->n == 0) return 0;
+    uint64_t want = (uint64_t)(q * (double)h->n);
+    if (want >= h->n) want = h->n - 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < H_BUCKETS; ++i) {
+        seen += h->b[i];
+        if (seen > want) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Called lazily on a thread's first traced message, so idle connections
+// carry no histogram memory.
+static void trace_thread_start(void) {
+    trace_t *t = (trace_t *)calloc(1, sizeof(*t));
+    if (!t) return; // tracing is best effort
+    pthread_mutex_lock(&trace_mtx);
+    t->next = trace_live;
+    trace_live = t;
+    pthread_mutex_unlock(&trace_mtx);
+    tls_trace = t;
+}
+
+static void trace_thread_end(void) {
+    trace_t *t = tls_trace;
+    if (!t) return;
+    pthread_mutex_lock(&trace_mtx);
+    for (trace_t **pp = &trace_live; *pp; pp = &(*pp)->next) {
+        if (*pp == t) { *pp = t->next; break; }
+    }
+    for (int m = 0; m < MT_COUNT; ++m)
+        for (int p = 0; p < TP_COUNT; ++p) hist_merge(&trace_retired.h[m][p], &t->h[m][p]);
+    pthread_mutex_unlock(&trace_mtx);
+    tls_trace = NULL;
+    free(t);
+}
+
+// Start a message: TP_RECV is taken when recv_line for the body completes.
+static inline void trace_begin(void) {
+    memset(tls_tp, 0, sizeof(tls_tp));
+    trace_mark(TP_RECV);
+}
+
+// Close out the message in flight; points that were never reached are skipped.
+static void trace_commit(msg_type_t mt) {
+    if (!tls_trace) trace_thread_start();
+    trace_t *t = tls_trace;
+    if (!t) return;
+    for (int p = TP_PARSE; p < TP_COUNT; ++p) {
+        if (tls_tp[p]) hist_add(&t->h[mt][p], tls_tp[p] - tls_tp[TP_RECV]);
+    }
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Spin-then-park wait for a non-blocking socket (low-latency mode). Blocking
+// sockets never hit EAGAIN, so the default mode never gets here.
+static void wait_fd(int fd, short events) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    for (int i = 0; i < LL_SPINS; ++i) {
+        if (poll(&pfd, 1, 0) > 0) return;
+        cpu_relax();
+    }
+    poll(&pfd, 1, LL_PARK_MS);
+}
 
 static void safe_send(int fd, const char *buf, size_t len) {
     size_t sent = 0;
@@ -42,6 +285,7 @@ static void safe_send(int fd, const char *buf, size_t len) {
         ssize_t n = send(fd, buf + sent, len - sent, 0);
         if (n < 0) {
             if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { wait_fd(fd, POLLOUT); continue; }
             break;
         }
         if (n == 0) break;
@@ -49,24 +293,97 @@ static void safe_send(int fd, const char *buf, size_t len) {
     }
 }
 
-static void send_line(int fd, const char *fmt, ...) {
-    char msg[BUF_SZ];
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(msg, sizeof(msg), fmt, ap);
-    va_end(ap);
+static size_t format_line(char msg[BUF_SZ], const char *fmt, va_list ap) {
+    vsnprintf(msg, BUF_SZ, fmt, ap);
     // Ensure newline termination as required
     size_t L = strlen(msg);
     if (L == 0 || msg[L - 1] != '\n') {
-        if (L + 1 < sizeof(msg)) {
+        if (L + 1 < BUF_SZ) {
             msg[L] = '\n';
             msg[L + 1] = '\0';
             L++;
         }
     }
+    return L;
+}
+
+static void send_line(int fd, const char *fmt, ...) {
+    char msg[BUF_SZ];
+    va_list ap;
+    va_start(ap, fmt);
+    size_t L = format_line(msg, fmt, ap);
+    va_end(ap);
     safe_send(fd, msg, L);
 }
 
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void pq_dump(int fd);
+static void pq_seal(int sockid);
+static void pq_depart(int sockid, uint64_t key);
+static void spam_dump(int fd);
+static void relay_dump(int fd);
+static void accept_dump(int fd);
+
+// Merge all per-thread histograms and print one line per (type, point).
+// Works for both sockets (STATS) and stdout (SIGUSR1).
+static void trace_dump(int fd) {
+    trace_t *sum = (trace_t *)malloc(sizeof(*sum));
+    if (!sum) return;
+    pthread_mutex_lock(&trace_mtx);
+    memcpy(sum, &trace_retired, sizeof(*sum));
+    for (trace_t *t = trace_live; t; t = t->next)
+        for (int m = 0; m < MT_COUNT; ++m)
+            for (int p = 0; p < TP_COUNT; ++p) hist_merge(&sum->h[m][p], &t->h[m][p]);
+    pthread_mutex_unlock(&trace_mtx);
+
+    char line[256];
+    for (int m = 0; m < MT_COUNT; ++m) {
+        for (int p = TP_PARSE; p < TP_COUNT; ++p) {
+            const hist_t *h = &sum->h[m][p];
+            if (h->n == 0) continue;
+            int L = snprintf(line, sizeof(line),
+                             "STATS %s %s n=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+                             mt_name[m], tp_name[p], (unsigned long long)h->n,
+                             hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.99) / 1e3,
+                             hist_percentile(h, 0.999) / 1e3, h->max / 1e3);
+            write_all(fd, line, (size_t)L);
+        }
+    }
+    pq_dump(fd);
+    spam_dump(fd);
+    relay_dump(fd);
+    accept_dump(fd);
+    write_all(fd, "STATS END\n", 10);
+    free(sum);
+}
+
+// SIGUSR1 is blocked in every thread and collected here, so the dump runs in
+// normal thread context rather than inside a signal handler.
+static void *stats_signal_thread(void *arg) {
+    sigset_t *set = (sigset_t *)arg;
+    while (1) {
+        int sig;
+        if (sigwait(set, &sig) == 0 && sig == SIGUSR1) trace_dump(STDOUT_FILENO);
+    }
+    return NULL;
+}
+
+static bool peer_is_loopback(int fd) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    if (getpeername(fd, (struct sockaddr *)&sa, &len) < 0 || sa.sin_family != AF_INET) return false;
+    return (ntohl(sa.sin_addr.s_addr) >> 24) == 127;
+}
+
 static ssize_t recv_line(int fd, char *out, size_t cap) {
     size_t pos = 0;
     while (pos + 1 < cap) {
@@ -84,13 +401,46 @@ static ssize_t recv_line(int fd, char *out, size_t cap) {
     return (ssize_t)pos;
 }
 
+// Caller holds mtx.
+static client_t *client_find(int fd) {
+    for (int i = 0; i < MAX_CLIENTS; ++i)
+        if (clients[i].in_use && clients[i].fd == fd) return &clients[i];
+    return NULL;
+}
+
+// The calling connection's own slot: registered before it is served and
+// its own until remove_client.
+static client_t *client_self(int fd) {
+    pthread_mutex_lock(&mtx);
+    client_t *c = client_find(fd);
+    pthread_mutex_unlock(&mtx);
+    return c;
+}
+
+// A reply to the client's own socket. Fan-out and relays write to it from
+// other threads under its wr lock, so replies take that lock too.
+static void reply_line(client_t *self, const char *fmt, ...) {
+    char msg[BUF_SZ];
+    va_list ap;
+    va_start(ap, fmt);
+    size_t L = format_line(msg, fmt, ap);
+    va_end(ap);
+    pthread_mutex_lock(&self->wr);
+    safe_send(self->fd, msg, L);
+    pthread_mutex_unlock(&self->wr);
+}
+
 static int add_client(int fd) {
+    if (__atomic_load_n(&n_online, __ATOMIC_RELAXED) >= MAX_CLIENTS) return -1;
     pthread_mutex_lock(&mtx);
     for (int i = 0; i < MAX_CLIENTS; ++i) {
         if (!clients[i].in_use) {
             clients[i].in_use = true;
             clients[i].fd = fd;
             clients[i].last_broadcast = 0;
+            clients[i].key = 0;
+            pq_seal(fd);
+            __atomic_add_fetch(&n_online, 1, __ATOMIC_RELAXED);
             pthread_mutex_unlock(&mtx);
             return 0;
         }
@@ -103,65 +453,672 @@ static void remove_client(int fd) {
     pthread_mutex_lock(&mtx);
     for (int i = 0; i < MAX_CLIENTS; ++i) {
         if (clients[i].in_use && clients[i].fd == fd) {
+            if (clients[i].key) pq_depart(fd, clients[i].key);
             clients[i].in_use = false;
             clients[i].fd = -1;
             clients[i].last_broadcast = 0;
+            free(clients[i].defer);
+            clients[i].defer = NULL;
+            clients[i].defer_len = clients[i].defer_cap = 0;
+            unsigned left = __atomic_sub_fetch(&n_online, 1, __ATOMIC_RELAXED);
+            if (left <= LOW_WATER && __atomic_load_n(&shedding, __ATOMIC_ACQUIRE)) {
+                uint64_t one = 1;
+                if (write(shed_wake_fd, &one, sizeof(one)) < 0) { /* counter saturated: already woken */ }
+            }
             break;
         }
     }
     pthread_mutex_unlock(&mtx);
 }
 
-static int online_count(void) {
-    int c = 0;
+// Outbound deliveries are built from iovecs instead of a formatted copy:
+// the sender's cached "[SockID n]: " prefix, the shared payload slice, and a
+// newline, sent with one sendmsg() per recipient.
+typedef struct {
+    char s[24];
+    size_t len;
+} sockid_hdr_t;
+
+static void sockid_hdr_init(sockid_hdr_t *h, int fd) {
+    h->len = (size_t)snprintf(h->s, sizeof(h->s), "[SockID %d]: ", fd);
+}
+
+static const char nl[1] = { '\n' };
+
+// sendmsg() until every iovec is written; the caller's iov array is consumed.
+static bool safe_sendmsg(int fd, struct iovec *iov, int cnt, int flags) {
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = (size_t)cnt;
+    while (mh.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &mh, flags);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) { wait_fd(fd, POLLOUT); continue; }
+            return false;
+        }
+        if (n == 0) return false;
+        // Advance past fully written iovecs, then into the partial one
+        while (mh.msg_iovlen > 0 && (size_t)n >= mh.msg_iov->iov_len) {
+            n -= (ssize_t)mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (n > 0) {
+            mh.msg_iov->iov_base = (char *)mh.msg_iov->iov_base + n;
+            mh.msg_iov->iov_len -= (size_t)n;
+        }
+    }
+    return true;
+}
+
+static void send_prefixed(int fd, const sockid_hdr_t *h, const char *payload, size_t len) {
+    struct iovec iov[3] = {
+        { (void *)h->s, h->len },
+        { (void *)payload, len },
+        { (void *)nl, sizeof(nl) },
+    };
+    safe_sendmsg(fd, iov, 3, 0);
+}
+
+static void pq_append(char *dst, const sockid_hdr_t *h, const char *payload, size_t len) {
+    memcpy(dst, h->s, h->len);
+    memcpy(dst + h->len, payload, len);
+    dst[h->len + len] = '\n';
+}
+
+static unsigned long long relay_stat_blobs, relay_stat_sender_cut, relay_stat_target_cut;
+static unsigned long long relay_stat_deferred, relay_stat_defer_dropped;
+
+// Caller holds mtx. While a UNICASTN relay owns c's socket its wr lock may
+// be held for up to RELAY_STALL_MS per stalled step, so fan-out must not
+// wait on it: the message is kept in c->defer instead (false, and counted,
+// if that is full).
+static bool defer_push(client_t *c, const sockid_hdr_t *h, const char *payload, size_t len) {
+    size_t need = h->len + len + 1;
+    if (c->defer_len + need > c->defer_cap) {
+        size_t cap = c->defer_cap ? c->defer_cap * 2 : 4096;
+        while (cap < c->defer_len + need) cap *= 2;
+        char *d = c->defer_len + need > RELAY_DEFER_MAX ? NULL : (char *)realloc(c->defer, cap);
+        if (!d) { __atomic_add_fetch(&relay_stat_defer_dropped, 1, __ATOMIC_RELAXED); return false; }
+        c->defer = d;
+        c->defer_cap = cap;
+    }
+    pq_append(c->defer + c->defer_len, h, payload, len);
+    c->defer_len += need;
+    __atomic_add_fetch(&relay_stat_deferred, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static void broadcast_all_prefixed(const sockid_hdr_t *h, const char *payload, size_t len) {
     pthread_mutex_lock(&mtx);
-    for (int i = 0; i < MAX_CLIENTS; ++i) if (clients[i].in_use) c++;
+    trace_mark(TP_LOCK);
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        if (!clients[i].in_use) continue;
+        if (clients[i].relays) {
+            defer_push(&clients[i], h, payload, len);
+            continue;
+        }
+        pthread_mutex_lock(&clients[i].wr);
+        send_prefixed(clients[i].fd, h, payload, len);
+        pthread_mutex_unlock(&clients[i].wr);
+        if (!tls_tp[TP_FIRST]) trace_mark(TP_FIRST);
+    }
+    trace_mark(TP_LAST);
     pthread_mutex_unlock(&mtx);
-    return c;
 }
 
-static void broadcast_all_prefixed(int sender_fd, const char *payload) {
-    char line[BUF_SZ];
-    snprintf(line, sizeof(line), "[SockID %d]: %s", sender_fd, payload);
-    // Make sure ends with '\n'
-    size_t L = strlen(line);
-    if (L == 0 || line[L - 1] != '\n') {
-        if (L + 1 < sizeof(line)) {
-            line[L] = '\n';
-            line[L + 1] = '\0';
+// ---- Store-and-forward queues for departed sessions ----
+// A queue belongs to one departed connection, named by its SESSION key; its
+// SockID only routes new messages to it, and only while the fd number has
+// not been given to another connection (open).
+// Messages are stored fully formatted ("[SockID s]: body\n") so a flush is a
+// single writev of the memory buffer followed by every spool segment. A
+// target's bytes live in memory until its per-target or the global memory
+// budget is hit; from then on they are appended to mmap'd segment files,
+// which keeps the order (memory first, then segments) intact. Segments are
+// unlinked right after creation: they are disk-backed scratch, not a
+// durable store, and vanish with the process.
+typedef struct {
+    char *base;     // mmap'd PQ_SEG_SZ bytes
+    size_t used;
+} pq_seg_t;
+
+typedef struct pending_q {
+    int sockid;             // SockID of the departed connection
+    bool open;              // still takes messages sent to sockid
+    uint64_t key;           // its SESSION key; RESUME <key> claims the queue
+    time_t gone;            // departure; the queue expires PQ_TTL_S later
+    char *mem;              // in-memory part, grows up to PQ_MEM_PER_TARGET
+    size_t mem_len, mem_cap;
+    pq_seg_t segs[PQ_DISK_PER_TARGET / PQ_SEG_SZ];
+    int nsegs;
+    size_t disk_len;
+    unsigned msgs;
+    struct pending_q *next;
+} pending_q_t;
+
+static pthread_mutex_t q_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pending_q_t *pq_list;
+static unsigned pq_targets;     // read without q_mtx as a fast-path hint
+static size_t pq_mem_total;
+static unsigned long long pq_disk_total;
+static unsigned long long pq_stat_queued, pq_stat_spilled, pq_stat_flushed, pq_stat_dropped, pq_stat_expired;
+static const char *pq_spool_dir = "./spool";
+
+static pending_q_t *pq_find(int sockid) {
+    for (pending_q_t *q = pq_list; q; q = q->next)
+        if (q->open && q->sockid == sockid) return q;
+    return NULL;
+}
+
+static void pq_free(pending_q_t *q) {
+    for (int i = 0; i < q->nsegs; ++i) munmap(q->segs[i].base, PQ_SEG_SZ);
+    free(q->mem);
+    free(q);
+}
+
+// Unlink *pp from pq_list and take it out of the totals. Caller holds q_mtx.
+static pending_q_t *pq_unlink(pending_q_t **pp) {
+    pending_q_t *q = *pp;
+    *pp = q->next;
+    __atomic_store_n(&pq_targets, pq_targets - 1, __ATOMIC_RELAXED);
+    pq_mem_total -= q->mem_cap;
+    pq_disk_total -= q->disk_len;
+    return q;
+}
+
+// Drop queues whose session left more than PQ_TTL_S ago. Caller holds q_mtx.
+static void pq_expire(time_t now) {
+    for (pending_q_t **pp = &pq_list; *pp; ) {
+        if (now - (*pp)->gone < PQ_TTL_S) { pp = &(*pp)->next; continue; }
+        pending_q_t *q = pq_unlink(pp);
+        pq_stat_expired += q->msgs;
+        pq_free(q);
+    }
+}
+
+// A connection with SESSION key `key` left: messages to its SockID queue up
+// from now on. Called under mtx.
+static void pq_depart(int sockid, uint64_t key) {
+    pthread_mutex_lock(&q_mtx);
+    pq_expire(time(NULL));
+    pending_q_t *q = pq_targets < PQ_MAX_TARGETS ? (pending_q_t *)calloc(1, sizeof(*q)) : NULL;
+    if (q) {
+        q->sockid = sockid;
+        q->open = true;
+        q->key = key;
+        q->gone = time(NULL);
+        q->next = pq_list;
+        pq_list = q;
+        __atomic_store_n(&pq_targets, pq_targets + 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&q_mtx);
+}
+
+// fd was just given to a new connection: what is sent to it now is the new
+// connection's, so the departed session's queue stops taking messages (it
+// can still be resumed). Called under mtx.
+static void pq_seal(int sockid) {
+    if (!__atomic_load_n(&pq_targets, __ATOMIC_RELAXED)) return;
+    pthread_mutex_lock(&q_mtx);
+    for (pending_q_t *q = pq_list; q; q = q->next)
+        if (q->sockid == sockid) q->open = false;
+    pthread_mutex_unlock(&q_mtx);
+}
+
+static bool pq_new_seg(pending_q_t *q) {
+    if (q->nsegs == (int)(sizeof(q->segs) / sizeof(q->segs[0]))) return false;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/q%d-%d-%d.seg", pq_spool_dir, (int)getpid(), q->sockid, q->nsegs);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) { perror("open spool segment"); return false; }
+    unlink(path);
+    void *base = MAP_FAILED;
+    if (ftruncate(fd, PQ_SEG_SZ) == 0)
+        base = mmap(NULL, PQ_SEG_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) { perror("spool segment"); return false; }
+    q->segs[q->nsegs].base = (char *)base;
+    q->segs[q->nsegs].used = 0;
+    q->nsegs++;
+    return true;
+}
+
+// Queue one message for an offline target; false unless a session that
+// left with that SockID is still waiting for it. Caller holds q_mtx.
+static bool pq_push(int sockid, const sockid_hdr_t *h, const char *payload, size_t len) {
+    size_t need = h->len + len + 1;
+    if (!pq_targets) return false;
+    pq_expire(time(NULL));
+    pending_q_t *q = pq_find(sockid);
+    if (!q) return false;
+
+    // Memory first, but never once spilling has started (keeps order)
+    if (q->nsegs == 0 && q->mem_len + need <= PQ_MEM_PER_TARGET && pq_mem_total + need <= PQ_MEM_TOTAL) {
+        if (q->mem_len + need > q->mem_cap) {
+            size_t cap = q->mem_cap ? q->mem_cap * 2 : 4096;
+            while (cap < q->mem_len + need) cap *= 2;
+            if (cap > PQ_MEM_PER_TARGET) cap = PQ_MEM_PER_TARGET;
+            char *m = (char *)realloc(q->mem, cap);
+            if (!m) return false;
+            pq_mem_total += cap - q->mem_cap;
+            q->mem = m;
+            q->mem_cap = cap;
         }
+        pq_append(q->mem + q->mem_len, h, payload, len);
+        q->mem_len += need;
+    } else {
+        if (q->disk_len + need > PQ_DISK_PER_TARGET || pq_disk_total + need > PQ_DISK_TOTAL) return false;
+        pq_seg_t *sg = q->nsegs ? &q->segs[q->nsegs - 1] : NULL;
+        if (!sg || sg->used + need > PQ_SEG_SZ) {
+            if (!pq_new_seg(q)) return false;
+            sg = &q->segs[q->nsegs - 1];
+        }
+        pq_append(sg->base + sg->used, h, payload, len);
+        sg->used += need;
+        q->disk_len += need;
+        pq_disk_total += need;
+        pq_stat_spilled++;
     }
+    q->msgs++;
+    pq_stat_queued++;
+    return true;
+}
+
+// RESUME: hand the queue of the session with `key` to connection c in one
+// batched writev. Returns the messages delivered, -1 if no queue has that key.
+static int pq_resume(client_t *c, uint64_t key) {
+    pending_q_t *q = NULL;
+    pthread_mutex_lock(&q_mtx);
+    pq_expire(time(NULL));
+    for (pending_q_t **pp = &pq_list; *pp; pp = &(*pp)->next) {
+        if ((*pp)->key == key) {
+            q = pq_unlink(pp);
+            pq_stat_flushed += q->msgs;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q_mtx);
+    if (!q) return -1;
+
+    struct iovec iov[1 + sizeof(q->segs) / sizeof(q->segs[0])];
+    int n = 0, msgs = (int)q->msgs;
+    if (q->mem_len) iov[n++] = (struct iovec){ q->mem, q->mem_len };
+    for (int i = 0; i < q->nsegs; ++i) iov[n++] = (struct iovec){ q->segs[i].base, q->segs[i].used };
+    pthread_mutex_lock(&c->wr);
+    if (n) safe_sendmsg(c->fd, iov, n, 0);
+    pthread_mutex_unlock(&c->wr);
+    pq_free(q);
+    return msgs;
+}
+
+// SESSION: c's resume key, made on first use; 0 if no random bytes.
+static uint64_t session_key(client_t *c) {
     pthread_mutex_lock(&mtx);
+    if (!c->key && (getrandom(&c->key, sizeof(c->key), 0) != (ssize_t)sizeof(c->key))) c->key = 0;
+    uint64_t key = c->key;
+    pthread_mutex_unlock(&mtx);
+    return key;
+}
+
+static void pq_dump(int fd) {
+    char line[256];
+    pthread_mutex_lock(&q_mtx);
+    int L = snprintf(line, sizeof(line),
+                     "STATS QUEUE targets=%u mem=%zu disk=%llu queued=%llu spilled=%llu flushed=%llu dropped=%llu expired=%llu\n",
+                     pq_targets, pq_mem_total, pq_disk_total, pq_stat_queued, pq_stat_spilled,
+                     pq_stat_flushed, pq_stat_dropped, pq_stat_expired);
+    write_all(fd, line, (size_t)L);
+    for (pending_q_t *q = pq_list; q; q = q->next) {
+        L = snprintf(line, sizeof(line), "STATS QUEUE sockid=%d open=%d age=%lds msgs=%u mem=%zu disk=%zu segs=%d\n",
+                     q->sockid, (int)q->open, (long)(time(NULL) - q->gone), q->msgs, q->mem_len, q->disk_len, q->nsegs);
+        write_all(fd, line, (size_t)L);
+    }
+    pthread_mutex_unlock(&q_mtx);
+}
+
+typedef enum { UC_DELIVERED = 0, UC_QUEUED, UC_DROPPED } unicast_rc_t;
+
+static unicast_rc_t send_to_sockid_prefixed(const sockid_hdr_t *h, int target_fd, const char *payload, size_t len) {
+    unicast_rc_t rc = UC_DROPPED;
+    bool found = false;
+    pthread_mutex_lock(&mtx);
+    trace_mark(TP_LOCK);
     for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].in_use) {
-            safe_send(clients[i].fd, line, strlen(line));
+        if (clients[i].in_use && clients[i].fd == target_fd) {
+            found = true;
+            if (clients[i].relays) {
+                rc = defer_push(&clients[i], h, payload, len) ? UC_DELIVERED : UC_DROPPED;
+                break;
+            }
+            pthread_mutex_lock(&clients[i].wr);
+            send_prefixed(clients[i].fd, h, payload, len);
+            pthread_mutex_unlock(&clients[i].wr);
+            trace_mark(TP_FIRST);
+            tls_tp[TP_LAST] = tls_tp[TP_FIRST];
+            rc = UC_DELIVERED;
+            break;
         }
     }
+    if (!found) {
+        pthread_mutex_lock(&q_mtx);
+        if (pq_push(target_fd, h, payload, len)) rc = UC_QUEUED;
+        else pq_stat_dropped++;
+        pthread_mutex_unlock(&q_mtx);
+    }
     pthread_mutex_unlock(&mtx);
+    return rc;
 }
 
-static bool send_to_sockid_prefixed(int sender_fd, int target_fd, const char *payload) {
-    bool ok = false;
-    char line[BUF_SZ];
-    snprintf(line, sizeof(line), "[SockID %d]: %s", sender_fd, payload);
-    size_t L = strlen(line);
-    if (L == 0 || line[L - 1] != '\n') {
-        if (L + 1 < sizeof(line)) {
-            line[L] = '\n';
-            line[L + 1] = '\0';
-            L++;
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+// Parse "<id> [id ...]" into a sorted, de-duplicated set. Returns the set
+// size, or -1 if it is empty, malformed or larger than cap.
+static int parse_sockid_set(const char *p, int *out, int cap) {
+    int n = 0;
+    while (1) {
+        while (*p == ' ') p++;
+        if (!*p) break;
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < 0 || v > 0x7fffffff || n == cap) return -1;
+        out[n++] = (int)v;
+        p = end;
+    }
+    if (n == 0) return -1;
+    qsort(out, (size_t)n, sizeof(int), cmp_int);
+    int k = 1;
+    for (int i = 1; i < n; ++i) if (out[i] != out[k - 1]) out[k++] = out[i];
+    return k;
+}
+
+typedef struct {
+    int delivered, queued, dropped;
+} multicast_result_t;
+
+// One lock acquisition for the whole set: a single pass over clients[]
+// matches online targets by binary search in the sorted set; the rest go
+// through the store-and-forward queues. All recipients share one iovec
+// payload (cached header + body slice + newline).
+static multicast_result_t multicast_prefixed(const sockid_hdr_t *h, const int *set, int k,
+                                             const char *payload, size_t len) {
+    multicast_result_t r = { 0, 0, 0 };
+    bool online[MULTICAST_MAX] = { false };
+    pthread_mutex_lock(&mtx);
+    trace_mark(TP_LOCK);
+    for (int i = 0; i < MAX_CLIENTS && r.delivered + r.dropped < k; ++i) {
+        if (!clients[i].in_use) continue;
+        const int *hit = (const int *)bsearch(&clients[i].fd, set, (size_t)k, sizeof(int), cmp_int);
+        if (!hit) continue;
+        online[hit - set] = true;
+        if (clients[i].relays) {
+            if (defer_push(&clients[i], h, payload, len)) r.delivered++;
+            else r.dropped++;
+            continue;
+        }
+        pthread_mutex_lock(&clients[i].wr);
+        send_prefixed(clients[i].fd, h, payload, len);
+        pthread_mutex_unlock(&clients[i].wr);
+        if (!tls_tp[TP_FIRST]) trace_mark(TP_FIRST);
+        r.delivered++;
+    }
+    trace_mark(TP_LAST);
+    if (r.delivered + r.dropped < k) {
+        pthread_mutex_lock(&q_mtx);
+        for (int j = 0; j < k; ++j) {
+            if (online[j]) continue;
+            if (pq_push(set[j], h, payload, len)) r.queued++;
+            else { r.dropped++; pq_stat_dropped++; }
         }
+        pthread_mutex_unlock(&q_mtx);
     }
+    pthread_mutex_unlock(&mtx);
+    return r;
+}
+
+// Move exactly `len` bytes from src_fd to dst_fd through pipe p[] with
+// splice(); the payload never enters user space. Sockets are blocking, so a
+// full target send buffer stalls the splice-out, which stops us draining the
+// sender and lets TCP flow control push back on it. If the target fails
+// mid-relay the rest is drained into /dev/null so the sender's stream stays
+// framed. Returns 0 on success, 1 if the target failed, -1 if the sender did;
+// then *owed is what the target was still due (0 if it had failed too).
+static int splice_relay(int src_fd, int dst_fd, int p[2], size_t len, size_t *owed) {
+    int rc = 0;
+    if (dst_fd < 0) { dst_fd = devnull_fd; rc = 1; }
+    while (len > 0) {
+        *owed = dst_fd == devnull_fd ? 0 : len;
+        size_t chunk = len < RELAY_PIPE_SZ ? len : RELAY_PIPE_SZ;
+        ssize_t in = splice(src_fd, NULL, p[1], NULL, chunk,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == 0) return -1;      // sender closed mid-body
+        if (in < 0) {
+            if (errno == EINTR) continue;
+            return -1;               // includes the RELAY_STALL_MS receive timeout
+        }
+        len -= (size_t)in;
+        while (in > 0) {
+            ssize_t out = splice(p[0], NULL, dst_fd, NULL, (size_t)in,
+                                 SPLICE_F_MOVE | (len ? SPLICE_F_MORE : 0));
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) {
+                if (dst_fd == devnull_fd) return -1;
+                dst_fd = devnull_fd; // target gone: discard the remainder
+                rc = 1;
+                continue;
+            }
+            in -= out;
+        }
+    }
+    return rc;
+}
+
+// The sender failed with `owed` body bytes still due: zero-fill them so the
+// target's stream stays framed, then tell it the blob is void.
+static void relay_abort(const sockid_hdr_t *h, int target_fd, size_t owed) {
+    static const char zeros[64 << 10];
+    while (owed > 0) {
+        ssize_t n = send(target_fd, zeros, owed < sizeof(zeros) ? owed : sizeof(zeros), MSG_MORE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        owed -= (size_t)n;
+    }
+    static const char aborted[] = "BLOB ABORTED";
+    send_prefixed(target_fd, h, aborted, sizeof(aborted) - 1);
+}
+
+// SO_RCVTIMEO on the sender, SO_SNDTIMEO on the target; 0 clears it.
+static void relay_timeout(int fd, int opt, int ms) {
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, opt, &tv, sizeof(tv));
+}
+
+static void relay_dump(int fd) {
+    char line[200];
+    int L = snprintf(line, sizeof(line),
+                     "STATS RELAY blobs=%llu sender_cut=%llu target_cut=%llu deferred=%llu defer_dropped=%llu\n",
+                     __atomic_load_n(&relay_stat_blobs, __ATOMIC_RELAXED),
+                     __atomic_load_n(&relay_stat_sender_cut, __ATOMIC_RELAXED),
+                     __atomic_load_n(&relay_stat_target_cut, __ATOMIC_RELAXED),
+                     __atomic_load_n(&relay_stat_deferred, __ATOMIC_RELAXED),
+                     __atomic_load_n(&relay_stat_defer_dropped, __ATOMIC_RELAXED));
+    write_all(fd, line, (size_t)L);
+}
+
+// UNICASTN: write the prefixed header to the target, then splice the body.
+// The target's write lock is held for the whole relay so nothing can
+// interleave into the blob. relays > 0 tells fan-out, which runs under the
+// global lock, to defer to dst->defer rather than wait for it; the global
+// lock itself is only held for the lookup and the hand-back. Either side is
+// cut off after RELAY_STALL_MS without progress: a stalled sender as in
+// relay_abort(), a stalled target by shutting its connection down, since
+// its stream now ends mid-blob; what was held for it is dropped then.
+static int relay_blob_to_sockid(const sockid_hdr_t *h, int sender_fd, int target_fd, int p[2], size_t len) {
+    size_t owed = 0;
+    pthread_mutex_lock(&mtx);
+    client_t *dst = client_find(target_fd);
+    if (dst) dst->relays++;
+    pthread_mutex_unlock(&mtx);
+    trace_mark(TP_LOCK);
+
+    __atomic_add_fetch(&relay_stat_blobs, 1, __ATOMIC_RELAXED);
+    if (!dst) return splice_relay(sender_fd, -1, p, len, &owed);
+
+    pthread_mutex_lock(&dst->wr);
+    relay_timeout(target_fd, SO_SNDTIMEO, RELAY_STALL_MS);
+    char blob[32];
+    struct iovec iov[2] = {
+        { (void *)h->s, h->len },
+        { blob, (size_t)snprintf(blob, sizeof(blob), "BLOB %zu\n", len) },
+    };
+    bool hdr_ok = safe_sendmsg(target_fd, iov, 2, MSG_MORE);
+    trace_mark(TP_FIRST);
+    relay_timeout(sender_fd, SO_RCVTIMEO, RELAY_STALL_MS);
+    int rc = splice_relay(sender_fd, hdr_ok ? target_fd : -1, p, len, &owed);
+    relay_timeout(sender_fd, SO_RCVTIMEO, 0);
+    if (rc < 0) __atomic_add_fetch(&relay_stat_sender_cut, 1, __ATOMIC_RELAXED);
+    if (rc < 0 && owed) relay_abort(h, target_fd, owed);
+    bool target_cut = rc > 0 || (rc < 0 && !owed); // owed is 0 once the target has failed
+    if (target_cut) {
+        shutdown(target_fd, SHUT_RDWR); // its thread sees EOF and cleans up
+        __atomic_add_fetch(&relay_stat_target_cut, 1, __ATOMIC_RELAXED);
+    }
+    trace_mark(TP_LAST);
+
+    // Hand the socket back: what fan-out held meanwhile goes out first. The
+    // slot may have been reused by then, so send to whoever holds it now.
+    pthread_mutex_lock(&mtx);
+    dst->relays--;
+    char *held = dst->defer;
+    size_t held_len = dst->defer_len;
+    int fd = dst->fd;
+    dst->defer = NULL;
+    dst->defer_len = dst->defer_cap = 0;
+    pthread_mutex_unlock(&mtx);
+    if (held_len && fd >= 0 && !(target_cut && fd == target_fd)) {
+        safe_send(fd, held, held_len); // still under the target's SO_SNDTIMEO
+    } else if (held_len) {
+        unsigned long long n = 0;
+        for (const char *q = held; (q = (const char *)memchr(q, '\n', held_len - (size_t)(q - held))); ++q) ++n;
+        __atomic_add_fetch(&relay_stat_defer_dropped, n, __ATOMIC_RELAXED);
+    }
+    free(held);
+    relay_timeout(target_fd, SO_SNDTIMEO, 0);
+    pthread_mutex_unlock(&dst->wr);
+    return rc;
+}
+
+// Rate limit check: >= 5 seconds between a client's broadcasts.
+static bool broadcast_allowed(int fd) {
+    time_t now = time(NULL);
+    bool deny = false;
+
     pthread_mutex_lock(&mtx);
     for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].in_use && clients[i].fd == target_fd) {
-            safe_send(clients[i].fd, line, L);
-            ok = true;
+        if (clients[i].in_use && clients[i].fd == fd) {
+            if (clients[i].last_broadcast != 0 &&
+                (now - clients[i].last_broadcast) < 5) {
+                deny = true;
+            } else {
+                clients[i].last_broadcast = now;
+            }
             break;
         }
     }
     pthread_mutex_unlock(&mtx);
-    return ok;
+    return !deny;
+}
+
+// ---- Duplicate-content suppression (count-min sketch) ----
+// Two generations, each covering half the window; an estimate is the sum of
+// the current and previous generation, which approximates a sliding window.
+// Counters are updated with relaxed atomics, so the check takes no lock. A
+// stale generation is recycled by whichever thread wins the CAS that marks
+// its epoch SPAM_CLEARING; it zeroes the counters and only then publishes the
+// new epoch. Until then nobody counts against it or reads it as the previous
+// half-window, so a recycled generation never carries old counts: increments
+// racing with the reset may be lost, which only makes the sketch under-count
+// (it never suppresses content it has not seen often enough).
+// Memory is fixed: SPAM_DEPTH * SPAM_WIDTH * 2 counters.
+#define SPAM_CLEARING UINT64_MAX
+typedef struct {
+    uint64_t epoch;     // half-window index this generation counts
+    uint32_t c[SPAM_DEPTH][SPAM_WIDTH];
+} spam_gen_t;
+
+static spam_gen_t spam_gen[2];
+static unsigned spam_threshold = 3;
+static unsigned long long spam_checked, spam_suppressed;
+
+// 64-bit multiply-xorshift hash over 8-byte words (unaligned-safe).
+static uint64_t body_hash(const char *p, size_t len) {
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t h = len * k;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ (w * k)) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+        p += 8;
+        len -= 8;
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, len);
+    h = (h ^ (w * k)) * 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 29);
+}
+
+// The generation counting `epoch`, or NULL while another thread clears it.
+static spam_gen_t *spam_generation(uint64_t epoch) {
+    spam_gen_t *g = &spam_gen[epoch & 1];
+    uint64_t seen = __atomic_load_n(&g->epoch, __ATOMIC_ACQUIRE);
+    if (seen == epoch) return g;
+    if (seen > epoch) return NULL; // being cleared: SPAM_CLEARING is above every epoch
+    if (!__atomic_compare_exchange_n(&g->epoch, &seen, SPAM_CLEARING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return seen == epoch ? g : NULL; // another thread won the reset
+    for (unsigned d = 0; d < SPAM_DEPTH; ++d)
+        for (unsigned i = 0; i < SPAM_WIDTH; ++i) __atomic_store_n(&g->c[d][i], 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&g->epoch, epoch, __ATOMIC_RELEASE);
+    return g;
+}
+
+// Count this body and report whether it may be broadcast.
+static bool spam_allowed(const char *payload, size_t len) {
+    if (spam_threshold == 0) return true;
+    __atomic_add_fetch(&spam_checked, 1, __ATOMIC_RELAXED);
+
+    uint64_t epoch = (uint64_t)time(NULL) / (SPAM_WINDOW_S / 2);
+    spam_gen_t *cur = spam_generation(epoch);
+    if (!cur) return true; // not counted: an under-count, never a false suppression
+    spam_gen_t *prev = &spam_gen[(epoch - 1) & 1];
+    bool prev_live = __atomic_load_n(&prev->epoch, __ATOMIC_ACQUIRE) == epoch - 1;
+
+    uint64_t h = body_hash(payload, len);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    uint32_t est = UINT32_MAX;
+    for (unsigned d = 0; d < SPAM_DEPTH; ++d) {
+        unsigned col = (h1 + d * h2) & (SPAM_WIDTH - 1);
+        uint32_t v = __atomic_add_fetch(&cur->c[d][col], 1, __ATOMIC_RELAXED);
+        if (prev_live) v += __atomic_load_n(&prev->c[d][col], __ATOMIC_RELAXED);
+        if (v < est) est = v;
+    }
+    if (est <= spam_threshold) return true;
+    __atomic_add_fetch(&spam_suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+static void spam_dump(int fd) {
+    char line[160];
+    int L = snprintf(line, sizeof(line), "STATS SPAM threshold=%u window=%ds checked=%llu suppressed=%llu\n",
+                     spam_threshold, SPAM_WINDOW_S,
+                     __atomic_load_n(&spam_checked, __ATOMIC_RELAXED),
+                     __atomic_load_n(&spam_suppressed, __ATOMIC_RELAXED));
+    write_all(fd, line, (size_t)L);
 }
 
 typedef struct {
@@ -174,8 +1131,12 @@ static void *client_thread(void *arg) {
     free(t);
 
     char buf[BUF_SZ];
+    int relay_pipe[2] = { -1, -1 }; // created on first UNICASTN
+    sockid_hdr_t hdr;                // "[SockID n]: " prefix for everything we send
+    sockid_hdr_init(&hdr, cfd);
+    client_t *self = client_self(cfd);
     // Announce connection info (optional)
-    // send_line(cfd, "Welcome. Your SockID is %d", cfd);
+    // reply_line(self, "Welcome. Your SockID is %d", cfd);
 
     while (1) {
         ssize_t n = recv_line(cfd, buf, sizeof(buf));
@@ -189,33 +1150,46 @@ static void *client_thread(void *arg) {
             char msg[BUF_SZ];
             ssize_t m = recv_line(cfd, msg, sizeof(msg));
             if (m <= 0) break;
-            if (m > 0 && msg[m - 1] == '\n') msg[m - 1] = '\0';
-
-            // Rate limit check
-            time_t now = time(NULL);
-            bool deny = false;
-
-            pthread_mutex_lock(&mtx);
-            for (int i = 0; i < MAX_CLIENTS; ++i) {
-                if (clients[i].in_use && clients[i].fd == cfd) {
-                    if (clients[i].last_broadcast != 0 &&
-                        (now - clients[i].last_broadcast) < 5) {
-                        deny = true;
-                    } else {
-                        clients[i].last_broadcast = now;
-                    }
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&mtx);
+            trace_begin();
+            if (m > 0 && msg[m - 1] == '\n') msg[--m] = '\0';
+            trace_mark(TP_PARSE);
 
-            if (deny) {
-                send_line(cfd, "broadcast request denied!");
+            if (!broadcast_allowed(cfd)) {
+                reply_line(self, "broadcast request denied!");
+                continue;
+            }
+            if (!spam_allowed(msg, (size_t)m)) {
+                reply_line(self, "broadcast suppressed (duplicate content)");
                 continue;
             }
 
             // Deliver to all (including sender), prefixed with sender SockID
-            broadcast_all_prefixed(cfd, msg);
+            broadcast_all_prefixed(&hdr, msg, (size_t)m);
+            trace_commit(MT_BROADCAST);
+        } else if (strncmp(buf, "UNICASTN", 8) == 0) {
+            // Expect: "UNICASTN <sockid> <len>" then exactly <len> raw bytes
+            trace_begin();
+            int target = -1;
+            unsigned long long len = 0;
+            int fields = sscanf(buf + 8, "%d %llu", &target, &len);
+            trace_mark(TP_PARSE);
+            if (fields != 2 || len > BLOB_MAX) {
+                // Body length unknown or too large: cannot stay framed
+                reply_line(self, "FAIL UNICASTN: usage UNICASTN <sockid> <len> (len <= %u)", BLOB_MAX);
+                break;
+            }
+            if (relay_pipe[0] < 0) {
+                if (pipe2(relay_pipe, O_CLOEXEC) < 0) {
+                    perror("pipe2");
+                    break;
+                }
+                fcntl(relay_pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SZ); // best effort
+            }
+
+            int rc = relay_blob_to_sockid(&hdr, cfd, target, relay_pipe, (size_t)len);
+            if (rc < 0) break;
+            trace_commit(MT_UNICASTN);
+            if (rc > 0) reply_line(self, "note: target SockID not online");
         } else if (strncmp(buf, "UNICAST", 7) == 0) {
             // Expect: "UNICAST <sockid>"
             int target = -1;
@@ -230,26 +1204,333 @@ static void *client_thread(void *arg) {
             char msg[BUF_SZ];
             ssize_t m = recv_line(cfd, msg, sizeof(msg));
             if (m <= 0) break;
-            if (m > 0 && msg[m - 1] == '\n') msg[m - 1] = '\0';
+            trace_begin();
+            if (m > 0 && msg[m - 1] == '\n') msg[--m] = '\0';
+            trace_mark(TP_PARSE);
+
+            unicast_rc_t rc = send_to_sockid_prefixed(&hdr, target, msg, (size_t)m);
+            if (rc == UC_DELIVERED) trace_commit(MT_UNICAST);
+            else if (rc == UC_QUEUED) reply_line(self, "note: target SockID not online, message queued");
+            else reply_line(self, "note: target SockID not online");
+        } else if (strncmp(buf, "MULTICAST", 9) == 0) {
+            // Expect: "MULTICAST <sockid> [sockid ...]", then the message body
+            int set[MULTICAST_MAX];
+            int k = parse_sockid_set(buf + 9, set, MULTICAST_MAX);
 
-            if (!send_to_sockid_prefixed(cfd, target, msg)) {
-                send_line(cfd, "note: target SockID not online");
+            char msg[BUF_SZ];
+            ssize_t m = recv_line(cfd, msg, sizeof(msg));
+            if (m <= 0) break;
+            trace_begin();
+            if (m > 0 && msg[m - 1] == '\n') msg[--m] = '\0';
+            trace_mark(TP_PARSE);
+            if (k < 0) {
+                reply_line(self, "FAIL MULTICAST: usage MULTICAST <sockid> [sockid ...] (max %d)", MULTICAST_MAX);
+                continue;
+            }
+
+            multicast_result_t r = multicast_prefixed(&hdr, set, k, msg, (size_t)m);
+            trace_commit(MT_MULTICAST);
+            reply_line(self, "OK MULTICAST delivered=%d queued=%d dropped=%d", r.delivered, r.queued, r.dropped);
+        } else if (strcmp(buf, "SESSION") == 0) {
+            uint64_t key = session_key(self);
+            if (key) reply_line(self, "SESSION %d %016llx", cfd, (unsigned long long)key);
+            else reply_line(self, "FAIL SESSION: no key available");
+        } else if (strncmp(buf, "RESUME", 6) == 0) {
+            unsigned long long key = 0;
+            int msgs = sscanf(buf + 6, "%llx", &key) == 1 && key ? pq_resume(self, key) : -1;
+            if (msgs >= 0) reply_line(self, "OK RESUME %d", msgs);
+            else reply_line(self, "FAIL RESUME: unknown or expired key");
+        } else if (strcmp(buf, "STATS") == 0) {
+            // Admin: latency percentiles, loopback peers only
+            if (peer_is_loopback(cfd)) {
+                pthread_mutex_lock(&self->wr);
+                trace_dump(cfd);
+                pthread_mutex_unlock(&self->wr);
+            } else {
+                reply_line(self, "unknown command");
             }
         } else {
             // Unknown command; ignore politely
-            send_line(cfd, "unknown command");
+            reply_line(self, "unknown command");
         }
     }
 
-    close(cfd);
+    if (relay_pipe[0] >= 0) {
+        close(relay_pipe[0]);
+        close(relay_pipe[1]);
+    }
+    trace_thread_end();
     remove_client(cfd);
+    // A relay into this socket holds wr: let it finish before the fd number
+    // can be reused by another connection.
+    pthread_mutex_lock(&self->wr);
+    close(cfd);
+    pthread_mutex_unlock(&self->wr);
     pthread_exit(NULL);
     return NULL;
 }
 
+// ---- Low-latency mode ----
+// One pinned thread owns every client socket. Sockets are non-blocking, so a
+// sweep is a recv(MSG_DONTWAIT) per connection; after LL_SPINS empty sweeps
+// the thread parks in poll() for at most LL_PARK_MS. New connections arrive
+// from the accept loop through ll_handoff (a pipe, so a parked poller wakes).
+typedef enum { LL_CMD = 0, LL_BROADCAST_BODY, LL_UNICAST_BODY, LL_MULTICAST_BODY } ll_state_t;
+
+typedef struct {
+    int fd;
+    ll_state_t state;   // which line we expect next
+    int target;         // UNICAST target while in LL_UNICAST_BODY
+    int mc_set[MULTICAST_MAX]; // MULTICAST targets while in LL_MULTICAST_BODY
+    int mc_n;           // set size, -1 if the command was malformed
+    size_t len;         // bytes buffered in `in`
+    sockid_hdr_t hdr;
+    char in[BUF_SZ];
+} ll_conn_t;
+
+static int ll_cpu = -1;             // >= 0 enables low-latency mode
+static int ll_handoff[2] = { -1, -1 };
+static unsigned ll_pending;         // fds written to ll_handoff, not yet adopted
+static ll_conn_t ll_conns[MAX_CLIENTS];
+static int ll_nconns;
+
+static void ll_tune_socket(int fd) {
+    int v = LL_BUSY_POLL_US, one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &v, sizeof(v)) < 0) {
+        static bool warned = false;
+        if (!warned) { perror("setsockopt SO_BUSY_POLL (needs CAP_NET_ADMIN above net.core.busy_read)"); warned = true; }
+    }
+    setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)); // best effort
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void ll_drop(int i) {
+    int fd = ll_conns[i].fd;
+    client_t *self = client_self(fd);
+    // As in client_thread: unregister first, then close under wr, so the fd
+    // number cannot be reused while it still names this client.
+    remove_client(fd);
+    if (self) pthread_mutex_lock(&self->wr);
+    close(fd);
+    if (self) pthread_mutex_unlock(&self->wr);
+    ll_conns[i] = ll_conns[--ll_nconns];
+}
+
+// Same protocol as client_thread, driven one complete line at a time.
+// Returns false if the connection must be dropped.
+static bool ll_on_line(ll_conn_t *c, char *line, size_t n) {
+    if (c->state != LL_CMD) {
+        trace_begin();
+        trace_mark(TP_PARSE);
+        if (c->state == LL_BROADCAST_BODY) {
+            if (!broadcast_allowed(c->fd)) {
+                send_line(c->fd, "broadcast request denied!");
+            } else if (!spam_allowed(line, n)) {
+                send_line(c->fd, "broadcast suppressed (duplicate content)");
+            } else {
+                broadcast_all_prefixed(&c->hdr, line, n);
+                trace_commit(MT_BROADCAST);
+            }
+        } else if (c->state == LL_MULTICAST_BODY) {
+            if (c->mc_n < 0) {
+                send_line(c->fd, "FAIL MULTICAST: usage MULTICAST <sockid> [sockid ...] (max %d)", MULTICAST_MAX);
+            } else {
+                multicast_result_t r = multicast_prefixed(&c->hdr, c->mc_set, c->mc_n, line, n);
+                trace_commit(MT_MULTICAST);
+                send_line(c->fd, "OK MULTICAST delivered=%d queued=%d dropped=%d", r.delivered, r.queued, r.dropped);
+            }
+        } else {
+            unicast_rc_t rc = send_to_sockid_prefixed(&c->hdr, c->target, line, n);
+            if (rc == UC_DELIVERED) trace_commit(MT_UNICAST);
+            else if (rc == UC_QUEUED) send_line(c->fd, "note: target SockID not online, message queued");
+            else send_line(c->fd, "note: target SockID not online");
+        }
+        c->state = LL_CMD;
+        return true;
+    }
+
+    if (strncmp(line, "BROADCAST", 9) == 0) {
+        c->state = LL_BROADCAST_BODY;
+    } else if (strncmp(line, "UNICASTN", 8) == 0) {
+        // Body bytes may already sit in our read buffer, so splice cannot relay them
+        send_line(c->fd, "FAIL UNICASTN: not available in low-latency mode");
+        return false;
+    } else if (strncmp(line, "UNICAST", 7) == 0) {
+        const char *p = line + 7;
+        while (*p == ' ') p++;
+        c->target = *p ? atoi(p) : -1;
+        c->state = LL_UNICAST_BODY;
+    } else if (strncmp(line, "MULTICAST", 9) == 0) {
+        c->mc_n = parse_sockid_set(line + 9, c->mc_set, MULTICAST_MAX);
+        c->state = LL_MULTICAST_BODY;
+    } else if (strcmp(line, "SESSION") == 0) {
+        uint64_t key = session_key(client_self(c->fd));
+        if (key) send_line(c->fd, "SESSION %d %016llx", c->fd, (unsigned long long)key);
+        else send_line(c->fd, "FAIL SESSION: no key available");
+    } else if (strncmp(line, "RESUME", 6) == 0) {
+        unsigned long long key = 0;
+        int msgs = sscanf(line + 6, "%llx", &key) == 1 && key ? pq_resume(client_self(c->fd), key) : -1;
+        if (msgs >= 0) send_line(c->fd, "OK RESUME %d", msgs);
+        else send_line(c->fd, "FAIL RESUME: unknown or expired key");
+    } else if (strcmp(line, "STATS") == 0 && peer_is_loopback(c->fd)) {
+        trace_dump(c->fd);
+    } else {
+        send_line(c->fd, "unknown command");
+    }
+    return true;
+}
+
+// Read what is available and hand every complete line to ll_on_line.
+// Returns 1 on progress, 0 if nothing was ready, -1 to drop the connection.
+static int ll_service(ll_conn_t *c) {
+    ssize_t n = recv(c->fd, c->in + c->len, sizeof(c->in) - 1 - c->len, MSG_DONTWAIT);
+    if (n == 0) return -1;
+    if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    c->len += (size_t)n;
+
+    size_t start = 0;
+    for (size_t i = c->len - (size_t)n; i < c->len; ++i) {
+        if (c->in[i] != '\n') continue;
+        c->in[i] = '\0';
+        if (!ll_on_line(c, c->in + start, i - start)) return -1;
+        start = i + 1;
+    }
+    if (start == 0 && c->len == sizeof(c->in) - 1) {
+        // Over-long line: deliver what fits, like recv_line does
+        c->in[c->len] = '\0';
+        if (!ll_on_line(c, c->in, c->len)) return -1;
+        start = c->len;
+    }
+    memmove(c->in, c->in + start, c->len - start);
+    c->len -= start;
+    return 1;
+}
+
+static void ll_adopt(void) {
+    int fd;
+    while (read(ll_handoff[0], &fd, sizeof(fd)) == (ssize_t)sizeof(fd)) {
+        __atomic_sub_fetch(&ll_pending, 1, __ATOMIC_RELAXED);
+        ll_conn_t *c = &ll_conns[ll_nconns++];
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->state = LL_CMD;
+        sockid_hdr_init(&c->hdr, fd);
+    }
+}
+
+static void *ll_poller_thread(void *arg) {
+    (void)arg;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(ll_cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        fprintf(stderr, "low-latency: could not pin to CPU %d\n", ll_cpu);
+    unsigned idle = 0;
+    while (1) {
+        bool progress = false;
+        if (__atomic_load_n(&ll_pending, __ATOMIC_RELAXED)) ll_adopt();
+        for (int i = 0; i < ll_nconns; ) {
+            int r = ll_service(&ll_conns[i]);
+            if (r < 0) { ll_drop(i); continue; }
+            if (r > 0) progress = true;
+            ++i;
+        }
+        if (progress) { idle = 0; continue; }
+        if (++idle < LL_SPINS) { cpu_relax(); continue; }
+
+        // Park: wake on any client byte or a newly accepted connection
+        static struct pollfd pfd[MAX_CLIENTS + 1];
+        pfd[0] = (struct pollfd){ .fd = ll_handoff[0], .events = POLLIN };
+        for (int i = 0; i < ll_nconns; ++i) pfd[i + 1] = (struct pollfd){ .fd = ll_conns[i].fd, .events = POLLIN };
+        if (poll(pfd, (nfds_t)ll_nconns + 1, LL_PARK_MS) > 0 && (pfd[0].revents & POLLIN)) ll_adopt();
+        idle = 0;
+    }
+    return NULL;
+}
+
+static pthread_attr_t client_attr;
+static const char full_msg[] = "Server is full!\n";
+
+// One non-blocking write of the precomputed reject, then close.
+static void reject_full(int cfd) {
+    if (send(cfd, full_msg, sizeof(full_msg) - 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+        /* peer already gone or buffer full: closing is all we owe it */
+    }
+    close(cfd);
+    acc_rejected++;
+}
+
+// Hand an accepted, registered connection to its thread or to the poller.
+static void admit_client(int cfd) {
+    acc_accepted++;
+    if (ll_cpu >= 0) {
+        ll_tune_socket(cfd);
+        __atomic_add_fetch(&ll_pending, 1, __ATOMIC_RELAXED);
+        if (write(ll_handoff[1], &cfd, sizeof(cfd)) != (ssize_t)sizeof(cfd)) {
+            __atomic_sub_fetch(&ll_pending, 1, __ATOMIC_RELAXED);
+            remove_client(cfd);
+            close(cfd);
+        }
+        return;
+    }
+
+    thread_arg_t *ta = (thread_arg_t *)malloc(sizeof(thread_arg_t));
+    if (!ta) { remove_client(cfd); close(cfd); return; }
+    ta->fd = cfd;
+    pthread_t th;
+    if (pthread_create(&th, &client_attr, client_thread, ta) != 0) {
+        perror("pthread_create");
+        free(ta);
+        remove_client(cfd);
+        close(cfd);
+    }
+}
+
+static void accept_dump(int fd) {
+    char line[200];
+    int L = snprintf(line, sizeof(line),
+                     "STATS ACCEPT online=%u max=%d low_water=%d shedding=%d accepted=%llu rejected=%llu shed_episodes=%llu\n",
+                     __atomic_load_n(&n_online, __ATOMIC_RELAXED), MAX_CLIENTS, LOW_WATER,
+                     (int)__atomic_load_n(&shedding, __ATOMIC_RELAXED),
+                     __atomic_load_n(&acc_accepted, __ATOMIC_RELAXED),
+                     __atomic_load_n(&acc_rejected, __ATOMIC_RELAXED),
+                     __atomic_load_n(&acc_shed_episodes, __ATOMIC_RELAXED));
+    write_all(fd, line, (size_t)L);
+}
+
 int main(void) {
     signal(SIGPIPE, SIG_IGN);
 
+    // Route SIGUSR1 (latency dump) to a dedicated thread; block it everywhere else
+    static sigset_t stats_set;
+    sigemptyset(&stats_set);
+    sigaddset(&stats_set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stats_set, NULL);
+    pthread_t stats_th;
+    if (pthread_create(&stats_th, NULL, stats_signal_thread, &stats_set) == 0) pthread_detach(stats_th);
+
+    for (int i = 0; i < MAX_CLIENTS; ++i) pthread_mutex_init(&clients[i].wr, NULL);
+    devnull_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull_fd < 0) { perror("open /dev/null"); return 1; }
+
+    const char *spam = getenv("XK3_SPAM_THRESHOLD");
+    if (spam && *spam) spam_threshold = (unsigned)atoi(spam);
+
+    const char *spool = getenv("XK3_SPOOL");
+    if (spool && *spool) pq_spool_dir = spool;
+    if (mkdir(pq_spool_dir, 0700) < 0 && errno != EEXIST) perror("mkdir spool");
+
+    const char *ll = getenv("XK3_LOWLAT");
+    if (ll && *ll) {
+        ll_cpu = atoi(ll);
+        if (pipe2(ll_handoff, O_CLOEXEC | O_NONBLOCK) < 0) { perror("pipe2"); return 1; }
+        pthread_t ll_th;
+        if (pthread_create(&ll_th, NULL, ll_poller_thread, NULL) != 0) { perror("pthread_create"); return 1; }
+        pthread_detach(ll_th);
+        printf("Low-latency mode: poller pinned to CPU %d\n", ll_cpu);
+    }
+
     int srv = socket(AF_INET, SOCK_STREAM, 0);
     if (srv < 0) { perror("socket"); return 1; }
 
@@ -266,48 +1547,74 @@ int main(void) {
         perror("bind");
         return 1;
     }
-    if (listen(srv, 16) < 0) {
+    if (listen(srv, LISTEN_BACKLOG) < 0) {
         perror("listen");
         return 1;
     }
 
     printf("Server listening on %d. Max clients = %d\n", PORT, MAX_CLIENTS);
 
+    pthread_attr_init(&client_attr);
+    pthread_attr_setstacksize(&client_attr, CLIENT_STACK_SZ);
+    pthread_attr_setdetachstate(&client_attr, PTHREAD_CREATE_DETACHED);
+
+    fcntl(srv, F_SETFL, fcntl(srv, F_GETFL) | O_NONBLOCK);
+    shed_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (shed_wake_fd < 0) { perror("eventfd"); return 1; }
+    const char *sb = getenv("XK3_SHED_BACKLOG");
+    int shed_backlog = (sb && *sb) ? atoi(sb) : -1;
+
     while (1) {
-        struct sockaddr_in cli;
-        socklen_t clilen = sizeof(cli);
-        int cfd = accept(srv, (struct sockaddr*)&cli, &clilen);
-        if (cfd < 0) {
-            if (errno == EINTR) continue;
-            perror("accept");
+        if (!shedding) {
+            struct pollfd pfd = { .fd = srv, .events = POLLIN };
+            if (poll(&pfd, 1, -1) < 0) {
+                if (errno != EINTR) perror("poll");
+                continue;
+            }
+            for (int b = 0; b < ACCEPT_BATCH; ++b) {
+                int cfd = accept4(srv, NULL, NULL, SOCK_CLOEXEC);
+                if (cfd < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+                    break;
+                }
+                if (add_client(cfd) != 0) {
+                    reject_full(cfd);
+                    continue;
+                }
+                admit_client(cfd);
+                if (__atomic_load_n(&n_online, __ATOMIC_RELAXED) >= MAX_CLIENTS) {
+                    // Full: stop polling the listener until below LOW_WATER
+                    __atomic_store_n(&shedding, true, __ATOMIC_RELEASE);
+                    acc_shed_episodes++;
+                    if (shed_backlog >= 0) listen(srv, shed_backlog);
+                    break;
+                }
+            }
             continue;
         }
 
-        // Enforce capacity
-        if (online_count() >= MAX_CLIENTS) {
-            const char *full = "Server is full!\n";
-            safe_send(cfd, full, strlen(full));
-            close(cfd);
-            continue;
+        // At capacity: sleep until a slot frees up, draining the backlog
+        // with the precomputed reject every SHED_DRAIN_MS.
+        struct pollfd wfd = { .fd = shed_wake_fd, .events = POLLIN };
+        int r = poll(&wfd, 1, SHED_DRAIN_MS);
+        if (r > 0) {
+            uint64_t v;
+            if (read(shed_wake_fd, &v, sizeof(v)) < 0) { /* raced with another drain */ }
         }
-
-        if (add_client(cfd) != 0) {
-            const char *full = "Server is full!\n";
-            safe_send(cfd, full, strlen(full));
-            close(cfd);
+        if (__atomic_load_n(&n_online, __ATOMIC_RELAXED) <= LOW_WATER) {
+            __atomic_store_n(&shedding, false, __ATOMIC_RELEASE);
+            if (shed_backlog >= 0) listen(srv, LISTEN_BACKLOG);
             continue;
         }
-
-        thread_arg_t *ta = (thread_arg_t *)malloc(sizeof(thread_arg_t));
-        ta->fd = cfd;
-        pthread_t th;
-        if (pthread_create(&th, NULL, client_thread, ta) != 0) {
-            perror("pthread_create");
-            close(cfd);
-            remove_client(cfd);
-            continue;
+        for (int b = 0; b < SHED_BATCH; ++b) {
+            int cfd = accept4(srv, NULL, NULL, SOCK_CLOEXEC);
+            if (cfd < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            reject_full(cfd);
         }
-        pthread_detach(th);
     }
     return 0;
 }
@@ -1,6 +1,7 @@
 // server2.c — LAB3 Q2: Sign up & Login, then global chat (tagged by student_id)
 // Build: gcc -O2 -Wall -Wextra -o server2 server2.c -lpthread
 // Run:   ./server2
+//        XK3_PORT=5680 XK3_BUS=127.0.0.1:7001 XK3_BUS_PEERS=127.0.0.1:7000 ./server2
 //
 // Slide requirements implemented:
 // - Client must Sign up before Login.
@@ -15,304 +16,3143 @@
 // Protocol (line-based):
 //   SIGNUP\nSID:<sid>\nACC:<acc>\nPWD:<pwd>\n
 //   LOGIN\nACC:<acc>\nPWD:<pwd>\n
+//   RESUME\nTOKEN:<token>\n
 //   CHAT\n<message>\n
+//   SEARCH\n<words>\n
+//   MULTIPLEX\n
 //   EXIT!\n
 //
 // Notes:
+// - A command line must be exactly the command word (a trailing '\r' is ignored). The command
+//   is found with a compile-time perfect hash (CMD_TABLE), and its field lines are read as
+//   one frame and parsed in place as views into the receive buffer, with no copies.
 // - Server enforces only the connection cap; input-format/length rules are enforced by client
 //   and rechecked on server (defense in depth).
+// - The user table is separate from the connection lock: an open-addressed hash of 32-bit user
+//   ids, published RCU-style. LOGIN lookups take no lock; SIGNUP is the only writer (serialized
+//   by users_mtx). When it gets half full a doubled table replaces it and is filled a few slots
+//   per SIGNUP while readers search both. Records are 32 bytes in chunks that never move; their
+//   strings sit in an append-only arena, SIDs interned. See xk3_bench_users.c for sizes.
+// - Each connection owns a session_t created at accept and handed to its thread. LOGIN caches
+//   the user and sid in it and publishes it to the broadcast set, an RCU-published dense array
+//   of session pointers. Joining fills a hole or appends; leaving leaves a hole and waits out
+//   readers. The array is only copied to grow or to compact once a quarter of it is holes.
+//   CHAT reads its own session and sweeps the set without taking mtx; mtx only guards the
+//   connection slots at accept/disconnect.
+// - Nothing is written to a client socket from a client thread. Replies and broadcasts are
+//   appended (by reference to one shared buffer) to the recipient's bounded outbound queue,
+//   and a single writer thread drains the queues with non-blocking sendmsg driven by
+//   edge-triggered EPOLLOUT. No lock is held across I/O. A recipient whose queue would exceed
+//   XK3_OUTQ_BYTES (default 1 MiB) is handled by XK3_SLOW_POLICY:
+//     drop-oldest  evict its oldest unsent messages
+//     drop-newest  discard the new message
+//     disconnect   (default) also applies when its socket has accepted nothing for
+//                  XK3_OUTQ_MS (default 10000) while backlogged
+// - Metrics: an admin listener serves Prometheus text format on every connection (HTTP/1.0,
+//   any path). XK3_METRICS selects it: a port on 127.0.0.1 (default 5679), an absolute Unix
+//   socket path, or "off". Each thread counts into its own cache-line-aligned block; blocks
+//   are only summed when scraped.
+// - Chat log: every CHAT is appended to a segmented write-ahead log in XK3_WAL_DIR (default
+//   ./wal) before it is broadcast. The directory is created 0700 and segments 0600: they hold
+//   every message in clear. Client threads enqueue records lock-free; one log thread writes
+//   them in batches. XK3_WAL selects durability:
+//     group    (default) one fdatasync per batch; the sender waits for it, so concurrent
+//              CHATs share a sync. XK3_WAL_WINDOW_US (default 0) holds a batch open longer.
+//     message  one write + fdatasync per record
+//     none     batched writes, no fdatasync, the sender does not wait
+//     off      no log
+//   Segments rotate at XK3_WAL_SEGMENT_MB (default 64). Each record is a wal_hdr_t (length,
+//   CRC-32, sequence, wall-clock ns) followed by "<sid>\t<message>".
+//   If a write or fdatasync fails the log stops and every later CHAT gets "FAIL CHAT: chat
+//   log unavailable" instead of being broadcast. On start a torn tail on the newest segment
+//   is truncated away before appending.
+// - Resume: OK LOGIN carries "token:<mac>.<expiry>.<acc>", a SipHash-2-4 MAC under a per-process
+//   random key (or XK3_RESUME_KEY, 32 hex digits, to share one across restarts). RESUME checks
+//   the MAC and expiry and does one hash lookup, then binds the session like LOGIN and replies
+//   "OK RESUME sid:<sid> token:<fresh token>". Tokens live XK3_RESUME_TTL seconds (default
+//   600).
+// - Presence: logins and logouts are not broadcast one by one. A user's online/offline
+//   transitions are collected and, every XK3_PRESENCE_MS (default 200), sent to everyone as one
+//   digest per direction, e.g. "SYSTEM: 312 users online: a, b, ... (+296 more)". A single
+//   change keeps the old "SYSTEM: <sid> is online" form. At most XK3_PRESENCE_CAP names
+//   (default 16) are listed, and above XK3_PRESENCE_COUNTS_ONLY changes (default 256) only the
+//   count is sent. An offline is held for XK3_RESUME_QUIET seconds (default 5); if the user
+//   comes back (RESUME or LOGIN) in that time, neither change is announced.
+// - Cluster: several server processes can share global chat. XK3_BUS is this process's bus
+//   address ("host:port" or an absolute Unix socket path) and XK3_BUS_PEERS a comma-separated
+//   list of the others' (full mesh, up to BUS_MAX_PEERS). Every CHAT line and presence digest
+//   is also queued, by reference, on one outbound link per peer; the writer thread batches
+//   those like any client queue. Lines arriving from a peer are delivered to this process's
+//   authed sessions only and never forwarded, so each sender's messages reach every process
+//   in the order they were sent. A dead link is redialled; what was queued on it is lost.
+//   A host-less ":port" binds loopback only. Inbound links are accepted only from the
+//   XK3_BUS_PEERS addresses (same uid for Unix sockets); set XK3_BUS_KEY (32 hex digits, the
+//   same on every process) to also require a challenge-response under that shared key.
+//   Accounts are not shared: users sign up on the process they log in to. XK3_PORT moves the
+//   client listener (default 5678); give each process its own XK3_METRICS and XK3_WAL_DIR.
+// - Capture: XK3_TRACE=<file> records every inbound line and every direct reply (not
+//   broadcasts) with its connection id and time in a compact binary trace, for xk3_replay.c
+//   to re-drive against a server. Off by default; costs one buffered append per line. The
+//   file must not exist and is created 0600; passwords and resume tokens are recorded as
+//   placeholders.
+// - Zerocopy: CHAT bodies may be up to CHAT_MAX (64 KiB). XK3_ZEROCOPY=<bytes> (e.g. 16384)
+//   has the writer send messages at least that long with MSG_ZEROCOPY, so the kernel
+//   transmits every recipient's copy from the one shared buffer instead of copying it into
+//   each socket. Each recipient keeps its reference until the socket's error queue reports
+//   that send complete (the writer reaps it on EPOLLERR). A socket whose completions say the
+//   kernel copied anyway (loopback, devices that cannot send from user pages) goes back to
+//   plain sends. A closed session waits up to ZC_DRAIN_MS for its completions, then resets
+//   the connection. Off by default.
+// - Search: the last XK3_HISTORY chat lines (default 100000, 0 = off), local and from peers,
+//   are kept and their words indexed by a background thread, so CHAT only pays one queue
+//   push. Each is kept as its own copy cut at SEARCH_HIT_MAX, and the oldest go early once
+//   the copies pass XK3_HISTORY_BYTES (default 64 MiB). SEARCH takes up to SEARCH_TERMS words (ASCII letters and digits, any case) and
+//   replies "OK SEARCH <n>" then n lines "HIT [sid]: <message>", the newest lines holding
+//   every word, at most SEARCH_HITS, each cut at SEARCH_HIT_MAX bytes. Posting lists are
+//   delta-encoded blocks, intersected with SSE2 where available. See xk3_bench_search.c.
+// - Multiplexing: MULTIPLEX (before LOGIN) turns a connection into a carrier of up to
+//   MUX_CHANNELS logical sessions; "OK MULTIPLEX" is its last unframed line. From then on
+//   every line sent must be "@<channel> <line>", the lines of one command contiguous and on
+//   one channel (anything else closes the connection), and each channel has its own login
+//   state. Direct replies come back as "@<channel> <reply line>". Broadcast lines ("[sid]:"
+//   and "SYSTEM:") come unprefixed, once per connection, and are meant for every channel
+//   authed on it at that point in the stream: the connection sits in the broadcast set once,
+//   so a broadcast costs it one queue entry and one write however many channels it carries.
+//   EXIT! ends only its channel ("@<channel> OK EXIT"). MAX_CLIENTS counts connections. See
+//   xk3_bench_mux.c for kernel memory and fan-out against one connection per session.
 
 #define _GNU_SOURCE
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define PORT 5678
-#define MAX_CLIENTS 5
-#define MAX_USERS   128
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 5           // override with -DMAX_CLIENTS=N for scale runs
+#endif
+#define USER_ID_BITS 26      // user ids fit in the low bits of a hash slot
+#define MAX_USERS   ((1u << USER_ID_BITS) - 1)
+#define USER_CHUNK_BITS 16  // records per chunk of the user store: 64Ki x 32 B
+#define FIELD_MAX 63        // longest SID/ACC/PWD stored; a longer SID is cut
+#define ARENA_CHUNK_BITS 20 // the string arena grows 1 MiB at a time, up to 4 GiB
 #define BUF_SZ 4096
+#define CHAT_MAX 65536      // longest CHAT body
+#define RBUF_SZ 16384       // initial per-connection receive buffer; grows to fit a command
+#define BUS_MAX_PEERS 16
+#define BUS_RBUF (2 * CHAT_MAX) // per inbound link; a batch of whole lines is delivered at once
+#define BUS_RETRY_MS 500
+#define BUS_HANDSHAKE_MS 2000   // an inbound link must prove itself within this
+#define RCU_MAX_READERS (MAX_CLIENTS + BUS_MAX_PEERS + 16)
+#define BSET_MIN 64         // initial broadcast set capacity
+#define BSET_PREFETCH 8     // members ahead whose queue header a broadcast prefetches
+#define USERS_TAB_MIN 64    // initial hash slots (power of two)
+#define USERS_MIGRATE 8     // old slots moved into a grown table per add
+#define SID_TAB_MIN 64      // initial interned-SID slots (power of two)
+#define OUTQ_SLOTS 512      // queued messages per recipient (power of two)
+#define OUTQ_DEFAULT_BYTES (1024 * 1024)
+#define OUTQ_DEFAULT_MS 10000
+#define WRITER_IOV 64       // messages per sendmsg
+#define WRITER_EVENTS 64
+#define ZC_WINDOW 64        // zerocopy sends in flight per socket (at most 64: bits of zc_ahead)
+#define ZC_DRAIN_MS 5000    // how long a closed session waits for zerocopy completions
+#ifndef ZC_KEEP_ON_COPY
+#define ZC_KEEP_ON_COPY 0   // 1: keep MSG_ZEROCOPY on sockets where the kernel copies anyway (for measuring)
+#endif
+#define METRICS_DEFAULT_PORT 5679
+#define METRICS_BACKOFF_MAX_MS 1000 // longest pause between accepts while out of fds or memory
+#define HIST_BUCKETS 24     // le = 1us, 2us, ... 2^23us (~8.4s), then +Inf
+#define WAL_DEFAULT_DIR "./wal"
+#define WAL_SEGMENT_DEFAULT_MB 64
+#define WAL_WINDOW_DEFAULT_US 0
+#define WAL_BATCH 512       // records per writev (two iovecs each)
+#define RESUME_TTL_DEFAULT_S 600
+#define RESUME_QUIET_DEFAULT_S 5
+#define PRESENCE_MS_DEFAULT 200
+#define PRESENCE_CAP_DEFAULT 16
+#define PRESENCE_COUNTS_ONLY_DEFAULT 256
+#define TRACE_BUF (1 << 20) // stdio buffer for the capture file
+#define TRACE_FLUSH_MS 100
+#define HISTORY_DEFAULT 100000 // chat lines kept for SEARCH
+#define HISTORY_BYTES_DEFAULT (64ull << 20) // and at most this much of their text
+#define POST_BLOCK 128      // ids per sealed posting block
+#define TERM_MAX 32         // a longer word is indexed by its first TERM_MAX bytes
+#define TERM_TAB_MIN 1024   // initial term dictionary slots (power of two)
+#define INDEX_BATCH 256     // messages indexed per write-lock hold
+#define INDEX_SWEEP 65536   // documents between sweeps of expired postings
+#define SEARCH_TERMS 8
+#define SEARCH_HITS 20
+#define SEARCH_HIT_MAX 1024 // a longer hit is cut
+#define MUX_CHANNELS 65536  // channels per MULTIPLEX connection
+#define MUX_PREFIX_MAX 7    // "@65535 "
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// Immutable once published in the user table, except the presence fields.
+// The strings are refs into the user arena (arena_str() reads one).
 typedef struct {
-    char sid[64];
-    char acc[64];
-    char pwd[64];
-    bool in_use;
+    uint32_t acc, pwd;
+    uint32_t sid;           // interned: accounts with the same SID share it
+    int online;             // authed sessions bound to this user (atomic)
+    // Guarded by presence_mtx:
+    bool shown_online;      // what everyone was last told
+    bool presence_dirty;    // on presence_dirty[]
+    bool presence_slot;     // counted in presence_slots
+    uint64_t offline_due_ns; // pending offline announcement, 0 if none
 } user_t;
+_Static_assert(sizeof(user_t) == 32, "user records are sized for the 32-byte slots in user_chunk[]");
+
+// Immutable, shared by every queue it is on.
+typedef struct {
+    int refs;
+    size_t len;
+    uint64_t t_ns;      // when it was queued, for delivery latency
+    char data[];
+} msg_t;
+
+// Bytes inside a buffer someone else owns: a received line or a field of it.
+typedef struct {
+    const char *p;
+    size_t len;
+} view_t;
+
+// One per connection, owned by its client thread until it is retired to the
+// writer thread, which frees it. Cache-line aligned: everything a broadcast
+// touches besides the queue slot itself sits in the first two lines.
+typedef struct session {
+    // Outbound queue, guarded by q_mtx. Entries [q_head, q_head + q_inflight)
+    // are being written by the writer thread outside the lock and are never
+    // evicted; q_off is how much of the head entry has already been sent (a
+    // partly sent head is not evicted either).
+    pthread_mutex_t q_mtx;
+    unsigned q_head, q_n, q_inflight;
+    bool broken;         // write error or slow-consumer disconnect
+    int on_ready;        // queued on the writer's ready stack
+    size_t q_off, q_bytes;
+    uint64_t q_stall_ns; // backlogged with no progress since
+    struct session *ready_next;
+
+    int fd;
+    int slot;           // index in clients[]
+    int bset_idx;       // index in the broadcast set, -1 if not in it
+    unsigned conn_id;   // trace connection id, 0 if not captured
+    bool dead;          // retired by the client thread
+    user_t *user;       // bound at LOGIN/RESUME
+    char sid[64];       // cached from user at LOGIN
+    char *rbuf;         // client thread's receive buffer, rbuf[r_off, r_len) unread
+    size_t r_off, r_len, r_cap;
+    // MULTIPLEX, client thread only. Each channel's user sits in mux_user[]
+    // between commands; user/sid above hold the one being handled.
+    bool mux;
+    int mux_cur;        // channel of the command being read, -1 until its first line
+    int mux_authed;     // channels with a user bound
+    int mux_cap;
+    user_t **mux_user;  // by channel id
+
+    // MSG_ZEROCOPY, writer thread only. The kernel numbers zerocopy sends on
+    // a socket from 0 and reports completions as id ranges: every id below
+    // zc_done is complete, and bit i of zc_ahead is set when zc_done + i
+    // completed early. A message a zerocopy send covered stays referenced in
+    // zc_pins until that send completes.
+    bool zc;            // sending with MSG_ZEROCOPY
+    unsigned zc_next, zc_done;
+    uint64_t zc_ahead;
+    unsigned zc_head_pin; // 1 + the last zerocopy send that carried part of the head entry, 0 if none
+    struct zc_pin *zc_pins; // ring, ordered by id
+    unsigned zc_pin_head, zc_pin_n, zc_pin_cap;
+    uint64_t zc_drain_ns; // closed, waiting for completions until then
+    msg_t *q[OUTQ_SLOTS];
+} __attribute__((aligned(64))) session_t;
+
+typedef struct zc_pin {
+    msg_t *m;
+    unsigned id;
+} zc_pin_t;
+
+typedef enum { SLOW_DROP_OLDEST, SLOW_DROP_NEWEST, SLOW_DISCONNECT } slow_policy_t;
+
+// Authed sessions, read under RCU. m[0, n) is a dense array of session
+// pointers, updated in place under bset_mtx: a departure leaves a NULL hole
+// that readers skip and the next arrival fills. Only growth and compaction
+// publish a new copy.
+typedef struct {
+    int n, cap;
+    session_t *m[];
+} bset_t;
+
+// Open-addressed set of strings in the user arena, keyed by 32-bit slot
+// values (0 = empty) that key_fn maps to the string's ref. The bits of a
+// value in tag_mask hold bits of the string's hash, so most mismatches are
+// rejected without touching the string. While a grown table is filling from
+// the one it replaced, old points at that one and both are searched.
+typedef uint32_t (*strtab_key_fn)(uint32_t v);
+typedef struct strtab {
+    unsigned mask;      // slots - 1
+    unsigned count;
+    uint32_t tag_mask;
+    struct strtab *old;
+    unsigned migrated;  // old slots moved so far (writer only)
+    uint32_t slot[];
+} strtab_t;
+
+// Another server process. link is our outbound connection to it, published
+// under RCU by its dialer thread.
+typedef struct {
+    const char *spec;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    session_t *link;
+} bus_peer_t;
+
+static strtab_t *users_tab;             // accounts: user id + 1, tagged; RCU-published
+static pthread_mutex_t users_mtx = PTHREAD_MUTEX_INITIALIZER; // SIGNUP only
+static session_t *clients[MAX_CLIENTS];
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER; // clients[] slots only
+static bset_t *bset;                    // RCU-published
+static pthread_mutex_t bset_mtx = PTHREAD_MUTEX_INITIALIZER; // bset writers (LOGIN/disconnect)
+static int *bset_holes;                 // free indices below bset->n, under bset_mtx
+static int bset_nholes, bset_holes_cap;
+
+static slow_policy_t slow_policy = SLOW_DISCONNECT;
+static size_t outq_max_bytes = OUTQ_DEFAULT_BYTES;
+static uint64_t outq_max_ns = OUTQ_DEFAULT_MS * 1000000ull;
+static int writer_ep = -1, writer_evfd = -1;
+static session_t *ready_top;            // Treiber stack of sessions with work for the writer
+static size_t zc_min;                   // XK3_ZEROCOPY: smallest message sent zerocopy, 0 = off
+static session_t *zc_draining;          // closed sessions awaiting completions, writer only
+static bus_peer_t bus_peers[BUS_MAX_PEERS];
+static int bus_npeers;
+
+// ---- Minimal userspace RCU ----
+// Each registered thread owns a counter that is odd while it is inside a
+// read-side section. A writer unpublishes an object, then synchronize_rcu()
+// waits for every reader that was inside a section at that moment to leave
+// it; readers that enter later are guaranteed (by the paired seq_cst fences)
+// to see the new pointer. Readers never block or write shared lines.
+typedef struct {
+    unsigned long ctr;
+    bool in_use;
+} __attribute__((aligned(64))) rcu_reader_t;
+
+static rcu_reader_t rcu_readers[RCU_MAX_READERS];
+static __thread rcu_reader_t *rcu_self;
+
+// False if every slot is taken; the caller must not enter a read section.
+// Threads unregister before they give up their connection slot, so this
+// only fails if something else leaks slots.
+static bool rcu_register_thread(void) {
+    for (int i = 0; i < RCU_MAX_READERS; ++i) {
+        bool expect = false;
+        if (__atomic_compare_exchange_n(&rcu_readers[i].in_use, &expect, true, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            rcu_self = &rcu_readers[i];
+            return true;
+        }
+    }
+    fprintf(stderr, "rcu: out of reader slots\n");
+    return false;
+}
+
+static void rcu_unregister_thread(void) {
+    if (!rcu_self) return;
+    __atomic_store_n(&rcu_self->ctr, rcu_self->ctr + (rcu_self->ctr & 1), __ATOMIC_RELEASE);
+    __atomic_store_n(&rcu_self->in_use, false, __ATOMIC_RELEASE);
+    rcu_self = NULL;
+}
+
+static inline void rcu_read_lock(void) {
+    __atomic_store_n(&rcu_self->ctr, rcu_self->ctr + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_unlock(void) {
+    __atomic_store_n(&rcu_self->ctr, rcu_self->ctr + 1, __ATOMIC_RELEASE);
+}
+
+static void synchronize_rcu(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (int i = 0; i < RCU_MAX_READERS; ++i) {
+        unsigned long c = __atomic_load_n(&rcu_readers[i].ctr, __ATOMIC_ACQUIRE);
+        if (!(c & 1)) continue;
+        while (__atomic_load_n(&rcu_readers[i].ctr, __ATOMIC_ACQUIRE) == c) sched_yield();
+    }
+}
+
+static void safe_send(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(fd, buf + off, len - off, 0);
+        if (n < 0) { if (errno == EINTR) continue; break; }
+        if (n == 0) break;
+        off += (size_t)n;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// ---- Metrics ----
+// Every thread that counts owns one metrics_t; only the owner writes it
+// (relaxed stores, so a scrape never sees a torn value). Blocks of exited
+// threads are folded into metrics_retired. The scrape sums them all.
+typedef enum {
+    M_ACCEPTED, M_REJECTED, M_SIGNUP_OK, M_SIGNUP_FAIL, M_LOGIN_OK, M_LOGIN_FAIL,
+    M_CHAT_IN, M_DELIVERED, M_DROPPED, M_SLOW_CUT, M_BYTES_IN, M_BYTES_OUT,
+    M_WAL_RECORDS, M_WAL_BYTES, M_WAL_SYNCS, M_WAL_ERRORS, M_RESUME_OK, M_RESUME_FAIL,
+    M_BUS_LINKS, M_BUS_BYTES_IN, M_ZC_BYTES, M_ZC_COPIED, M_SEARCH, M_INDEXED,
+    M_MUX_CONNS,
+    M_COUNT
+} metric_t;
+
+typedef enum { H_FANOUT, H_DELIVERY, H_LOGIN, H_WAL_COMMIT, H_SEARCH, H_COUNT } hist_id_t;
+
+static const struct { const char *name, *help; } metric_info[M_COUNT] = {
+    [M_ACCEPTED]    = { "xk3_connections_accepted_total", "Connections given a session." },
+    [M_REJECTED]    = { "xk3_connections_rejected_total", "Connections refused with \"Server is full!\"." },
+    [M_SIGNUP_OK]   = { "xk3_signup_ok_total", "Successful SIGNUPs." },
+    [M_SIGNUP_FAIL] = { "xk3_signup_fail_total", "Refused SIGNUPs." },
+    [M_LOGIN_OK]    = { "xk3_login_ok_total", "Successful LOGINs." },
+    [M_LOGIN_FAIL]  = { "xk3_login_fail_total", "Refused LOGINs." },
+    [M_CHAT_IN]     = { "xk3_chat_messages_in_total", "CHAT messages received from authed sessions." },
+    [M_DELIVERED]   = { "xk3_fanout_deliveries_total", "Messages fully written to a recipient socket." },
+    [M_DROPPED]     = { "xk3_fanout_dropped_total", "Messages dropped by the slow-consumer policy." },
+    [M_SLOW_CUT]    = { "xk3_slow_consumer_disconnects_total", "Sessions cut by the slow-consumer policy." },
+    [M_BYTES_IN]    = { "xk3_bytes_in_total", "Bytes read from client sockets." },
+    [M_BYTES_OUT]   = { "xk3_bytes_out_total", "Bytes written to client sockets." },
+    [M_WAL_RECORDS] = { "xk3_wal_records_total", "Records appended to the chat log." },
+    [M_WAL_BYTES]   = { "xk3_wal_bytes_total", "Bytes appended to the chat log." },
+    [M_WAL_SYNCS]   = { "xk3_wal_syncs_total", "fdatasync calls on the chat log." },
+    [M_WAL_ERRORS]  = { "xk3_wal_errors_total", "Chat log write or sync failures; the log stops after one." },
+    [M_RESUME_OK]   = { "xk3_resume_ok_total", "Sessions restored from a resume token." },
+    [M_RESUME_FAIL] = { "xk3_resume_fail_total", "Refused RESUMEs." },
+    [M_BUS_LINKS]   = { "xk3_bus_links_established_total", "Outbound links to cluster peers (re)established." },
+    [M_BUS_BYTES_IN] = { "xk3_bus_bytes_in_total", "Bytes of chat lines received from cluster peers." },
+    [M_ZC_BYTES]    = { "xk3_zerocopy_bytes_out_total", "Bytes written with MSG_ZEROCOPY (also in xk3_bytes_out_total)." },
+    [M_ZC_COPIED]   = { "xk3_zerocopy_copied_total", "Zerocopy completions the kernel reported as copied after all." },
+    [M_SEARCH]      = { "xk3_search_queries_total", "SEARCH queries answered." },
+    [M_INDEXED]     = { "xk3_history_indexed_total", "Chat lines added to the search history." },
+    [M_MUX_CONNS]   = { "xk3_multiplex_connections_total", "Connections switched to MULTIPLEX framing." },
+};
+
+static const struct { const char *name, *help; } hist_info[H_COUNT] = {
+    [H_FANOUT]   = { "xk3_broadcast_fanout_seconds", "Time to queue one broadcast to every authed session." },
+    [H_DELIVERY] = { "xk3_delivery_latency_seconds", "Queue-to-socket latency per delivered message." },
+    [H_LOGIN]    = { "xk3_login_seconds", "LOGIN handling time, lookup to reply queued." },
+    [H_WAL_COMMIT] = { "xk3_wal_commit_seconds", "Enqueue-to-durable time per chat log record." },
+    [H_SEARCH]   = { "xk3_search_seconds", "SEARCH time under the index read lock, lookup to hits formatted." },
+};
+
+typedef struct {
+    uint64_t count[HIST_BUCKETS + 1];
+    uint64_t sum_ns;
+} hist_t;
+
+typedef struct metrics {
+    uint64_t c[M_COUNT];
+    hist_t h[H_COUNT];
+    struct metrics *next;
+} __attribute__((aligned(64))) metrics_t;
+
+static pthread_mutex_t metrics_mtx = PTHREAD_MUTEX_INITIALIZER; // registry; never on the hot path
+static metrics_t *metrics_live;
+static metrics_t metrics_retired;
+static __thread metrics_t *metrics_self;
+
+static metrics_t *metrics_thread(void) {
+    if (metrics_self) return metrics_self;
+    metrics_t *m;
+    if (posix_memalign((void **)&m, 64, sizeof(*m)) != 0) return &metrics_retired; // best effort
+    memset(m, 0, sizeof(*m));
+    pthread_mutex_lock(&metrics_mtx);
+    m->next = metrics_live;
+    metrics_live = m;
+    pthread_mutex_unlock(&metrics_mtx);
+    return metrics_self = m;
+}
+
+static inline void bump(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline void metric_add(metric_t k, uint64_t v) { bump(&metrics_thread()->c[k], v); }
+
+static void hist_observe(hist_id_t k, uint64_t ns) {
+    hist_t *h = &metrics_thread()->h[k];
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0; // smallest b with us < 2^b
+    if (b > HIST_BUCKETS) b = HIST_BUCKETS;
+    bump(&h->count[b], 1);
+    bump(&h->sum_ns, ns);
+}
+
+static void metrics_add_into(metrics_t *dst, const metrics_t *src) {
+    for (int k = 0; k < M_COUNT; ++k) dst->c[k] += __atomic_load_n(&src->c[k], __ATOMIC_RELAXED);
+    for (int k = 0; k < H_COUNT; ++k) {
+        for (int b = 0; b <= HIST_BUCKETS; ++b)
+            dst->h[k].count[b] += __atomic_load_n(&src->h[k].count[b], __ATOMIC_RELAXED);
+        dst->h[k].sum_ns += __atomic_load_n(&src->h[k].sum_ns, __ATOMIC_RELAXED);
+    }
+}
+
+static void metrics_thread_exit(void) {
+    metrics_t *m = metrics_self;
+    if (!m || m == &metrics_retired) return;
+    pthread_mutex_lock(&metrics_mtx);
+    for (metrics_t **pp = &metrics_live; *pp; pp = &(*pp)->next) {
+        if (*pp == m) { *pp = m->next; break; }
+    }
+    metrics_add_into(&metrics_retired, m);
+    pthread_mutex_unlock(&metrics_mtx);
+    metrics_self = NULL;
+    free(m);
+}
+
+// ---- Traffic capture ----
+// One stdio stream shared by all client threads; a record is encoded on the
+// caller's stack and appended under the stream lock, which also orders the
+// timestamps. A flusher thread pushes the buffer out every TRACE_FLUSH_MS.
+// The file is created 0600 and must not exist yet. Secrets never reach it:
+// a "PWD:" line's value and every resume token (the "TOKEN:" line and the
+// "token:" of an OK reply) are replaced by a SipHash of the value under a
+// key that lives only in this process, so equal values stay equal (replay
+// can still pair a token with the reply that issued it) and a placeholder
+// password passes the signup policy exactly when the real one did.
+// Layout (read by xk3_replay.c):
+//   header  "XK3TRC1\n", u64 wall-clock ns at start (little-endian)
+//   record  u8 type, varint conn id, varint us since the previous record,
+//           then for TR_IN/TR_REPLY varint length and the bytes
+
+enum { TR_OPEN = 1, TR_CLOSE = 2, TR_IN = 3, TR_REPLY = 4 };
+
+static FILE *trace_f;
+static uint64_t trace_last_ns;  // under the stream lock
+static unsigned trace_conn_seq;
+static uint64_t trace_key[2];   // for the placeholders; never written out
+
+static uint64_t siphash24(const uint64_t key[2], const void *buf, size_t len); // Resume tokens
+static bool valid_len(view_t v);                                               // Commands
+static bool contains_upper_and_symbol(view_t v);
+
+static size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) { p[n++] = (uint8_t)(v | 0x80); v >>= 7; }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+#define TRACE_BLANK ((size_t)-1) // trace_redact: record the line empty
+
+// Length of the value at p: for a "KEY:value" line the rest of it without
+// the CR/LF, as parse_kv() takes it; inside a reply, up to a space.
+static size_t trace_value_len(const char *p, const char *e, bool whole_line) {
+    const char *q = p;
+    if (whole_line) { q = e; while (q > p && (q[-1] == '\r' || q[-1] == '\n')) --q; }
+    else while (q < e && *q != ' ' && *q != '\r' && *q != '\n') ++q;
+    return (size_t)(q - p);
+}
+
+// If buf holds a secret, write the record with it replaced into out and
+// return the new length; 0 if buf can be traced as is, TRACE_BLANK if it
+// holds a secret that does not fit in out.
+static size_t trace_redact(int type, const char *buf, size_t len, char *out, size_t cap) {
+    const char *p = buf, *e = buf + len;
+    if (p < e && *p == '@') { // MULTIPLEX channel prefix
+        const char *sp = (const char *)memchr(p, ' ', (size_t)(e - p));
+        if (!sp) return 0; // mux_strip() rejects it: not a command line
+        p = sp + 1;
+    }
+    const char *v = NULL, *fmt = NULL;
+    if (type == TR_IN && (size_t)(e - p) >= 4 && memcmp(p, "PWD:", 4) == 0) v = p + 4;
+    else if (type == TR_IN && (size_t)(e - p) >= 6 && memcmp(p, "TOKEN:", 6) == 0) { v = p + 6; fmt = "t%016llx"; }
+    else if (type == TR_REPLY && (size_t)(e - p) >= 3 && memcmp(p, "OK ", 3) == 0) {
+        const char *t = (const char *)memmem(p, (size_t)(e - p), " token:", 7);
+        if (t) { v = t + 7; fmt = "t%016llx"; }
+    }
+    if (!v) return 0;
+    size_t vl = trace_value_len(v, e, type == TR_IN), head = (size_t)(v - buf), tail = (size_t)(e - v) - vl;
+    uint64_t h = siphash24(trace_key, v, vl);
+    char ph[24];
+    if (!fmt) { // a password: keep whether it meets the signup policy
+        view_t pw = { v, vl };
+        fmt = valid_len(pw) && contains_upper_and_symbol(pw) ? "Pw%08llx!" : "pw%08llx";
+        h &= 0xffffffffu;
+    }
+    int pl = snprintf(ph, sizeof(ph), fmt, (unsigned long long)h);
+    if (head + (size_t)pl + tail > cap) return TRACE_BLANK; // never trace a secret as is
+    memcpy(out, buf, head);
+    memcpy(out + head, ph, (size_t)pl);
+    memcpy(out + head + (size_t)pl, v + vl, tail);
+    return head + (size_t)pl + tail;
+}
+
+static void trace_rec(int type, unsigned conn, const char *buf, size_t len) {
+    char red[BUF_SZ + MUX_PREFIX_MAX];
+    size_t rl = len ? trace_redact(type, buf, len, red, sizeof(red)) : 0;
+    if (rl == TRACE_BLANK) len = 0;
+    else if (rl) { buf = red; len = rl; }
+    uint8_t hdr[32];
+    size_t h = 0;
+    hdr[h++] = (uint8_t)type;
+    h += put_varint(hdr + h, conn);
+    flockfile(trace_f);
+    uint64_t now = now_ns();
+    h += put_varint(hdr + h, (now - trace_last_ns) / 1000);
+    trace_last_ns = now - (now - trace_last_ns) % 1000; // keep the remainder
+    if (type == TR_IN || type == TR_REPLY) h += put_varint(hdr + h, len);
+    fwrite_unlocked(hdr, 1, h, trace_f);
+    if (len) fwrite_unlocked(buf, 1, len, trace_f);
+    funlockfile(trace_f);
+}
+
+static void *trace_flusher(void *arg) {
+    (void)arg;
+    struct timespec d = { 0, TRACE_FLUSH_MS * 1000000L };
+    while (1) {
+        nanosleep(&d, NULL);
+        if (fflush(trace_f) != 0) { perror("trace"); break; } // keeps serving; the trace is cut short
+    }
+    return NULL;
+}
+
+static int trace_start(void) {
+    const char *path = getenv("XK3_TRACE");
+    if (!path || !*path) return 0;
+    if (getrandom(trace_key, sizeof(trace_key), 0) != (ssize_t)sizeof(trace_key)) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) return -1; // EEXIST: never append to or clobber an old capture
+    FILE *f = fdopen(fd, "wb");
+    if (!f) { close(fd); return -1; }
+    setvbuf(f, NULL, _IOFBF, TRACE_BUF);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t wall = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    uint8_t hdr[16];
+    memcpy(hdr, "XK3TRC1\n", 8);
+    for (int i = 0; i < 8; ++i) hdr[8 + i] = (uint8_t)(wall >> (8 * i));
+    if (fwrite(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) { fclose(f); return -1; }
+    trace_last_ns = now_ns();
+    pthread_t th;
+    if (pthread_create(&th, NULL, trace_flusher, NULL) != 0) { fclose(f); return -1; }
+    pthread_detach(th);
+    trace_f = f;
+    printf("Capturing traffic to %s\n", path);
+    return 0;
+}
+
+// ---- Outbound queues and the writer thread ----
+
+// Room for len bytes plus a NUL, so the caller can format into it.
+static msg_t *msg_alloc(size_t len) {
+    msg_t *m = (msg_t *)malloc(sizeof(*m) + len + 1);
+    if (!m) return NULL;
+    m->refs = 1;
+    m->len = len;
+    m->t_ns = 0;
+    return m;
+}
+
+static msg_t *msg_new(const char *buf, size_t len) {
+    msg_t *m = msg_alloc(len);
+    if (m) memcpy(m->data, buf, len);
+    return m;
+}
+
+static void msg_put(msg_t *m) {
+    if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) free(m);
+}
+
+// Pop the head entry. Caller holds q_mtx.
+static msg_t *outq_pop_locked(session_t *s) {
+    msg_t *m = s->q[s->q_head];
+    s->q_head = (s->q_head + 1) & (OUTQ_SLOTS - 1);
+    s->q_n--;
+    s->q_bytes -= m->len;
+    s->q_off = 0;
+    return m;
+}
+
+// Entries the writer is holding: those it is writing now, or else a head
+// entry it has partly written (evicting that would tear the stream, and a
+// zerocopy send may still be reading it).
+static unsigned outq_held_locked(const session_t *s) {
+    return s->q_inflight ? s->q_inflight : s->q_off != 0;
+}
+
+// Evict the oldest entry the writer is not holding: shift the held entries
+// up one slot over it. Caller holds q_mtx and q_n > outq_held_locked().
+static msg_t *outq_evict_locked(session_t *s) {
+    unsigned held = outq_held_locked(s);
+    unsigned victim = (s->q_head + held) & (OUTQ_SLOTS - 1);
+    msg_t *m = s->q[victim];
+    for (unsigned i = held; i > 0; --i) {
+        unsigned to = (s->q_head + i) & (OUTQ_SLOTS - 1);
+        s->q[to] = s->q[(to - 1) & (OUTQ_SLOTS - 1)];
+    }
+    s->q_head = (s->q_head + 1) & (OUTQ_SLOTS - 1);
+    s->q_n--;
+    s->q_bytes -= m->len;
+    return m;
+}
+
+static bool outq_over_locked(const session_t *s, size_t add) {
+    return s->q_n == OUTQ_SLOTS || s->q_bytes + add > outq_max_bytes;
+}
+
+// Drop everything queued that the writer is not holding. Caller holds q_mtx.
+static void outq_discard_locked(session_t *s) {
+    while (s->q_n > outq_held_locked(s)) msg_put(outq_evict_locked(s));
+}
+
+// Append m to s's queue under the slow-consumer policy. Never does I/O.
+// Returns true if the queue was empty, i.e. the writer must be told.
+static bool outq_push(session_t *s, msg_t *m, uint64_t now) {
+    bool kick = false, cut = false;
+    pthread_mutex_lock(&s->q_mtx);
+    if (s->broken) goto out;
+    if (slow_policy == SLOW_DISCONNECT) {
+        // Signed: the writer may have stamped progress after `now` was taken.
+        if (outq_over_locked(s, m->len) || (s->q_n && (int64_t)(now - s->q_stall_ns) > (int64_t)outq_max_ns)) {
+            s->broken = cut = true;
+            metric_add(M_DROPPED, s->q_n - outq_held_locked(s) + 1);
+            outq_discard_locked(s);
+            goto out;
+        }
+    } else if (outq_over_locked(s, m->len)) {
+        if (slow_policy == SLOW_DROP_OLDEST) {
+            while (outq_over_locked(s, m->len) && s->q_n > outq_held_locked(s)) {
+                msg_put(outq_evict_locked(s));
+                metric_add(M_DROPPED, 1);
+            }
+        }
+        if (outq_over_locked(s, m->len)) { metric_add(M_DROPPED, 1); goto out; } // drop-newest, or nothing evictable
+    }
+    if (s->q_n == 0) { s->q_stall_ns = now; kick = true; }
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    s->q[(s->q_head + s->q_n) & (OUTQ_SLOTS - 1)] = m;
+    s->q_n++;
+    s->q_bytes += m->len;
+out:
+    pthread_mutex_unlock(&s->q_mtx);
+    if (cut) {
+        shutdown(s->fd, SHUT_RDWR); // wakes the client thread's recv
+        metric_add(M_SLOW_CUT, 1);
+    }
+    return kick;
+}
+
+// Hand a chain of sessions (linked by ready_next) to the writer thread.
+static void ready_push_chain(session_t *first, session_t *last) {
+    session_t *top = __atomic_load_n(&ready_top, __ATOMIC_RELAXED);
+    do {
+        last->ready_next = top;
+    } while (!__atomic_compare_exchange_n(&ready_top, &top, first, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!top) {
+        uint64_t one = 1;
+        ssize_t w = write(writer_evfd, &one, sizeof(one));
+        (void)w;
+    }
+}
+
+// Claim s for the ready stack; false if it is already on it.
+static bool ready_claim(session_t *s) {
+    return __atomic_exchange_n(&s->on_ready, 1, __ATOMIC_SEQ_CST) == 0;
+}
+
+// A reply on a MULTIPLEX connection: every line gets its channel's prefix,
+// including an unterminated tail, so size by segments rather than newlines.
+static msg_t *mux_frame(int ch, const char *buf, size_t len) {
+    size_t segs = 0;
+    for (const char *p = buf; (p = (const char *)memchr(p, '\n', len - (size_t)(p - buf))) != NULL; ++p) segs++;
+    segs += len && buf[len - 1] != '\n';
+    msg_t *m = msg_alloc(len + segs * MUX_PREFIX_MAX);
+    if (!m) return NULL;
+    char pre[MUX_PREFIX_MAX + 1];
+    size_t lp = (size_t)snprintf(pre, sizeof(pre), "@%u ", (unsigned)ch % MUX_CHANNELS), o = 0;
+    for (size_t i = 0; i < len;) {
+        const char *nl = (const char *)memchr(buf + i, '\n', len - i);
+        size_t k = nl ? (size_t)(nl - buf) + 1 : len;
+        memcpy(m->data + o, pre, lp); o += lp;
+        memcpy(m->data + o, buf + i, k - i); o += k - i;
+        i = k;
+    }
+    m->len = o;
+    return m;
+}
+
+static void session_send(session_t *s, const char *buf, size_t len) {
+    msg_t *m = s->mux && s->mux_cur >= 0 ? mux_frame(s->mux_cur, buf, len) : msg_new(buf, len);
+    if (!m) return;
+    if (s->conn_id) trace_rec(TR_REPLY, s->conn_id, m->data, m->len);
+    m->t_ns = now_ns();
+    if (outq_push(s, m, m->t_ns) && ready_claim(s)) ready_push_chain(s, s);
+    msg_put(m);
+}
+
+static void send_line(session_t *s, const char *fmt, ...) {
+    char out[BUF_SZ];
+    va_list ap; va_start(ap, fmt);
+    vsnprintf(out, sizeof(out), fmt, ap);
+    va_end(ap);
+    size_t L = strlen(out);
+    if (L == 0 || out[L-1] != '\n') {
+        if (L + 1 < sizeof(out)) { out[L] = '\n'; out[L+1] = '\0'; L++; }
+    }
+    session_send(s, out, L);
+}
+
+// ---- Zerocopy completions (writer thread only) ----
+
+// Keep m until zerocopy send pin - 1 has completed; pin 0 means no zerocopy
+// send covered it.
+static void zc_hold(session_t *s, msg_t *m, unsigned pin) {
+    if (!pin || (int)(pin - 1 - s->zc_done) < 0) { msg_put(m); return; }
+    if (s->zc_pin_n == s->zc_pin_cap) {
+        unsigned cap = s->zc_pin_cap ? 2 * s->zc_pin_cap : 64;
+        zc_pin_t *p = (zc_pin_t *)malloc(cap * sizeof(*p));
+        if (!p) return; // leak m rather than free it under the kernel
+        for (unsigned i = 0; i < s->zc_pin_n; ++i) p[i] = s->zc_pins[(s->zc_pin_head + i) & (s->zc_pin_cap - 1)];
+        free(s->zc_pins);
+        s->zc_pins = p;
+        s->zc_pin_head = 0;
+        s->zc_pin_cap = cap;
+    }
+    s->zc_pins[(s->zc_pin_head + s->zc_pin_n++) & (s->zc_pin_cap - 1)] = (zc_pin_t){ m, pin - 1 };
+}
+
+static void zc_release_done(session_t *s) {
+    while (s->zc_pin_n && (int)(s->zc_pins[s->zc_pin_head].id - s->zc_done) < 0) {
+        msg_put(s->zc_pins[s->zc_pin_head].m);
+        s->zc_pin_head = (s->zc_pin_head + 1) & (s->zc_pin_cap - 1);
+        s->zc_pin_n--;
+    }
+}
+
+// Read completion notifications off s's error queue and drop the references
+// they release.
+static void zc_reap(session_t *s) {
+    char ctl[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+    while (s->zc_next != s->zc_done) {
+        struct msghdr mh; memset(&mh, 0, sizeof(mh));
+        mh.msg_control = ctl; mh.msg_controllen = sizeof(ctl);
+        if (recvmsg(s->fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) { if (errno == EINTR) continue; break; }
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+            if (!(c->cmsg_level == SOL_IP && c->cmsg_type == IP_RECVERR) &&
+                !(c->cmsg_level == SOL_IPV6 && c->cmsg_type == IPV6_RECVERR)) continue;
+            struct sock_extended_err *e = (struct sock_extended_err *)CMSG_DATA(c);
+            if (e->ee_origin != SO_EE_ORIGIN_ZEROCOPY || e->ee_errno != 0) continue;
+            if (e->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                // Loopback, or a device that cannot send from user pages:
+                // the pinning bought nothing, so go back to plain sends.
+                metric_add(M_ZC_COPIED, 1);
+                if (!ZC_KEEP_ON_COPY) s->zc = false;
+            }
+            for (unsigned id = e->ee_info, left = e->ee_data - e->ee_info + 1; left--; ++id) {
+                unsigned d = id - s->zc_done;
+                if (d < ZC_WINDOW) s->zc_ahead |= 1ull << d;
+            }
+            while (s->zc_ahead & 1) { s->zc_ahead >>= 1; s->zc_done++; }
+        }
+    }
+    zc_release_done(s);
+}
+
+// Writer thread only: drop everything queued, a partly written head entry
+// included. Caller holds q_mtx.
+static void outq_drop_locked(session_t *s) {
+    outq_discard_locked(s);
+    if (s->q_n) {
+        unsigned pin = s->zc_head_pin;
+        s->zc_head_pin = 0;
+        zc_hold(s, outq_pop_locked(s), pin);
+    }
+}
+
+// Writer thread only: write as much of s's queue as the socket takes.
+static void outq_flush(session_t *s) {
+    struct iovec iov[WRITER_IOV];
+    bool cut = false, copy_only = false;
+    if (s->zc_next - s->zc_done == ZC_WINDOW) zc_reap(s);
+    pthread_mutex_lock(&s->q_mtx);
+    while (s->q_n && !s->broken) {
+        unsigned k = s->q_n < WRITER_IOV ? s->q_n : WRITER_IOV;
+        // One sendmsg is either all zerocopy or all copied, so a batch ends
+        // where message size crosses zc_min.
+        bool zc = false;
+        if (s->zc && !copy_only) {
+            bool big = s->q[s->q_head]->len >= zc_min;
+            zc = big && s->zc_next - s->zc_done < ZC_WINDOW;
+            for (unsigned i = 1; i < k && big == zc; ++i)
+                if ((s->q[(s->q_head + i) & (OUTQ_SLOTS - 1)]->len >= zc_min) != big) k = i;
+        }
+        for (unsigned i = 0; i < k; ++i) {
+            msg_t *m = s->q[(s->q_head + i) & (OUTQ_SLOTS - 1)];
+            size_t skip = i ? 0 : s->q_off;
+            iov[i].iov_base = m->data + skip;
+            iov[i].iov_len = m->len - skip;
+        }
+        s->q_inflight = k;
+        pthread_mutex_unlock(&s->q_mtx);
+
+        struct msghdr mh; memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = iov; mh.msg_iovlen = k;
+        ssize_t n = sendmsg(s->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+        int err = errno;
+
+        pthread_mutex_lock(&s->q_mtx);
+        s->q_inflight = 0;
+        if (n < 0) {
+            if (err == EINTR) continue;
+            if (err == EAGAIN || err == EWOULDBLOCK) break; // EPOLLOUT resumes us
+            if (zc && err == ENOBUFS) { copy_only = true; continue; } // no pinnable memory left
+            s->broken = cut = true;
+            break;
+        }
+        uint64_t now = now_ns();
+        s->q_stall_ns = now;
+        metric_add(M_BYTES_OUT, (uint64_t)n);
+        unsigned pin = 0; // 1 + this send's zerocopy id
+        if (zc) { pin = ++s->zc_next; metric_add(M_ZC_BYTES, (uint64_t)n); }
+        size_t left = (size_t)n;
+        while (left) {
+            size_t rem = s->q[s->q_head]->len - s->q_off;
+            if (left < rem) { s->q_off += left; if (pin) s->zc_head_pin = pin; break; }
+            left -= rem;
+            unsigned hold = pin ? pin : s->zc_head_pin; // only the head can carry an earlier send
+            s->zc_head_pin = 0;
+            msg_t *m = outq_pop_locked(s);
+            metric_add(M_DELIVERED, 1);
+            hist_observe(H_DELIVERY, now - m->t_ns);
+            zc_hold(s, m, hold);
+        }
+    }
+    if (s->broken) outq_drop_locked(s);
+    pthread_mutex_unlock(&s->q_mtx);
+    if (cut) shutdown(s->fd, SHUT_RDWR);
+}
+
+static void session_destroy(session_t *s) {
+    epoll_ctl(writer_ep, EPOLL_CTL_DEL, s->fd, NULL);
+    if (s->zc_next != s->zc_done) {
+        // Gave up on the completions: a reset makes the kernel drop the
+        // unsent data, and with it the pages it pinned.
+        struct linger lg = { 1, 0 };
+        setsockopt(s->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(s->fd);
+    s->zc_done = s->zc_next;
+    zc_release_done(s);
+    free(s->zc_pins);
+    pthread_mutex_destroy(&s->q_mtx);
+    free(s);
+}
+
+// Close and free s, unless zerocopy sends may still read its messages: then
+// it is shut down for writing and parked on zc_draining until they complete.
+static void session_free(session_t *s) {
+    pthread_mutex_lock(&s->q_mtx);
+    outq_drop_locked(s);
+    pthread_mutex_unlock(&s->q_mtx);
+    zc_reap(s);
+    if (s->zc_next != s->zc_done) {
+        shutdown(s->fd, SHUT_WR);
+        s->zc_drain_ns = now_ns() + ZC_DRAIN_MS * 1000000ull;
+        s->ready_next = zc_draining;
+        zc_draining = s;
+        return;
+    }
+    session_destroy(s);
+}
+
+static void *writer_thread(void *arg) {
+    (void)arg;
+    struct epoll_event evs[WRITER_EVENTS];
+    while (1) {
+        int n = epoll_wait(writer_ep, evs, WRITER_EVENTS, zc_draining ? 100 : -1);
+        if (n < 0) { if (errno == EINTR) continue; perror("epoll_wait"); break; }
+        for (int i = 0; i < n; ++i) {
+            session_t *s = (session_t *)evs[i].data.ptr;
+            if (s == NULL) {
+                uint64_t v;
+                ssize_t r = read(writer_evfd, &v, sizeof(v));
+                (void)r;
+            } else {
+                // EPOLLERR also means zerocopy completions are waiting.
+                if ((evs[i].events & EPOLLERR) && s->zc_next != s->zc_done) zc_reap(s);
+                outq_flush(s);
+            }
+        }
+        // Sessions freed below cannot appear in a later epoll batch. A
+        // session is freed by whoever holds its ready claim after it died,
+        // so it is never freed while still on the stack.
+        session_t *s = __atomic_exchange_n(&ready_top, NULL, __ATOMIC_ACQUIRE);
+        while (s) {
+            session_t *next = s->ready_next;
+            if (!__atomic_load_n(&s->dead, __ATOMIC_SEQ_CST)) {
+                __atomic_store_n(&s->on_ready, 0, __ATOMIC_SEQ_CST);
+                outq_flush(s);
+                if (!__atomic_load_n(&s->dead, __ATOMIC_SEQ_CST) || !ready_claim(s)) { s = next; continue; }
+            }
+            outq_flush(s);
+            session_free(s);
+            s = next;
+        }
+        uint64_t now = zc_draining ? now_ns() : 0;
+        for (session_t **pp = &zc_draining; *pp;) {
+            session_t *d = *pp;
+            if (d->zc_next != d->zc_done && (int64_t)(now - d->zc_drain_ns) < 0) { pp = &d->ready_next; continue; }
+            *pp = d->ready_next;
+            session_destroy(d);
+        }
+    }
+    return NULL;
+}
+
+// Client thread is done with s (already out of the broadcast set): the writer
+// flushes what it can, closes the fd and frees it.
+static void session_retire(session_t *s) {
+    __atomic_store_n(&s->dead, true, __ATOMIC_SEQ_CST);
+    if (ready_claim(s)) ready_push_chain(s, s);
+}
+
+static int writer_start(void) {
+    writer_ep = epoll_create1(EPOLL_CLOEXEC);
+    writer_evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (writer_ep < 0 || writer_evfd < 0) return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(writer_ep, EPOLL_CTL_ADD, writer_evfd, &ev) < 0) return -1;
+    pthread_t th;
+    if (pthread_create(&th, NULL, writer_thread, NULL) != 0) return -1;
+    pthread_setname_np(th, "xk3-writer");
+    pthread_detach(th);
+    return 0;
+}
+
+// Peel the "@<channel> " prefix off each line of a frame. They must all
+// name the channel of the command's first line; anything else breaks the
+// framing and ends the connection.
+static int mux_strip(session_t *s, view_t *v, int n) {
+    for (int i = 0; i < n; ++i) {
+        const char *p = v[i].p, *e = p + v[i].len;
+        if (p == e || *p++ != '@') return -1;
+        const char *d = p;
+        int ch = 0;
+        while (p < e && p - d < MUX_PREFIX_MAX - 2 && *p >= '0' && *p <= '9') ch = ch * 10 + (*p++ - '0');
+        if (p == d || p == e || *p++ != ' ' || ch >= MUX_CHANNELS) return -1;
+        if (s->mux_cur < 0) s->mux_cur = ch;
+        else if (ch != s->mux_cur) return -1;
+        v[i] = (view_t){ p, (size_t)(e - p) };
+    }
+    return n;
+}
+
+// Client thread only: the next n lines as views into the receive buffer,
+// valid until the next call. Each ends with its '\n' or is cut at max bytes
+// (plus the channel prefix in MULTIPLEX mode, which is stripped), the rest
+// becoming the next line. Returns n, 0 on EOF, -1 on error.
+static int recv_lines(session_t *s, view_t *v, int n, size_t max) {
+    if (s->mux) max += MUX_PREFIX_MAX;
+    size_t need = (size_t)n * max; // all n lines at their longest
+    if (need > s->r_cap) {
+        char *p = (char *)realloc(s->rbuf, need);
+        if (!p) return -1;
+        s->rbuf = p;
+        s->r_cap = need;
+    }
+    while (1) {
+        size_t pos = s->r_off;
+        int i = 0;
+        for (; i < n; ++i) {
+            size_t k = s->r_len - pos < max ? s->r_len - pos : max;
+            const char *nl = (const char *)memchr(s->rbuf + pos, '\n', k);
+            if (nl) k = (size_t)(nl - (s->rbuf + pos)) + 1;
+            else if (k < max) break; // not all here yet
+            v[i] = (view_t){ s->rbuf + pos, k };
+            pos += k;
+        }
+        if (i == n) {
+            metric_add(M_BYTES_IN, pos - s->r_off);
+            if (s->conn_id) for (i = 0; i < n; ++i) trace_rec(TR_IN, s->conn_id, v[i].p, v[i].len);
+            s->r_off = pos;
+            return s->mux ? mux_strip(s, v, n) : n;
+        }
+        // Less than need is unread, so moving it to the front leaves room.
+        memmove(s->rbuf, s->rbuf + s->r_off, s->r_len - s->r_off);
+        s->r_len -= s->r_off;
+        s->r_off = 0;
+        ssize_t got = recv(s->fd, s->rbuf + s->r_len, s->r_cap - s->r_len, 0);
+        if (got == 0) return 0;
+        if (got < 0) { if (errno == EINTR) continue; return -1; }
+        s->r_len += (size_t)got;
+    }
+}
+
+static int online_count(void) {
+    int c = 0;
+    pthread_mutex_lock(&mtx);
+    for (int i = 0; i < MAX_CLIENTS; ++i) if (clients[i]) c++;
+    pthread_mutex_unlock(&mtx);
+    return c;
+}
+
+static session_t *session_alloc(int fd) {
+    session_t *s;
+    if (posix_memalign((void **)&s, 64, sizeof(*s)) != 0) return NULL;
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    s->slot = -1;
+    s->bset_idx = -1;
+    if (fd >= 0 && zc_min) {
+        int one = 1;
+        s->zc = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0; // TCP only
+    }
+    pthread_mutex_init(&s->q_mtx, NULL);
+    return s;
+}
+
+static session_t *add_client(int fd) {
+    session_t *s = session_alloc(fd);
+    if (!s) return NULL;
+    pthread_mutex_lock(&mtx);
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        if (!clients[i]) { clients[i] = s; s->slot = i; break; }
+    }
+    pthread_mutex_unlock(&mtx);
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLET, .data.ptr = s };
+    if (s->slot < 0 || epoll_ctl(writer_ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if (s->slot >= 0) { pthread_mutex_lock(&mtx); clients[s->slot] = NULL; pthread_mutex_unlock(&mtx); }
+        pthread_mutex_destroy(&s->q_mtx);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+// Release the connection slot and hand s to the writer to close and free.
+static void remove_client(session_t *s) {
+    pthread_mutex_lock(&mtx);
+    clients[s->slot] = NULL;
+    pthread_mutex_unlock(&mtx);
+    session_retire(s);
+}
+
+// Replace the set with a compacted copy of at least cap slots. Caller holds
+// bset_mtx; returns the old set, to be freed after synchronize_rcu(), or
+// NULL if out of memory (the current set stays valid).
+static bset_t *bset_republish_locked(int cap) {
+    bset_t *old = bset;
+    bset_t *nb = (bset_t *)malloc(sizeof(*nb) + (size_t)cap * sizeof(nb->m[0]));
+    if (!nb) return NULL;
+    nb->n = 0;
+    nb->cap = cap;
+    for (int i = 0; i < old->n; ++i) {
+        session_t *s = old->m[i];
+        if (!s) continue;
+        s->bset_idx = nb->n;
+        nb->m[nb->n++] = s;
+    }
+    bset_nholes = 0;
+    __atomic_store_n(&bset, nb, __ATOMIC_RELEASE);
+    return old;
+}
+
+// Publish s to the broadcast set. Amortized O(1); only growth waits for
+// readers.
+static bool bset_add(session_t *s) {
+    bset_t *old = NULL;
+    pthread_mutex_lock(&bset_mtx);
+    if (s->bset_idx >= 0) { pthread_mutex_unlock(&bset_mtx); return true; }
+    int idx;
+    if (bset_nholes) {
+        idx = bset_holes[--bset_nholes];
+    } else {
+        if (bset->n == bset->cap && !(old = bset_republish_locked(bset->cap * 2))) {
+            pthread_mutex_unlock(&bset_mtx);
+            return false;
+        }
+        idx = bset->n;
+    }
+    s->bset_idx = idx;
+    __atomic_store_n(&bset->m[idx], s, __ATOMIC_RELEASE);
+    if (idx == bset->n) __atomic_store_n(&bset->n, idx + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&bset_mtx);
+    if (old) { synchronize_rcu(); free(old); }
+    return true;
+}
+
+// Unpublish s; on return no broadcaster can still reach it or its fd.
+static void bset_del(session_t *s) {
+    bset_t *old = NULL;
+    pthread_mutex_lock(&bset_mtx);
+    if (s->bset_idx < 0) { pthread_mutex_unlock(&bset_mtx); return; }
+    __atomic_store_n(&bset->m[s->bset_idx], NULL, __ATOMIC_RELEASE);
+    if (bset_nholes == bset_holes_cap) {
+        int ncap = bset_holes_cap ? bset_holes_cap * 2 : BSET_MIN;
+        int *nh = (int *)realloc(bset_holes, (size_t)ncap * sizeof(*nh));
+        if (nh) { bset_holes = nh; bset_holes_cap = ncap; }
+    }
+    if (bset_nholes < bset_holes_cap) bset_holes[bset_nholes++] = s->bset_idx;
+    // (Out of memory: the hole is not reused until the next compaction.)
+    s->bset_idx = -1;
+    // Compact once holes are a quarter of the sweep, so a broadcast after a
+    // mass logout does not walk mostly NULLs.
+    if (bset->n > BSET_MIN && bset->n - bset_nholes < bset->n / 4 * 3) old = bset_republish_locked(bset->cap);
+    pthread_mutex_unlock(&bset_mtx);
+    synchronize_rcu();
+    free(old);
+}
+
+// Queue m (whole '\n'-terminated lines) to every authed session and, if
+// cluster is set, to every peer link.
+static void broadcast_msg(msg_t *m, bool cluster) {
+    uint64_t now = now_ns();
+    m->t_ns = now;
+    session_t *first = NULL, *last = NULL;
+    rcu_read_lock();
+    bset_t *b = __atomic_load_n(&bset, __ATOMIC_ACQUIRE);
+    int n = __atomic_load_n(&b->n, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < n + (cluster ? bus_npeers : 0); ++i) {
+        session_t *s;
+        if (i < n) {
+            // A straight sweep of the pointer array; pull in the queue header
+            // of a member a few steps ahead so its lock is warm on arrival.
+            if (i + BSET_PREFETCH < n) {
+                session_t *ahead = __atomic_load_n(&b->m[i + BSET_PREFETCH], __ATOMIC_RELAXED);
+                if (ahead) { __builtin_prefetch(ahead, 1); __builtin_prefetch((char *)ahead + 64, 1); }
+            }
+            s = __atomic_load_n(&b->m[i], __ATOMIC_ACQUIRE);
+        } else {
+            s = __atomic_load_n(&bus_peers[i - n].link, __ATOMIC_ACQUIRE);
+        }
+        if (s && outq_push(s, m, now) && ready_claim(s)) {
+            s->ready_next = first;
+            first = s;
+            if (!last) last = s;
+        }
+    }
+    rcu_read_unlock();
+    if (first) ready_push_chain(first, last); // one wakeup per broadcast
+    hist_observe(H_FANOUT, now_ns() - now);
+}
+
+// Queue one line ('\n'-terminated) to every authed session in the cluster.
+static void broadcast_raw(const char *line, size_t L) {
+    msg_t *m = msg_new(line, L);
+    if (!m) return;
+    broadcast_msg(m, true);
+    msg_put(m);
+}
+
+// ---- Cluster bus ----
+// Each process dials every peer once and only ever writes on that link; the
+// peer only ever reads it. Both ends stay FIFO, so per-sender order holds
+// without sequence numbers, and since received lines are never forwarded
+// there are no loops or duplicates.
+//
+// An inbound link is only read if it comes from a configured peer (its IPv4
+// address, or our own uid on a Unix socket), and, with XK3_BUS_KEY set, if
+// it answers a challenge: the listener sends "XK3BUS? <nonce>" and the
+// dialer must reply "XK3BUS 1 <mac>", the SipHash-2-4 of the nonce under the
+// shared key, within BUS_HANDSHAKE_MS. Without a key the hello is the bare
+// BUS_HELLO. Lines are not signed and the bus is not encrypted: keep it on a
+// trusted network.
+
+#define BUS_HELLO "XK3BUS 1\n"
+#define BUS_CHALLENGE "XK3BUS? "
+
+static int bus_inbound; // live reader threads
+static uint64_t bus_key[2];
+static bool bus_keyed;
+
+static uint64_t siphash24(const uint64_t key[2], const void *buf, size_t len); // Resume tokens
+
+static uint64_t bus_mac(uint64_t nonce) {
+    return siphash24(bus_key, &nonce, sizeof(nonce));
+}
+
+static void bus_timeout(int fd, int ms) {
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+// Is the other end of an accepted fd one of XK3_BUS_PEERS?
+static bool bus_peer_allowed(int fd) {
+    struct sockaddr_storage ss;
+    socklen_t sl = sizeof(ss);
+    if (getpeername(fd, (struct sockaddr *)&ss, &sl) < 0) return false;
+    if (ss.ss_family == AF_UNIX) {
+        struct ucred cr;
+        socklen_t cl = sizeof(cr);
+        return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &cl) == 0 && cr.uid == geteuid();
+    }
+    if (ss.ss_family != AF_INET) return false;
+    const struct sockaddr_in *in = (const struct sockaddr_in *)&ss;
+    for (int i = 0; i < bus_npeers; ++i) {
+        const struct sockaddr_in *p = (const struct sockaddr_in *)&bus_peers[i].addr;
+        if (p->sin_family == AF_INET && p->sin_addr.s_addr == in->sin_addr.s_addr) return true;
+    }
+    return false;
+}
+
+// Dialer side of the challenge: read "XK3BUS? <nonce>\n" and build the reply.
+static bool bus_answer(int fd, char *hello, size_t cap) {
+    char line[64];
+    size_t len = 0;
+    bus_timeout(fd, BUS_HANDSHAKE_MS);
+    while (len < sizeof(line) - 1 && (len == 0 || line[len - 1] != '\n')) {
+        ssize_t n = recv(fd, line + len, 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        len += (size_t)n;
+    }
+    bus_timeout(fd, 0);
+    line[len] = '\0';
+    unsigned long long nonce;
+    char nl;
+    if (strncmp(line, BUS_CHALLENGE, sizeof(BUS_CHALLENGE) - 1) != 0 ||
+        sscanf(line + sizeof(BUS_CHALLENGE) - 1, "%16llx%c", &nonce, &nl) != 2 || nl != '\n') return false;
+    snprintf(hello, cap, "XK3BUS 1 %016llx\n", (unsigned long long)bus_mac(nonce));
+    return true;
+}
+
+// "host:port" (empty host = loopback, 0.0.0.0 = every interface) or an
+// absolute Unix socket path.
+static int bus_parse_addr(const char *spec, struct sockaddr_storage *ss, socklen_t *len) {
+    memset(ss, 0, sizeof(*ss));
+    if (spec[0] == '/') {
+        struct sockaddr_un *un = (struct sockaddr_un *)ss;
+        if (strlen(spec) >= sizeof(un->sun_path)) return -1;
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, spec);
+        *len = sizeof(*un);
+        return 0;
+    }
+    const char *colon = strrchr(spec, ':');
+    if (!colon || atoi(colon + 1) <= 0) return -1;
+    char host[64];
+    size_t hl = (size_t)(colon - spec);
+    if (hl >= sizeof(host)) return -1;
+    memcpy(host, spec, hl); host[hl] = '\0';
+    struct sockaddr_in *in = (struct sockaddr_in *)ss;
+    in->sin_family = AF_INET;
+    in->sin_port = htons((uint16_t)atoi(colon + 1));
+    if (hl == 0) in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    else if (inet_pton(AF_INET, host, &in->sin_addr) != 1) return -1;
+    *len = sizeof(*in);
+    return 0;
+}
+
+static void bus_sleep_retry(void) {
+    struct timespec d = { BUS_RETRY_MS / 1000, (BUS_RETRY_MS % 1000) * 1000000L };
+    nanosleep(&d, NULL);
+}
+
+// One per peer: keep an outbound link up and published.
+static void *bus_dialer(void *arg) {
+    bus_peer_t *p = (bus_peer_t *)arg;
+    bool was_up = false, warned = false;
+    while (1) {
+        int fd = socket(p->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&p->addr, p->addrlen) < 0) {
+            if (fd >= 0) close(fd);
+            bus_sleep_retry();
+            continue;
+        }
+        char hello[48] = BUS_HELLO;
+        if (bus_keyed && !bus_answer(fd, hello, sizeof(hello))) {
+            if (!warned) fprintf(stderr, "Bus link to %s: no valid challenge (XK3_BUS_KEY on both ends?)\n", p->spec);
+            warned = true;
+            close(fd);
+            bus_sleep_retry();
+            continue;
+        }
+        int one = 1;
+        if (p->addr.ss_family == AF_INET) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        session_t *s = session_alloc(fd);
+        struct epoll_event ev = { .events = EPOLLOUT | EPOLLET, .data.ptr = s };
+        if (!s || epoll_ctl(writer_ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            if (s) { pthread_mutex_destroy(&s->q_mtx); free(s); }
+            close(fd);
+            bus_sleep_retry();
+            continue;
+        }
+        session_send(s, hello, strlen(hello));
+        __atomic_store_n(&p->link, s, __ATOMIC_RELEASE);
+        metric_add(M_BUS_LINKS, 1);
+        printf("Bus link to %s %s\n", p->spec, was_up ? "re-established" : "up");
+        fflush(stdout);
+        was_up = true;
+
+        // The peer never writes; this returns when it goes away or the
+        // writer shuts the link down (write error, slow-consumer cut).
+        char sink[64];
+        ssize_t n;
+        while ((n = recv(fd, sink, sizeof(sink), 0)) > 0 || (n < 0 && errno == EINTR)) {}
+
+        __atomic_store_n(&p->link, NULL, __ATOMIC_RELEASE);
+        synchronize_rcu(); // no broadcaster still holds s
+        session_retire(s);
+        bus_sleep_retry();
+    }
+    return NULL;
+}
+
+static void index_submit(msg_t *m); // Chat history and search
+
+// One per inbound link: deliver each batch of whole lines to local sessions.
+static void *bus_reader(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    char *buf = rcu_register_thread() ? (char *)malloc(BUS_RBUF) : NULL;
+    size_t len = 0;
+    bool hello = false;
+    char want[48] = BUS_HELLO;
+    if (!bus_peer_allowed(fd)) { free(buf); buf = NULL; }
+    if (buf && bus_keyed) {
+        uint64_t nonce;
+        char ch[48];
+        if (getrandom(&nonce, sizeof(nonce), 0) != (ssize_t)sizeof(nonce)) { free(buf); buf = NULL; }
+        else {
+            int cl = snprintf(ch, sizeof(ch), BUS_CHALLENGE "%016llx\n", (unsigned long long)nonce);
+            snprintf(want, sizeof(want), "XK3BUS 1 %016llx\n", (unsigned long long)bus_mac(nonce));
+            if (send(fd, ch, (size_t)cl, MSG_NOSIGNAL) != cl) { free(buf); buf = NULL; }
+        }
+    }
+    bus_timeout(fd, BUS_HANDSHAKE_MS);
+    size_t wl = strlen(want);
+    while (buf) {
+        ssize_t n = recv(fd, buf + len, BUS_RBUF - len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += (size_t)n;
+        char *nl = (char *)memrchr(buf, '\n', len);
+        if (!nl) { if (len == BUS_RBUF) len = 0; continue; } // drop an over-long line
+        size_t k = (size_t)(nl - buf) + 1, off = 0;
+        if (!hello) {
+            unsigned char diff = k < wl;
+            for (size_t i = 0; i < wl && i < k; ++i) diff |= (unsigned char)(buf[i] ^ want[i]);
+            if (diff) break; // not a peer
+            hello = true;
+            off = wl;
+            bus_timeout(fd, 0);
+        }
+        if (k > off) {
+            metric_add(M_BUS_BYTES_IN, k - off);
+            msg_t *m = msg_new(buf + off, k - off);
+            if (m) { broadcast_msg(m, false); index_submit(m); msg_put(m); }
+        }
+        memmove(buf, buf + k, len - k);
+        len -= k;
+    }
+    free(buf);
+    close(fd);
+    metrics_thread_exit();
+    rcu_unregister_thread(); // before the slot can be handed to a new link
+    __atomic_sub_fetch(&bus_inbound, 1, __ATOMIC_ACQ_REL);
+    return NULL;
+}
+
+static void *bus_accept_thread(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) { if (errno == EINTR || errno == ECONNABORTED) continue; perror("bus accept"); break; }
+        if (__atomic_add_fetch(&bus_inbound, 1, __ATOMIC_ACQ_REL) > BUS_MAX_PEERS) {
+            __atomic_sub_fetch(&bus_inbound, 1, __ATOMIC_ACQ_REL);
+            close(fd);
+            continue;
+        }
+        pthread_t th;
+        if (pthread_create(&th, NULL, bus_reader, (void *)(intptr_t)fd) != 0) {
+            __atomic_sub_fetch(&bus_inbound, 1, __ATOMIC_ACQ_REL);
+            close(fd);
+            continue;
+        }
+        pthread_detach(th);
+    }
+    return NULL;
+}
+
+// XK3_BUS: our bus address; XK3_BUS_PEERS: everyone else's. Off unless set.
+static int bus_start(void) {
+    const char *self = getenv("XK3_BUS");
+    const char *peers = getenv("XK3_BUS_PEERS");
+    if (!self || !*self) {
+        if (peers && *peers) { fprintf(stderr, "XK3_BUS_PEERS needs XK3_BUS\n"); errno = EINVAL; return -1; }
+        return 0;
+    }
+    struct sockaddr_storage ss; socklen_t sl;
+    if (bus_parse_addr(self, &ss, &sl) < 0) { fprintf(stderr, "XK3_BUS: bad address %s\n", self); errno = EINVAL; return -1; }
+    const char *key = getenv("XK3_BUS_KEY");
+    if (key && *key) {
+        unsigned long long a, b;
+        if (strlen(key) != 32 || sscanf(key, "%16llx%16llx", &a, &b) != 2) { fprintf(stderr, "XK3_BUS_KEY: need 32 hex digits\n"); errno = EINVAL; return -1; }
+        bus_key[0] = a; bus_key[1] = b;
+        bus_keyed = true;
+    }
+
+    char *list = strdup(peers ? peers : "");
+    if (!list) return -1;
+    char *save = NULL;
+    for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (!*tok || strcmp(tok, self) == 0) continue; // ourselves
+        if (bus_npeers == BUS_MAX_PEERS) { fprintf(stderr, "XK3_BUS_PEERS: more than %d peers\n", BUS_MAX_PEERS); errno = EINVAL; return -1; }
+        bus_peer_t *p = &bus_peers[bus_npeers];
+        if (bus_parse_addr(tok, &p->addr, &p->addrlen) < 0) { fprintf(stderr, "XK3_BUS_PEERS: bad address %s\n", tok); errno = EINVAL; return -1; }
+        p->spec = tok; // list is never freed
+        bus_npeers++;
+    }
+
+    if (ss.ss_family == AF_UNIX) unlink(self);
+    int lfd = socket(ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int yes = 1;
+    if (lfd >= 0 && ss.ss_family == AF_INET) setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&ss, sl) < 0 || listen(lfd, BUS_MAX_PEERS) < 0) return -1;
+    pthread_t th;
+    if (pthread_create(&th, NULL, bus_accept_thread, (void *)(intptr_t)lfd) != 0) return -1;
+    pthread_detach(th);
+    for (int i = 0; i < bus_npeers; ++i) {
+        if (pthread_create(&th, NULL, bus_dialer, &bus_peers[i]) != 0) return -1;
+        pthread_detach(th);
+    }
+    printf("Bus on %s, %d peer(s)%s\n", self, bus_npeers, bus_keyed ? ", keyed" : "");
+    return 0;
+}
+
+// ---- User store ----
+//
+// Accounts are 32-byte records in chunks that are allocated as needed and
+// never move, so a user_t * stays valid and the table holds 32-bit ids.
+// Their strings are appended to an arena of 1 MiB chunks: a length byte, the
+// bytes, a NUL. A ref is chunk << ARENA_CHUNK_BITS | offset of the first
+// byte. SIDs are interned, so students with several accounts store theirs
+// once. Nothing is ever freed. SIGNUP is the only writer (users_mtx); a
+// reader that found a record through the table sees its chunk and strings.
+
+static user_t *user_chunk[(MAX_USERS >> USER_CHUNK_BITS) + 1];
+static uint32_t users_n;                          // records in use
+static char *arena_chunk[1u << (32 - ARENA_CHUNK_BITS)];
+static uint32_t arena_top;                        // next free ref
+static strtab_t *sid_tab;                         // interned SIDs: their refs
+
+static inline user_t *user_at(uint32_t id) {
+    return &user_chunk[id >> USER_CHUNK_BITS][id & ((1u << USER_CHUNK_BITS) - 1)];
+}
+
+static inline const char *arena_str(uint32_t ref) {
+    return arena_chunk[ref >> ARENA_CHUNK_BITS] + (ref & ((1u << ARENA_CHUNK_BITS) - 1));
+}
+
+static inline size_t arena_len(uint32_t ref) {
+    return (unsigned char)arena_str(ref)[-1];
+}
+
+static bool arena_eq(uint32_t ref, const char *p, size_t len) {
+    const char *a = arena_str(ref);
+    return (unsigned char)a[-1] == len && memcmp(a, p, len) == 0;
+}
+
+// Appends p[len] (len <= FIELD_MAX). Returns false when the arena is full.
+static bool arena_put(const char *p, size_t len, uint32_t *ref) {
+    const uint32_t csz = 1u << ARENA_CHUNK_BITS;
+    uint32_t c = arena_top >> ARENA_CHUNK_BITS, off = arena_top & (csz - 1);
+    if (arena_chunk[c] && off + len + 2 >= csz) { // no room left (the top never reaches the next chunk)
+        if (++c == sizeof(arena_chunk) / sizeof(arena_chunk[0])) return false;
+        off = 0;
+    }
+    if (!arena_chunk[c] && !(arena_chunk[c] = (char *)malloc(csz))) return false;
+    arena_top = c << ARENA_CHUNK_BITS | off;
+    char *d = arena_chunk[c] + off;
+    d[0] = (char)len;
+    memcpy(d + 1, p, len);
+    d[len + 1] = '\0';
+    *ref = arena_top + 1;
+    arena_top += (uint32_t)len + 2;
+    return true;
+}
+
+static uint64_t str_hash(const char *s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull; // FNV-1a
+    for (size_t i = 0; i < len; ++i) { h ^= (unsigned char)s[i]; h *= 0x100000001b3ull; }
+    // FNV's low bits only see the bytes' low bits, which cluster digit-only
+    // strings; the tables index by low bits, so mix the high ones down.
+    h ^= h >> 32; h *= 0xd6e8feb86659fd93ull; h ^= h >> 32;
+    return h;
+}
+
+static strtab_t *strtab_new(unsigned slots, uint32_t tag_mask) {
+    strtab_t *t = (strtab_t *)calloc(1, sizeof(*t) + slots * sizeof(t->slot[0]));
+    if (t) { t->mask = slots - 1; t->tag_mask = tag_mask; }
+    return t;
+}
+
+static uint32_t strtab_probe(const strtab_t *t, uint64_t h, const char *p, size_t len, strtab_key_fn key) {
+    uint32_t tag = (uint32_t)(h >> 32) & t->tag_mask;
+    for (unsigned i = (unsigned)h & t->mask;; i = (i + 1) & t->mask) {
+        uint32_t v = __atomic_load_n(&t->slot[i], __ATOMIC_ACQUIRE);
+        if (!v) return 0;
+        if ((v & t->tag_mask) == tag && arena_eq(key(v), p, len)) return v;
+    }
+}
+
+// Lock-free for tables readers reach under RCU. Returns the value or 0.
+static uint32_t strtab_find(const strtab_t *t, uint64_t h, const char *p, size_t len, strtab_key_fn key) {
+    // Load old first: once it reads NULL every migrated slot is visible in t.
+    const strtab_t *old = __atomic_load_n(&t->old, __ATOMIC_ACQUIRE);
+    uint32_t v = strtab_probe(t, h, p, len, key);
+    if (!v && old) v = strtab_probe(old, h, p, len, key);
+    return v;
+}
+
+static void strtab_put(strtab_t *t, uint32_t v, uint64_t h) {
+    unsigned i = (unsigned)h & t->mask;
+    while (t->slot[i]) i = (i + 1) & t->mask;
+    __atomic_store_n(&t->slot[i], v, __ATOMIC_RELEASE);
+    t->count++;
+}
+
+// Moves up to n more slots of t->old into t; retires old when done.
+static void strtab_migrate(strtab_t *t, unsigned n, strtab_key_fn key) {
+    strtab_t *old = t->old;
+    for (; n && t->migrated <= old->mask; --n, ++t->migrated) {
+        uint32_t v = old->slot[t->migrated];
+        if (!v) continue;
+        uint32_t ref = key(v);
+        strtab_put(t, v, str_hash(arena_str(ref), arena_len(ref)));
+    }
+    if (t->migrated > old->mask) {
+        __atomic_store_n(&t->old, NULL, __ATOMIC_RELEASE);
+        synchronize_rcu(); // no reader is still probing old
+        free(old);
+    }
+}
+
+// Adds v, hash h, which must not be in *tp yet. Writer only. The table grows
+// incrementally: at half full a doubled table is published empty, pointing
+// at the old one, and every add after that moves USERS_MIGRATE old slots
+// across. The last one moves long before the new table is half full, so no
+// add ever rehashes the whole set.
+static bool strtab_add(strtab_t **tp, uint32_t v, uint64_t h, strtab_key_fn key) {
+    strtab_t *t = *tp;
+    if (t->old) strtab_migrate(t, USERS_MIGRATE, key);
+    if ((t->count + 1) * 2 > t->mask + 1) {
+        if (t->old) strtab_migrate(t, t->old->mask + 1, key); // only if USERS_MIGRATE is too low
+        strtab_t *nt = strtab_new((t->mask + 1) * 2, t->tag_mask);
+        if (!nt) return false;
+        nt->old = t;
+        __atomic_store_n(tp, nt, __ATOMIC_RELEASE);
+        t = nt;
+        strtab_migrate(t, USERS_MIGRATE, key);
+    }
+    strtab_put(t, (v & ~t->tag_mask) | ((uint32_t)(h >> 32) & t->tag_mask), h);
+    return true;
+}
+
+static uint32_t sid_key(uint32_t v) { return v; }
+static uint32_t user_key(uint32_t v) { return user_at((v & ((1u << USER_ID_BITS) - 1)) - 1)->acc; }
+
+// The arena copy of this SID, added if new. Caller holds users_mtx.
+static bool sid_intern(const char *p, size_t len, uint32_t *ref) {
+    uint64_t h = str_hash(p, len);
+    if ((*ref = strtab_find(sid_tab, h, p, len, sid_key))) return true;
+    return arena_put(p, len, ref) && strtab_add(&sid_tab, *ref, h, sid_key);
+}
+
+// Lock-free lookup; user records are never freed, so the result stays valid
+// after the read-side section ends.
+static user_t *users_find_by_acc(const char *acc, size_t len) {
+    if (len > FIELD_MAX) return NULL;
+    uint64_t h = str_hash(acc, len);
+    rcu_read_lock();
+    uint32_t v = strtab_find(__atomic_load_n(&users_tab, __ATOMIC_ACQUIRE), h, acc, len, user_key);
+    rcu_read_unlock();
+    return v ? user_at((v & ((1u << USER_ID_BITS) - 1)) - 1) : NULL;
+}
+
+typedef enum { USERS_OK, USERS_EXISTS, USERS_FULL } users_add_t;
+
+// SIGNUP: the only writer. The account must not be longer than FIELD_MAX;
+// a longer SID is cut.
+static users_add_t users_add(view_t sid, view_t acc, view_t pwd) {
+    if (sid.len > FIELD_MAX) sid.len = FIELD_MAX;
+    pthread_mutex_lock(&users_mtx);
+    users_add_t ret = USERS_FULL;
+    if (users_find_by_acc(acc.p, acc.len)) { ret = USERS_EXISTS; goto out; }
+    uint32_t id = users_n;
+    if (id >= MAX_USERS) goto out;
+    user_t **chunk = &user_chunk[id >> USER_CHUNK_BITS];
+    if (!*chunk && !(*chunk = (user_t *)calloc(1u << USER_CHUNK_BITS, sizeof(user_t)))) goto out;
+    user_t *u = user_at(id);
+    // On failure the record stays unused and what reached the arena is lost.
+    if (!sid_intern(sid.p, sid.len, &u->sid) ||
+        !arena_put(acc.p, acc.len, &u->acc) ||
+        !arena_put(pwd.p, pwd.len, &u->pwd) ||
+        !strtab_add(&users_tab, id + 1, str_hash(acc.p, acc.len), user_key)) goto out;
+    users_n++;
+    ret = USERS_OK;
+out:
+    pthread_mutex_unlock(&users_mtx);
+    return ret;
+}
+
+// ---- Resume tokens ----
+
+static uint64_t resume_key[2];
+static uint64_t resume_ttl_s = RESUME_TTL_DEFAULT_S;
+static uint64_t resume_quiet_ns = RESUME_QUIET_DEFAULT_S * 1000000000ull; // offline hold
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+} while (0)
+
+// SipHash-2-4 of buf under key.
+static uint64_t siphash24(const uint64_t key[2], const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t v0 = 0x736f6d6570736575ull ^ key[0], v1 = 0x646f72616e646f6dull ^ key[1];
+    uint64_t v2 = 0x6c7967656e657261ull ^ key[0], v3 = 0x7465646279746573ull ^ key[1];
+    uint64_t b = (uint64_t)len << 56;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t m; memcpy(&m, p, 8); // little-endian hosts
+        v3 ^= m; SIPROUND; SIPROUND; v0 ^= m;
+    }
+    for (size_t i = 0; i < len; ++i) b |= (uint64_t)p[i] << (8 * i);
+    v3 ^= b; SIPROUND; SIPROUND; v0 ^= b;
+    v2 ^= 0xff; SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+static uint64_t resume_mac(const char *acc, size_t len, unsigned long long expiry) {
+    char buf[96];
+    int n = snprintf(buf, sizeof(buf), "%llu.%.*s", expiry, (int)len, acc);
+    return siphash24(resume_key, buf, (size_t)n);
+}
+
+static void resume_token(const user_t *u, char *out, size_t cap) {
+    unsigned long long expiry = (unsigned long long)time(NULL) + resume_ttl_s;
+    const char *acc = arena_str(u->acc);
+    snprintf(out, cap, "%016llx.%llu.%s", (unsigned long long)resume_mac(acc, arena_len(u->acc), expiry), expiry, acc);
+}
+
+// O(1): one MAC and one hash probe. Returns the user or NULL.
+static user_t *resume_verify(view_t tok) {
+    const char *p = tok.p, *end = tok.p + tok.len;
+    unsigned long long mac = 0, expiry = 0;
+    if (tok.len < 19) return NULL; // "<16 hex>.<digit>."
+    for (int i = 0; i < 16; ++i, ++p) {
+        unsigned c = (unsigned char)*p, d = c - '0', x = (c | 0x20) - 'a';
+        if (d > 9 && x > 5) return NULL;
+        mac = mac << 4 | (d <= 9 ? d : x + 10);
+    }
+    if (*p++ != '.') return NULL;
+    const char *ep = p;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p) expiry = expiry * 10 + (unsigned)(*p - '0');
+    if (p == ep || p == end || *p != '.') return NULL;
+    const char *acc = p + 1;
+    size_t alen = (size_t)(end - acc);
+    if (alen > FIELD_MAX) return NULL;
+    if (expiry < (unsigned long long)time(NULL)) return NULL;
+    uint64_t want = resume_mac(acc, alen, expiry);
+    if (want != mac) return NULL;
+    return users_find_by_acc(acc, alen);
+}
+
+static int resume_init(void) {
+    const char *v = getenv("XK3_RESUME_KEY");
+    if (v && *v) {
+        unsigned long long a, b;
+        if (strlen(v) != 32 || sscanf(v, "%16llx%16llx", &a, &b) != 2) { errno = EINVAL; return -1; }
+        resume_key[0] = a; resume_key[1] = b;
+    } else if (getrandom(resume_key, sizeof(resume_key), 0) != (ssize_t)sizeof(resume_key)) {
+        return -1;
+    }
+    if ((v = getenv("XK3_RESUME_TTL")) && atol(v) > 0) resume_ttl_s = (uint64_t)atol(v);
+    if ((v = getenv("XK3_RESUME_QUIET"))) resume_quiet_ns = (uint64_t)atol(v) * 1000000000ull;
+    return 0;
+}
+
+static bool valid_len(view_t v) {
+    return v.len >= 8 && v.len <= 15;
+}
+
+static bool contains_upper_and_symbol(view_t v) {
+    bool upper = false, symbol = false;
+    for (const unsigned char *p=(const unsigned char*)v.p, *e=p+v.len; p < e; ++p) {
+        if (*p >= 'A' && *p <= 'Z') upper = true;
+        if (!( (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9') ))
+            symbol = true;
+    }
+    return upper && symbol;
+}
+
+// A line without its trailing "\r\n".
+static view_t chomp(view_t v) {
+    while (v.len && (v.p[v.len-1] == '\r' || v.p[v.len-1] == '\n')) v.len--;
+    return v;
+}
+
+static bool parse_kv(view_t line, const char *key, view_t *out) {
+    // expects "KEY:value"; out points into line
+    size_t klen = strlen(key);
+    if (line.len <= klen || memcmp(line.p, key, klen) != 0) return false;
+    if (line.p[klen] != ':') return false;
+    *out = chomp((view_t){ line.p + klen + 1, line.len - klen - 1 });
+    return true;
+}
+
+// ---- Write-ahead chat log ----
+
+typedef enum { WAL_OFF, WAL_NONE, WAL_GROUP, WAL_MESSAGE } wal_mode_t;
+
+typedef struct {
+    uint32_t len;       // payload bytes
+    uint32_t crc;       // CRC-32 of seq, unix_ns and payload
+    uint64_t seq;
+    uint64_t unix_ns;
+} wal_hdr_t;
+
+enum { WAL_PENDING, WAL_WAITING, WAL_DONE, WAL_FAILED };
+
+typedef struct wal_rec {
+    struct wal_rec *next;
+    int state;          // futex word; the sender sleeps on it (group/message modes)
+    uint64_t t_ns;
+    wal_hdr_t h;
+    char payload[];
+} wal_rec_t;
+
+static wal_mode_t wal_mode = WAL_GROUP;
+static uint64_t wal_segment_max = (uint64_t)WAL_SEGMENT_DEFAULT_MB << 20;
+static uint64_t wal_window_ns = WAL_WINDOW_DEFAULT_US * 1000ull;
+static const char *wal_dir = WAL_DEFAULT_DIR;
+static int wal_fd = -1;
+static uint64_t wal_seg_bytes, wal_next_seq;
+static bool wal_broken;  // a write or sync failed; nothing more is logged
+
+// Vyukov MPSC queue: producers swap the tail, the log thread follows next.
+static wal_rec_t wal_stub;
+static wal_rec_t *wal_tail = &wal_stub;
+static wal_rec_t *wal_head = &wal_stub;  // log thread only
+static int wal_kick;                     // futex word: 1 once there is work
+
+static long futex(int *uaddr, int op, int val) {
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static uint32_t crc_table[256]; // filled by wal_start
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    crc = ~crc;
+    while (len--) crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t wal_crc(const wal_hdr_t *h, const char *payload) {
+    uint32_t c = crc32_update(0, &h->seq, sizeof(h->seq) + sizeof(h->unix_ns));
+    return crc32_update(c, payload, h->len);
+}
+
+// Sender side. Returns once the record is durable under the current mode
+// (immediately for none), false if it could not be logged. Never takes a lock.
+static bool wal_append(const char *sid, const char *msg, size_t lm) {
+    if (wal_mode == WAL_OFF) return true;
+    if (__atomic_load_n(&wal_broken, __ATOMIC_ACQUIRE)) return false;
+    size_t ls = strlen(sid);
+    wal_rec_t *r = (wal_rec_t *)malloc(sizeof(*r) + ls + 1 + lm);
+    if (!r) return false;
+    memcpy(r->payload, sid, ls);
+    r->payload[ls] = '\t';
+    memcpy(r->payload + ls + 1, msg, lm);
+    r->h.len = (uint32_t)(ls + 1 + lm);
+    r->next = NULL;
+    r->state = WAL_PENDING;
+    r->t_ns = now_ns();
+    struct timespec ts; clock_gettime(CLOCK_REALTIME, &ts);
+    r->h.unix_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    bool wait = wal_mode != WAL_NONE; // otherwise the log thread frees r
+
+    wal_rec_t *prev = __atomic_exchange_n(&wal_tail, r, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, r, __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&wal_kick, 1, __ATOMIC_SEQ_CST) == 0) futex(&wal_kick, FUTEX_WAKE_PRIVATE, 1);
+    if (!wait) return true;
+
+    int st = WAL_PENDING;
+    if (__atomic_compare_exchange_n(&r->state, &st, WAL_WAITING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        while ((st = __atomic_load_n(&r->state, __ATOMIC_ACQUIRE)) == WAL_WAITING)
+            futex(&r->state, FUTEX_WAIT_PRIVATE, WAL_WAITING);
+    }
+    hist_observe(H_WAL_COMMIT, now_ns() - r->t_ns);
+    free(r);
+    return st == WAL_DONE;
+}
+
+// Log thread: pop the oldest record, or NULL if none is fully linked yet.
+static wal_rec_t *wal_pop(void) {
+    wal_rec_t *head = wal_head, *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (head == &wal_stub) {
+        if (!next) return NULL;
+        wal_head = head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) { wal_head = next; return head; }
+    if (head != __atomic_load_n(&wal_tail, __ATOMIC_ACQUIRE)) return NULL; // a producer is mid-link
+    // head is the last record: put the stub behind it so it can be handed out.
+    wal_stub.next = NULL;
+    wal_rec_t *prev = __atomic_exchange_n(&wal_tail, &wal_stub, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, &wal_stub, __ATOMIC_RELEASE);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next) { wal_head = next; return head; }
+    return NULL;
+}
+
+static void wal_complete(wal_rec_t *r, bool ok) {
+    if (wal_mode == WAL_NONE) { free(r); return; }
+    if (__atomic_exchange_n(&r->state, ok ? WAL_DONE : WAL_FAILED, __ATOMIC_ACQ_REL) == WAL_WAITING)
+        futex(&r->state, FUTEX_WAKE_PRIVATE, 1);
+    // r now belongs to the sender again
+}
+
+static int fsync_dir(const char *dir) {
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return -1;
+    int rc = fsync(dfd);
+    close(dfd);
+    return rc;
+}
+
+static int wal_open_segment(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%020llu.wal", wal_dir, (unsigned long long)wal_next_seq);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    if (wal_mode != WAL_NONE) fsync_dir(wal_dir);
+    if (wal_fd >= 0) {
+        if (wal_mode != WAL_NONE) fdatasync(wal_fd);
+        close(wal_fd);
+    }
+    wal_fd = fd;
+    wal_seg_bytes = 0;
+    return 0;
+}
+
+static int write_fullv(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t n = writev(fd, iov, cnt);
+        if (n < 0) { if (errno == EINTR) continue; return -1; }
+        while (cnt > 0 && (size_t)n >= iov->iov_len) { n -= (ssize_t)iov->iov_len; ++iov; --cnt; }
+        if (cnt > 0) { iov->iov_base = (char *)iov->iov_base + n; iov->iov_len -= (size_t)n; }
+    }
+    return 0;
+}
 
-typedef struct {
-    int fd;
-    bool in_use;
-    bool authed;
-    int user_idx;       // index in users[]
-} client_t;
+static int wal_sync(void) {
+    metric_add(M_WAL_SYNCS, 1);
+    return fdatasync(wal_fd);
+}
 
-static user_t users[MAX_USERS];
-static client_t clients[MAX_CLIENTS];
-static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+// After a failed write or fdatasync the segment may end in a partial record and the kernel
+// may have dropped dirty pages, so nothing after it could be trusted: stop logging and fail
+// every CHAT from here on instead of acknowledging it.
+static void wal_fail(const char *what) {
+    perror(what);
+    fprintf(stderr, "wal: chat log disabled; CHAT will be refused\n");
+    metric_add(M_WAL_ERRORS, 1);
+    __atomic_store_n(&wal_broken, true, __ATOMIC_RELEASE);
+}
 
-static void safe_send(int fd, const char *buf, size_t len) {
-    size_t off = 0;
-    while (off < len) {
-        ssize_t n = send(fd, buf + off, len - off, 0);
-        if (n < 0) { if (errno == EINTR) continue; break; }
-        if (n == 0) break;
-        off += (size_t)n;
+static void *wal_thread(void *arg) {
+    (void)arg;
+    wal_rec_t *batch[WAL_BATCH];
+    struct iovec iov[2 * WAL_BATCH];
+    while (1) {
+        wal_rec_t *r = wal_pop();
+        if (!r) {
+            __atomic_store_n(&wal_kick, 0, __ATOMIC_SEQ_CST);
+            if ((r = wal_pop()) == NULL) {
+                futex(&wal_kick, FUTEX_WAIT_PRIVATE, 0);
+                continue;
+            }
+        }
+        // Hold the group open so concurrent senders share one sync.
+        if (wal_mode == WAL_GROUP && wal_window_ns) {
+            uint64_t until = r->t_ns + wal_window_ns, now = now_ns();
+            if (until > now) {
+                struct timespec d = { (time_t)((until - now) / 1000000000ull), (long)((until - now) % 1000000000ull) };
+                nanosleep(&d, NULL);
+            }
+        }
+        int n = 0;
+        size_t bytes = 0;
+        do {
+            r->h.seq = wal_next_seq++;
+            r->h.crc = wal_crc(&r->h, r->payload);
+            iov[2 * n] = (struct iovec){ &r->h, sizeof(r->h) };
+            iov[2 * n + 1] = (struct iovec){ r->payload, r->h.len };
+            bytes += sizeof(r->h) + r->h.len;
+            batch[n++] = r;
+            if (wal_mode == WAL_MESSAGE) break;
+        } while (n < WAL_BATCH && (r = wal_pop()) != NULL);
+
+        bool ok = !wal_broken;
+        if (ok && write_fullv(wal_fd, iov, 2 * n) < 0) { wal_fail("wal write"); ok = false; }
+        if (ok && wal_mode != WAL_NONE && wal_sync() < 0) { wal_fail("wal fdatasync"); ok = false; }
+        for (int i = 0; i < n; ++i) wal_complete(batch[i], ok);
+        if (!ok) continue;
+        wal_seg_bytes += bytes;
+        metric_add(M_WAL_RECORDS, (uint64_t)n);
+        metric_add(M_WAL_BYTES, bytes);
+        if (wal_seg_bytes >= wal_segment_max && wal_open_segment() < 0) perror("wal rotate");
     }
+    return NULL;
 }
 
-static void send_line(int fd, const char *fmt, ...) {
-    char out[BUF_SZ];
-    va_list ap; va_start(ap, fmt);
-    vsnprintf(out, sizeof(out), fmt, ap);
-    va_end(ap);
-    size_t L = strlen(out);
-    if (L == 0 || out[L-1] != '\n') {
-        if (L + 1 < sizeof(out)) { out[L] = '\n'; out[L+1] = '\0'; L++; }
+// Resume numbering after the newest segment's last intact record, and cut off whatever
+// follows it so new records are not appended behind a torn tail.
+static int wal_recover_seq(void) {
+    DIR *d = opendir(wal_dir);
+    if (!d) return -1;
+    unsigned long long newest = 0;
+    bool any = false;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned long long base; char tail;
+        if (sscanf(e->d_name, "%llu.wal%c", &base, &tail) == 1 && (!any || base > newest)) { newest = base; any = true; }
+    }
+    closedir(d);
+    if (!any) return 0;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%020llu.wal", wal_dir, newest);
+    wal_next_seq = newest;
+    FILE *f = fopen(path, "rb");
+    if (!f) return errno == ENOENT ? 0 : -1;
+    wal_hdr_t h;
+    char *buf = NULL;
+    off_t good = 0;
+    while (fread(&h, sizeof(h), 1, f) == 1) {
+        char *nb = (char *)realloc(buf, h.len ? h.len : 1);
+        if (!nb || fread(nb, 1, h.len, f) != h.len) { buf = nb ? nb : buf; break; }
+        buf = nb;
+        if (h.seq != wal_next_seq || wal_crc(&h, buf) != h.crc) break; // torn tail
+        wal_next_seq++;
+        good += (off_t)(sizeof(h) + h.len);
     }
-    safe_send(fd, out, L);
+    free(buf);
+    struct stat st;
+    int rc = fstat(fileno(f), &st);
+    fclose(f);
+    if (rc < 0) return -1;
+    if (st.st_size > good) {
+        fprintf(stderr, "wal: %s: dropping %lld bytes of torn tail\n", path, (long long)(st.st_size - good));
+        if (truncate(path, good) < 0) return -1;
+    }
+    return 0;
 }
 
-static ssize_t recv_line(int fd, char *out, size_t cap) {
-    size_t pos = 0;
-    while (pos + 1 < cap) {
-        char c;
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n == 0) return 0;
-        if (n < 0) { if (errno == EINTR) continue; return -1; }
-        out[pos++] = c;
-        if (c == '\n') break;
+static int wal_start(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+    const char *m = getenv("XK3_WAL");
+    if (m) {
+        if (strcmp(m, "off") == 0) wal_mode = WAL_OFF;
+        else if (strcmp(m, "none") == 0) wal_mode = WAL_NONE;
+        else if (strcmp(m, "group") == 0) wal_mode = WAL_GROUP;
+        else if (strcmp(m, "message") == 0) wal_mode = WAL_MESSAGE;
+        else { fprintf(stderr, "XK3_WAL: unknown mode %s\n", m); errno = EINVAL; return -1; }
     }
-    out[pos] = '\0';
-    return (ssize_t)pos;
+    if (wal_mode == WAL_OFF) return 0;
+    const char *v;
+    if ((v = getenv("XK3_WAL_DIR")) && *v) wal_dir = v;
+    if ((v = getenv("XK3_WAL_SEGMENT_MB")) && atol(v) > 0) wal_segment_max = (uint64_t)atol(v) << 20;
+    if ((v = getenv("XK3_WAL_WINDOW_US"))) wal_window_ns = (uint64_t)atol(v) * 1000ull;
+    if (mkdir(wal_dir, 0700) < 0 && errno != EEXIST) return -1;
+    if (wal_recover_seq() < 0 || wal_open_segment() < 0) return -1;
+    pthread_t th;
+    if (pthread_create(&th, NULL, wal_thread, NULL) != 0) return -1;
+    pthread_detach(th);
+    return 0;
 }
 
-static int online_count(void) {
-    int c = 0;
-    pthread_mutex_lock(&mtx);
-    for (int i = 0; i < MAX_CLIENTS; ++i) if (clients[i].in_use) c++;
-    pthread_mutex_unlock(&mtx);
-    return c;
+// ---- Metrics listener ----
+
+typedef struct { char *p; size_t len, cap; } sbuf_t;
+
+static void sb_printf(sbuf_t *b, const char *fmt, ...) {
+    va_list ap;
+    while (1) {
+        va_start(ap, fmt);
+        int n = vsnprintf(b->p + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < b->cap - b->len) { b->len += (size_t)n; return; }
+        size_t ncap = b->cap * 2 + (size_t)n;
+        char *np = (char *)realloc(b->p, ncap);
+        if (!np) return;
+        b->p = np; b->cap = ncap;
+    }
 }
 
-static int add_client(int fd) {
-    int idx = -1;
-    pthread_mutex_lock(&mtx);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (!clients[i].in_use) {
-            clients[i].in_use = true;
-            clients[i].fd = fd;
-            clients[i].authed = false;
-            clients[i].user_idx = -1;
-            idx = i;
-            break;
+static void metrics_render(sbuf_t *b) {
+    metrics_t sum; memset(&sum, 0, sizeof(sum));
+    pthread_mutex_lock(&metrics_mtx);
+    metrics_add_into(&sum, &metrics_retired);
+    for (metrics_t *m = metrics_live; m; m = m->next) metrics_add_into(&sum, m);
+    pthread_mutex_unlock(&metrics_mtx);
+
+    for (int k = 0; k < M_COUNT; ++k) {
+        sb_printf(b, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", metric_info[k].name, metric_info[k].help,
+                  metric_info[k].name, metric_info[k].name, (unsigned long long)sum.c[k]);
+    }
+    for (int k = 0; k < H_COUNT; ++k) {
+        const char *nm = hist_info[k].name;
+        sb_printf(b, "# HELP %s %s\n# TYPE %s histogram\n", nm, hist_info[k].help, nm);
+        uint64_t cum = 0;
+        for (int i = 0; i < HIST_BUCKETS; ++i) {
+            cum += sum.h[k].count[i];
+            sb_printf(b, "%s_bucket{le=\"%g\"} %llu\n", nm, (double)(1ull << i) * 1e-6, (unsigned long long)cum);
         }
+        cum += sum.h[k].count[HIST_BUCKETS];
+        sb_printf(b, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", nm, (unsigned long long)cum,
+                  nm, sum.h[k].sum_ns * 1e-9, nm, (unsigned long long)cum);
+    }
+
+    // Gauges, read at scrape time.
+    int open = 0;
+    unsigned long long q_msgs = 0, q_bytes = 0, q_max = 0;
+    pthread_mutex_lock(&mtx); // sessions in clients[] are not yet retired
+    for (int i = 0; i < MAX_CLIENTS; ++i) {
+        session_t *s = clients[i];
+        if (!s) continue;
+        open++;
+        pthread_mutex_lock(&s->q_mtx);
+        q_msgs += s->q_n;
+        q_bytes += s->q_bytes;
+        if (s->q_bytes > q_max) q_max = s->q_bytes;
+        pthread_mutex_unlock(&s->q_mtx);
     }
     pthread_mutex_unlock(&mtx);
-    return idx;
+    pthread_mutex_lock(&bset_mtx); // the current set is only freed after being replaced
+    int authed = bset->n - bset_nholes;
+    pthread_mutex_unlock(&bset_mtx);
+    sb_printf(b, "# HELP xk3_connections_open Connections holding a slot.\n# TYPE xk3_connections_open gauge\n"
+                 "xk3_connections_open %d\n", open);
+    sb_printf(b, "# HELP xk3_sessions_authed Sessions in the broadcast set.\n# TYPE xk3_sessions_authed gauge\n"
+                 "xk3_sessions_authed %d\n", authed);
+    sb_printf(b, "# HELP xk3_outq_messages Messages queued for all recipients.\n# TYPE xk3_outq_messages gauge\n"
+                 "xk3_outq_messages %llu\n", q_msgs);
+    sb_printf(b, "# HELP xk3_outq_bytes Bytes queued for all recipients.\n# TYPE xk3_outq_bytes gauge\n"
+                 "xk3_outq_bytes %llu\n", q_bytes);
+    sb_printf(b, "# HELP xk3_outq_max_bytes Deepest single recipient queue, in bytes.\n# TYPE xk3_outq_max_bytes gauge\n"
+                 "xk3_outq_max_bytes %llu\n", q_max);
 }
 
-static void remove_client(int fd) {
-    pthread_mutex_lock(&mtx);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].in_use && clients[i].fd == fd) {
-            clients[i].in_use = false;
-            clients[i].authed = false;
-            clients[i].user_idx = -1;
-            clients[i].fd = -1;
-            break;
+// One scrape per connection: read the request head (whatever it is), reply, close.
+// Only a broken listener ends the thread; any other accept() error is retried,
+// backing off while the process is out of fds or memory so it does not spin.
+static void *metrics_thread_main(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    long backoff_ms = 0;
+    while (1) {
+        int cfd = accept(lfd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EBADF || errno == EINVAL || errno == ENOTSOCK) { perror("metrics accept"); break; }
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                if (!backoff_ms) perror("metrics accept");
+                backoff_ms = backoff_ms ? backoff_ms * 2 : 10;
+                if (backoff_ms > METRICS_BACKOFF_MAX_MS) backoff_ms = METRICS_BACKOFF_MAX_MS;
+                struct timespec d = { backoff_ms / 1000, (backoff_ms % 1000) * 1000000 };
+                nanosleep(&d, NULL);
+            }
+            continue; // EINTR, ECONNABORTED, EPROTO and the other per-connection errors
+        }
+        backoff_ms = 0;
+        struct timeval tv = { .tv_sec = 1, .tv_usec = 0 };
+        setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        char req[1024]; size_t got = 0;
+        while (got < sizeof(req) - 1) {
+            ssize_t n = recv(cfd, req + got, sizeof(req) - 1 - got, 0);
+            if (n <= 0) break;
+            got += (size_t)n; req[got] = '\0';
+            if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
         }
+        sbuf_t body = { (char *)malloc(8192), 0, 8192 };
+        if (body.p) {
+            metrics_render(&body);
+            char head[160];
+            int hl = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                                  "Content-Length: %zu\r\n\r\n", body.len);
+            safe_send(cfd, head, (size_t)hl);
+            safe_send(cfd, body.p, body.len);
+            free(body.p);
+        }
+        close(cfd);
     }
-    pthread_mutex_unlock(&mtx);
+    return NULL;
 }
 
-static void broadcast_authed(const char *fmt, ...) {
-    char line[BUF_SZ];
-    va_list ap; va_start(ap, fmt);
-    vsnprintf(line, sizeof(line), fmt, ap);
-    va_end(ap);
-    size_t L = strlen(line);
-    if (L == 0 || line[L-1] != '\n') {
-        if (L + 1 < sizeof(line)) { line[L] = '\n'; line[L+1] = '\0'; L++; }
+// XK3_METRICS: "off", a port on 127.0.0.1, or an absolute Unix socket path.
+static int metrics_start(void) {
+    const char *spec = getenv("XK3_METRICS");
+    if (spec && strcmp(spec, "off") == 0) return 0;
+    int lfd;
+    if (spec && spec[0] == '/') {
+        struct sockaddr_un un; memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        if (strlen(spec) >= sizeof(un.sun_path)) { errno = ENAMETOOLONG; return -1; }
+        strcpy(un.sun_path, spec);
+        unlink(spec);
+        lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (lfd < 0 || bind(lfd, (struct sockaddr *)&un, sizeof(un)) < 0) return -1;
+    } else {
+        int port = spec ? atoi(spec) : METRICS_DEFAULT_PORT;
+        struct sockaddr_in sa; memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET; sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK); sa.sin_port = htons((uint16_t)port);
+        lfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int yes = 1;
+        if (lfd >= 0) setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (lfd < 0 || bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) < 0) return -1;
+    }
+    if (listen(lfd, 8) < 0) return -1;
+    pthread_t th;
+    if (pthread_create(&th, NULL, metrics_thread_main, (void *)(intptr_t)lfd) != 0) return -1;
+    pthread_detach(th);
+    if (spec && spec[0] == '/') printf("Metrics on %s\n", spec);
+    else printf("Metrics on 127.0.0.1:%d\n", spec ? atoi(spec) : METRICS_DEFAULT_PORT);
+    return 0;
+}
+
+// ---- Presence digests ----
+// Only a user's first session coming up and last one going away count as
+// changes. They mark the user dirty; the presence thread decides, once per
+// window, what everyone needs to hear and sends it as (at most) one online
+// and one offline digest. LOGIN/disconnect only take presence_mtx briefly;
+// the CHAT path never does. presence_dirty[] has a slot for every user that
+// has ever been bound, reserved at that first bind, so marking a user never
+// allocates and a transition cannot be lost to an out-of-memory.
+
+static pthread_mutex_t presence_mtx = PTHREAD_MUTEX_INITIALIZER;
+static user_t **presence_dirty;
+static size_t presence_n, presence_cap_slots, presence_slots;
+static uint64_t presence_window_ns = PRESENCE_MS_DEFAULT * 1000000ull;
+static size_t presence_cap = PRESENCE_CAP_DEFAULT;
+static size_t presence_counts_only = PRESENCE_COUNTS_ONLY_DEFAULT;
+
+// u's first bind: make sure presence_dirty[] can hold it.
+static bool presence_reserve_locked(user_t *u) {
+    if (u->presence_slot) return true;
+    if (presence_slots == presence_cap_slots) {
+        size_t ncap = presence_cap_slots ? presence_cap_slots * 2 : 64;
+        user_t **nd = (user_t **)realloc(presence_dirty, ncap * sizeof(*nd));
+        if (!nd) return false;
+        presence_dirty = nd;
+        presence_cap_slots = ncap;
     }
+    presence_slots++;
+    u->presence_slot = true;
+    return true;
+}
 
-    pthread_mutex_lock(&mtx);
-    for (int i = 0; i < MAX_CLIENTS; ++i) {
-        if (clients[i].in_use && clients[i].authed) {
-            safe_send(clients[i].fd, line, L);
-        }
+static void presence_mark_locked(user_t *u) {
+    if (u->presence_dirty) return;
+    u->presence_dirty = true;
+    presence_dirty[presence_n++] = u; // u has a reserved slot
+}
+
+// False if u has no slot and none could be reserved; nothing changed then.
+static bool presence_up(user_t *u) {
+    pthread_mutex_lock(&presence_mtx);
+    bool ok = presence_reserve_locked(u);
+    if (ok && __atomic_add_fetch(&u->online, 1, __ATOMIC_ACQ_REL) == 1) {
+        if (u->offline_due_ns) u->offline_due_ns = 0; // back within the hold: nobody is told
+        else if (!u->shown_online) presence_mark_locked(u);
     }
-    pthread_mutex_unlock(&mtx);
+    pthread_mutex_unlock(&presence_mtx);
+    return ok;
+}
+
+static void presence_down(user_t *u) {
+    if (__atomic_sub_fetch(&u->online, 1, __ATOMIC_ACQ_REL) != 0) return;
+    pthread_mutex_lock(&presence_mtx);
+    if (u->shown_online) {
+        u->offline_due_ns = now_ns() + resume_quiet_ns;
+        presence_mark_locked(u);
+    }
+    pthread_mutex_unlock(&presence_mtx);
 }
 
-static int users_find_by_acc(const char *acc) {
-    for (int i = 0; i < MAX_USERS; ++i) {
-        if (users[i].in_use && strcmp(users[i].acc, acc) == 0) return i;
+// "SYSTEM: <sid> is <what>" for one, else a capped digest or just a count.
+static void presence_send(user_t **us, size_t n, const char *what) {
+    if (n == 0) return;
+    sbuf_t b = { (char *)malloc(1024), 0, 1024 };
+    if (!b.p) return;
+    if (n == 1) {
+        sb_printf(&b, "SYSTEM: %s is %s\n", arena_str(us[0]->sid), what);
+    } else if (n > presence_counts_only) {
+        sb_printf(&b, "SYSTEM: %zu users %s\n", n, what);
+    } else {
+        size_t shown = n < presence_cap ? n : presence_cap;
+        sb_printf(&b, "SYSTEM: %zu users %s%s", n, what, shown ? ": " : "");
+        for (size_t i = 0; i < shown; ++i) sb_printf(&b, "%s%s", i ? ", " : "", arena_str(us[i]->sid));
+        if (shown < n) sb_printf(&b, "%s(+%zu more)", shown ? " " : "", n - shown);
+        sb_printf(&b, "\n");
     }
-    return -1;
+    broadcast_raw(b.p, b.len);
+    free(b.p);
 }
 
-static int users_find_free(void) {
-    for (int i = 0; i < MAX_USERS; ++i) if (!users[i].in_use) return i;
-    return -1;
+static void *presence_thread(void *arg) {
+    (void)arg;
+    // broadcast_raw reads the set. Started before any connection, so a slot
+    // is free unless they leak; keep trying rather than run unregistered.
+    while (!rcu_register_thread()) sleep(1);
+    user_t **up = NULL, **down = NULL;
+    size_t cap = 0;
+    while (1) {
+        struct timespec d = { (time_t)(presence_window_ns / 1000000000ull), (long)(presence_window_ns % 1000000000ull) };
+        nanosleep(&d, NULL);
+
+        size_t nu = 0, nd = 0;
+        uint64_t now = now_ns();
+        pthread_mutex_lock(&presence_mtx);
+        if (presence_n > cap) {
+            user_t **a = (user_t **)realloc(up, presence_n * sizeof(*a)), **c = a ? (user_t **)realloc(down, presence_n * sizeof(*c)) : NULL;
+            if (a) up = a;
+            if (c) { down = c; cap = presence_n; }
+        }
+        size_t keep = 0;
+        for (size_t i = 0; i < presence_n; ++i) {
+            user_t *u = presence_dirty[i];
+            bool on = __atomic_load_n(&u->online, __ATOMIC_ACQUIRE) > 0;
+            if (i >= cap) { presence_dirty[keep++] = u; continue; } // out of memory: next window
+            if (on && !u->shown_online) {
+                u->shown_online = true;
+                up[nu++] = u;
+            } else if (!on && u->offline_due_ns) {
+                if (now < u->offline_due_ns) { presence_dirty[keep++] = u; continue; } // still held
+                u->offline_due_ns = 0;
+                u->shown_online = false;
+                down[nd++] = u;
+            }
+            u->presence_dirty = false;
+        }
+        presence_n = keep;
+        pthread_mutex_unlock(&presence_mtx);
+
+        presence_send(down, nd, "offline");
+        presence_send(up, nu, "online");
+    }
+    return NULL;
 }
 
-static bool valid_len(const char *s) {
-    size_t L = strlen(s);
-    return L >= 8 && L <= 15;
+static int presence_start(void) {
+    const char *v;
+    if ((v = getenv("XK3_PRESENCE_MS")) && atol(v) > 0) presence_window_ns = (uint64_t)atol(v) * 1000000ull;
+    if ((v = getenv("XK3_PRESENCE_CAP"))) presence_cap = (size_t)atol(v);
+    if ((v = getenv("XK3_PRESENCE_COUNTS_ONLY")) && atol(v) > 0) presence_counts_only = (size_t)atol(v);
+    pthread_t th;
+    if (pthread_create(&th, NULL, presence_thread, NULL) != 0) return -1;
+    pthread_detach(th);
+    return 0;
 }
 
-static bool contains_upper_and_symbol(const char *s) {
-    bool upper = false, symbol = false;
-    for (const unsigned char *p=(const unsigned char*)s; *p; ++p) {
-        if (*p >= 'A' && *p <= 'Z') upper = true;
-        if (!( (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') || (*p >= '0' && *p <= '9') ))
-            symbol = true;
+static void session_unbind_user(session_t *sess) {
+    presence_down(sess->user);
+}
+
+// Bind the connection to u (LOGIN/RESUME) and publish it for broadcasts.
+static bool session_bind(session_t *sess, user_t *u) {
+    if (sess->user) session_unbind_user(sess); // re-LOGIN as someone else
+    sess->user = NULL;
+    if (!presence_up(u)) {
+        if (!sess->mux) bset_del(sess); // a re-LOGIN left it in the set
+        return false;
     }
-    return upper && symbol;
+    sess->user = u;
+    snprintf(sess->sid, sizeof(sess->sid), "%s", arena_str(u->sid));
+    if (!bset_add(sess)) {
+        session_unbind_user(sess);
+        sess->user = NULL;
+        return false;
+    }
+    return true;
 }
 
-static bool parse_kv(const char *line, const char *key, char *out, size_t outcap) {
-    // expects "KEY:value"
-    size_t klen = strlen(key);
-    if (strncmp(line, key, klen) != 0) return false;
-    if (line[klen] != ':') return false;
-    snprintf(out, outcap, "%s", line + klen + 1);
-    // strip trailing newline if any
-    size_t L = strlen(out);
-    while (L && (out[L-1] == '\r' || out[L-1] == '\n')) { out[L-1] = '\0'; L--; }
+// MULTIPLEX: load the user of channel mux_cur into the session for its
+// command. The connection is in the broadcast set once, while any of its
+// channels is authed, so each broadcast is queued and written to it once.
+static bool mux_enter(session_t *sess) {
+    int ch = sess->mux_cur;
+    if (ch >= sess->mux_cap) {
+        int ncap = sess->mux_cap ? sess->mux_cap : 16;
+        while (ncap <= ch) ncap *= 2;
+        user_t **nu = (user_t **)realloc(sess->mux_user, (size_t)ncap * sizeof(*nu));
+        if (!nu) return false;
+        memset(nu + sess->mux_cap, 0, (size_t)(ncap - sess->mux_cap) * sizeof(*nu));
+        sess->mux_user = nu;
+        sess->mux_cap = ncap;
+    }
+    sess->user = sess->mux_user[ch];
+    if (sess->user) snprintf(sess->sid, sizeof(sess->sid), "%s", arena_str(sess->user->sid));
     return true;
 }
 
-typedef struct { int fd; } thread_arg_t;
+// ...and store it back after.
+static void mux_leave(session_t *sess) {
+    user_t **slot = &sess->mux_user[sess->mux_cur];
+    bool was = *slot != NULL;
+    sess->mux_authed += (sess->user != NULL) - was;
+    *slot = sess->user;
+    sess->user = NULL;
+    if (was && !sess->mux_authed) bset_del(sess);
+}
 
-static void *client_thread(void *arg) {
-    thread_arg_t *ta = (thread_arg_t*)arg;
-    int cfd = ta->fd;
-    free(ta);
+// ---- Chat history and search ----
+// The last XK3_HISTORY chat lines, local and from peers, are kept in a ring
+// indexed by a running document id, and every word of their bodies is
+// indexed. A document keeps only its own copy of the line, cut at what a hit
+// shows, never the msg_t it came in (up to CHAT_MAX, or a whole bus batch),
+// and the oldest documents are also dropped to keep the copies within
+// XK3_HISTORY_BYTES. The CHAT path only hands its msg_t to an MPSC
+// queue like the chat log's; the index thread splits it into lines and adds
+// them in batches under the write side of index_lock. SEARCH takes the read
+// side.
+//
+// A word's posting list is the ascending ids of the documents holding it:
+// sealed blocks of up to POST_BLOCK ids (the first id, then varint deltas)
+// and an unsealed tail of plain ids. Block headers carry their first and last ids,
+// so a query only decodes the blocks that can overlap what it intersects.
+// Ids that left the ring are skipped by queries; every INDEX_SWEEP documents
+// the blocks wholly below the ring are freed, words left with no postings
+// dropped, and tails that did not grow since the last sweep sealed short. Ids are 32 bits: after 2^32 lines the history starts
+// over empty.
 
-    char line[BUF_SZ];
+typedef struct {
+    uint32_t first, last;
+    uint16_t n, bytes;      // ids; bytes of data[]
+    uint8_t data[];         // n - 1 varint deltas after first
+} post_block_t;
 
-    while (1) {
-        ssize_t n = recv_line(cfd, line, sizeof(line));
-        if (n <= 0) break;
+typedef struct {
+    uint64_t hash;
+    uint32_t ids;           // in blk[] and tail[]
+    uint32_t nblk, blk_cap;
+    uint32_t tail_n, tail_cap;
+    post_block_t **blk;     // oldest first
+    uint32_t *tail;
+    uint8_t len;
+    char text[];
+} term_t;
 
-        if (strncmp(line, "SIGNUP", 6) == 0) {
-            char sid[64]="", acc[64]="", pwd[64]="";
-            // Expect 3 following lines
-            if (recv_line(cfd, line, sizeof(line)) <= 0) break;
-            if (!parse_kv(line, "SID", sid, sizeof(sid))) { send_line(cfd, "FAIL SIGNUP: bad SID"); continue; }
+typedef struct {
+    char *text;             // the line without its '\n', cut at SEARCH_HIT_MAX
+    uint32_t len;
+} hist_doc_t;
 
-            if (recv_line(cfd, line, sizeof(line)) <= 0) break;
-            if (!parse_kv(line, "ACC", acc, sizeof(acc))) { send_line(cfd, "FAIL SIGNUP: bad ACC"); continue; }
+typedef struct index_rec {
+    struct index_rec *next;
+    msg_t *m;
+} index_rec_t;
 
-            if (recv_line(cfd, line, sizeof(line)) <= 0) break;
-            if (!parse_kv(line, "PWD", pwd, sizeof(pwd))) { send_line(cfd, "FAIL SIGNUP: bad PWD"); continue; }
+static uint32_t hist_cap = HISTORY_DEFAULT; // XK3_HISTORY, 0 = off
+static hist_doc_t *hist_ring;               // document id % hist_cap
+static uint32_t hist_next;                  // the next document id
+static uint32_t hist_first;                 // the oldest document still held
+static uint64_t hist_bytes;                 // text held by the ring
+static uint64_t hist_bytes_max = HISTORY_BYTES_DEFAULT; // XK3_HISTORY_BYTES
+static term_t **term_slot;                  // open-addressed by hash, NULL = empty
+static size_t term_mask, term_count;
+static pthread_rwlock_t index_lock;         // writer-preferring, set up by index_start
 
-            // Validate lengths and password policy
-            if (!valid_len(acc) || !valid_len(pwd) || !contains_upper_and_symbol(pwd)) {
-                send_line(cfd, "FAIL SIGNUP: policy violation");
-                continue;
-            }
+static index_rec_t index_stub;
+static index_rec_t *index_tail = &index_stub;
+static index_rec_t *index_head = &index_stub; // index thread only
+static int index_kick;                        // futex word: 1 once there is work
 
-            pthread_mutex_lock(&mtx);
-            if (users_find_by_acc(acc) != -1) {
-                pthread_mutex_unlock(&mtx);
-                send_line(cfd, "FAIL SIGNUP: account exists");
-                continue;
-            }
-            int ui = users_find_free();
-            if (ui == -1) {
-                pthread_mutex_unlock(&mtx);
-                send_line(cfd, "FAIL SIGNUP: user DB full");
-                continue;
-            }
-            users[ui].in_use = true;
-            snprintf(users[ui].sid, sizeof(users[ui].sid), "%s", sid);
-            snprintf(users[ui].acc, sizeof(users[ui].acc), "%s", acc);
-            snprintf(users[ui].pwd, sizeof(users[ui].pwd), "%s", pwd);
-            pthread_mutex_unlock(&mtx);
-
-            send_line(cfd, "OK SIGNUP");
-        }
-        else if (strncmp(line, "LOGIN", 5) == 0) {
-            char acc[64]="", pwd[64]="";
-            if (recv_line(cfd, line, sizeof(line)) <= 0) break;
-            if (!parse_kv(line, "ACC", acc, sizeof(acc))) { send_line(cfd, "FAIL LOGIN: bad ACC"); continue; }
-            if (recv_line(cfd, line, sizeof(line)) <= 0) break;
-            if (!parse_kv(line, "PWD", pwd, sizeof(pwd))) { send_line(cfd, "FAIL LOGIN: bad PWD"); continue; }
-
-            pthread_mutex_lock(&mtx);
-            int ui = users_find_by_acc(acc);
-            if (ui == -1 || strcmp(users[ui].pwd, pwd) != 0) {
-                pthread_mutex_unlock(&mtx);
-                send_line(cfd, "FAIL LOGIN: invalid credentials");
-                continue;
-            }
-            // Bind this connection to the authed user
-            for (int i=0;i<MAX_CLIENTS;++i) {
-                if (clients[i].in_use && clients[i].fd == cfd) {
-                    clients[i].authed = true;
-                    clients[i].user_idx = ui;
-                    break;
-                }
-            }
-            char sid[64]; snprintf(sid, sizeof(sid), "%s", users[ui].sid);
-            pthread_mutex_unlock(&mtx);
-
-            send_line(cfd, "OK LOGIN sid:%s", sid);
-            // (Optional) announce join
-            broadcast_authed("SYSTEM: %s is online", users[ui].sid);
-        }
-        else if (strncmp(line, "CHAT", 4) == 0) {
-            // Next line is message body
-            char msg[BUF_SZ];
-            if (recv_line(cfd, msg, sizeof(msg)) <= 0) break;
-            // strip newline
-            size_t L = strlen(msg);
-            while (L && (msg[L-1]=='\n'||msg[L-1]=='\r')) { msg[L-1]='\0'; L--; }
-
-            pthread_mutex_lock(&mtx);
-            const char *sid = NULL;
-            for (int i=0;i<MAX_CLIENTS;++i) {
-                if (clients[i].in_use && clients[i].fd == cfd && clients[i].authed) {
-                    sid = users[clients[i].user_idx].sid;
-                    break;
-                }
-            }
-            pthread_mutex_unlock(&mtx);
+// Documents below this id are gone. Caller holds index_lock.
+static uint32_t hist_oldest(void) {
+    return hist_first;
+}
+
+static bool word_byte(unsigned char c) {
+    return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+// The next word of s[*pos, len): a run of ASCII letters and digits, written
+// lowercased to out and cut at TERM_MAX. Returns its length, 0 at the end.
+static size_t next_term(const char *s, size_t len, size_t *pos, char *out) {
+    size_t i = *pos, n = 0;
+    while (i < len && !word_byte((unsigned char)s[i])) ++i;
+    for (; i < len && word_byte((unsigned char)s[i]); ++i)
+        if (n < TERM_MAX) out[n++] = s[i] >= 'A' && s[i] <= 'Z' ? (char)(s[i] | 0x20) : s[i];
+    *pos = i;
+    return n;
+}
+
+static term_t *term_find(const char *w, size_t n, uint64_t h) {
+    if (!term_slot) return NULL;
+    for (size_t i = h & term_mask;; i = (i + 1) & term_mask) {
+        term_t *t = term_slot[i];
+        if (!t) return NULL;
+        if (t->hash == h && t->len == n && memcmp(t->text, w, n) == 0) return t;
+    }
+}
+
+// Rebuild the dictionary with the given number of slots (also how a sweep's
+// deletions are closed up). Index thread, under the write lock.
+static bool term_rehash(size_t slots) {
+    term_t **ns = (term_t **)calloc(slots, sizeof(*ns));
+    if (!ns) return false;
+    for (size_t i = 0; term_slot && i <= term_mask; ++i) {
+        term_t *t = term_slot[i];
+        if (!t) continue;
+        size_t j = t->hash & (slots - 1);
+        while (ns[j]) j = (j + 1) & (slots - 1);
+        ns[j] = t;
+    }
+    free(term_slot);
+    term_slot = ns;
+    term_mask = slots - 1;
+    return true;
+}
+
+static term_t *term_get(const char *w, size_t n, uint64_t h) {
+    term_t *t = term_find(w, n, h);
+    if (t) return t;
+    if ((term_count + 1) * 2 > term_mask + 1 && !term_rehash(term_slot ? (term_mask + 1) * 2 : TERM_TAB_MIN)) return NULL;
+    t = (term_t *)calloc(1, sizeof(*t) + n);
+    if (!t) return NULL;
+    t->hash = h;
+    t->len = (uint8_t)n;
+    memcpy(t->text, w, n);
+    size_t i = h & term_mask;
+    while (term_slot[i]) i = (i + 1) & term_mask;
+    term_slot[i] = t;
+    term_count++;
+    return t;
+}
+
+static void term_free(term_t *t) {
+    for (uint32_t k = 0; k < t->nblk; ++k) free(t->blk[k]);
+    free(t->blk);
+    free(t->tail);
+    free(t);
+}
+
+// Encode the full tail as a block. On failure the tail stays full and the
+// next post_add() tries again.
+static void post_seal(term_t *t) {
+    uint8_t buf[POST_BLOCK * 5], *p = buf;
+    for (uint32_t i = 1; i < t->tail_n; ++i) {
+        uint32_t d = t->tail[i] - t->tail[i - 1];
+        while (d >= 0x80) { *p++ = (uint8_t)(d | 0x80); d >>= 7; }
+        *p++ = (uint8_t)d;
+    }
+    if (t->nblk == t->blk_cap) {
+        uint32_t ncap = t->blk_cap ? t->blk_cap * 2 : 4;
+        post_block_t **nb = (post_block_t **)realloc(t->blk, ncap * sizeof(*nb));
+        if (!nb) return;
+        t->blk = nb;
+        t->blk_cap = ncap;
+    }
+    post_block_t *b = (post_block_t *)malloc(sizeof(*b) + (size_t)(p - buf));
+    if (!b) return;
+    b->first = t->tail[0];
+    b->last = t->tail[t->tail_n - 1];
+    b->n = (uint16_t)t->tail_n;
+    b->bytes = (uint16_t)(p - buf);
+    memcpy(b->data, buf, b->bytes);
+    t->blk[t->nblk++] = b;
+    t->tail_n = 0;
+}
+
+static void post_add(term_t *t, uint32_t id) {
+    uint32_t last = t->tail_n ? t->tail[t->tail_n - 1] : t->nblk ? t->blk[t->nblk - 1]->last : UINT32_MAX;
+    if (last == id) return; // the word repeats in this document
+    if (t->tail_n == POST_BLOCK) { post_seal(t); if (t->tail_n) return; } // out of memory: posting lost
+    if (t->tail_n == t->tail_cap) {
+        uint32_t ncap = t->tail_cap ? t->tail_cap * 2 : 4;
+        uint32_t *nt = (uint32_t *)realloc(t->tail, ncap * sizeof(*nt));
+        if (!nt) return;
+        t->tail = nt;
+        t->tail_cap = ncap;
+    }
+    t->tail[t->tail_n++] = id;
+    t->ids++;
+    if (t->tail_n == POST_BLOCK) post_seal(t);
+}
 
-            if (!sid) { send_line(cfd, "note: please LOGIN first"); continue; }
-            broadcast_authed("[%s]: %s", sid, msg);
+// Blocks of a list as a query sees them: the sealed ones, then the tail.
+static size_t post_nblk(const term_t *t) { return t->nblk + (t->tail_n > 0); }
+static uint32_t post_first(const term_t *t, size_t b) { return b < t->nblk ? t->blk[b]->first : t->tail[0]; }
+static uint32_t post_last(const term_t *t, size_t b) { return b < t->nblk ? t->blk[b]->last : t->tail[t->tail_n - 1]; }
+
+// The ids of block b: decoded into scratch, or the tail in place.
+static const uint32_t *post_ids(const term_t *t, size_t b, uint32_t *scratch, size_t *n) {
+    if (b == t->nblk) { *n = t->tail_n; return t->tail; }
+    const post_block_t *k = t->blk[b];
+    const uint8_t *p = k->data;
+    uint32_t id = k->first;
+    scratch[0] = id;
+    for (uint32_t i = 1; i < k->n; ++i) {
+        uint32_t d = 0;
+        for (int sh = 0;; sh += 7) {
+            uint8_t c = *p++;
+            d |= (uint32_t)(c & 0x7f) << sh;
+            if (!(c & 0x80)) break;
         }
-        else if (strncmp(line, "EXIT!", 5) == 0) {
-            break;
+        scratch[i] = id += d;
+    }
+    *n = k->n;
+    return scratch;
+}
+
+// The first block at or after lo whose last id is at least x.
+static size_t post_seek(const term_t *t, size_t lo, uint32_t x) {
+    size_t hi = post_nblk(t);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (post_last(t, mid) < x) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// a ∩ b for ascending id arrays, in order into out. Returns the count.
+static size_t isect(const uint32_t *a, size_t na, const uint32_t *b, size_t nb, uint32_t *out) {
+    size_t i = 0, j = 0, k = 0;
+#ifdef __SSE2__
+    // Four against four: compare a's block with every rotation of b's, emit
+    // the lanes of a that matched, and move on whichever block ends lower.
+    while (i + 4 <= na && j + 4 <= nb) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + j));
+        __m128i eq = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi32(va, vb), _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+            _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                         _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))));
+        for (int mask = _mm_movemask_ps(_mm_castsi128_ps(eq)); mask; mask &= mask - 1)
+            out[k++] = a[i + (size_t)__builtin_ctz((unsigned)mask)];
+        uint32_t amax = a[i + 3], bmax = b[j + 3];
+        if (amax <= bmax) i += 4;
+        if (bmax <= amax) j += 4;
+    }
+#endif
+    while (i < na && j < nb) {
+        if (a[i] < b[j]) ++i;
+        else if (a[i] > b[j]) ++j;
+        else { out[k++] = a[i]; ++i; ++j; }
+    }
+    return k;
+}
+
+// The ids of a[0, n) also in t's list, into out. Only blocks of t that
+// hold one of a's ids are decoded.
+static size_t post_and(const term_t *t, const uint32_t *a, size_t n, uint32_t *out) {
+    uint32_t scratch[POST_BLOCK];
+    size_t i = 0, k = 0, nb = post_nblk(t);
+    for (size_t b = 0; i < n; ++b) {
+        if ((b = post_seek(t, b, a[i])) == nb) break;
+        uint32_t first = post_first(t, b), last = post_last(t, b);
+        while (i < n && a[i] < first) ++i;
+        size_t e = i;
+        while (e < n && a[e] <= last) ++e;
+        if (e > i) {
+            size_t m;
+            const uint32_t *ids = post_ids(t, b, scratch, &m);
+            k += isect(a + i, e - i, ids, m, out + k);
         }
-        else {
-            send_line(cfd, "unknown command");
+        i = e;
+    }
+    return k;
+}
+
+// The newest (up to max) retained documents holding all n words, newest
+// first, into hits. Caller holds index_lock for reading.
+static size_t search_run(char (*w)[TERM_MAX], const size_t *wl, size_t n, uint32_t *hits, size_t max) {
+    term_t *ts[SEARCH_TERMS];
+    size_t nt = 0;
+    for (size_t i = 0; i < n; ++i) {
+        term_t *t = term_find(w[i], wl[i], str_hash(w[i], wl[i]));
+        if (!t) return 0;
+        size_t j = 0;
+        while (j < nt && ts[j] != t) ++j;
+        if (j < nt) continue; // repeated word
+        // Rarest first: its list drives, the others are probed.
+        for (j = nt++; j > 0 && ts[j - 1]->ids > t->ids; --j) ts[j] = ts[j - 1];
+        ts[j] = t;
+    }
+    uint32_t scratch[POST_BLOCK], cur[POST_BLOCK], next[POST_BLOCK];
+    uint32_t oldest = hist_oldest();
+    const term_t *d = ts[0];
+    size_t nh = 0;
+    for (size_t b = post_nblk(d); b-- > 0 && nh < max;) {
+        if (post_last(d, b) < oldest) break;
+        size_t m;
+        const uint32_t *ids = post_ids(d, b, scratch, &m);
+        memcpy(cur, ids, m * sizeof(*cur));
+        for (size_t j = 1; j < nt && m; ++j) {
+            m = post_and(ts[j], cur, m, next);
+            memcpy(cur, next, m * sizeof(*cur));
         }
+        for (size_t i = m; i-- > 0 && nh < max && cur[i] >= oldest;) hits[nh++] = cur[i];
+    }
+    return nh;
+}
+
+// Free the postings below the ring and the words left without any, and
+// seal idle tails.
+static void index_sweep(void) {
+    uint32_t oldest = hist_oldest();
+    size_t dropped = 0;
+    for (size_t i = 0; i <= term_mask; ++i) {
+        term_t *t = term_slot[i];
+        if (!t) continue;
+        uint32_t k = 0;
+        while (k < t->nblk && t->blk[k]->last < oldest) { t->ids -= t->blk[k]->n; free(t->blk[k++]); }
+        if (k) { memmove(t->blk, t->blk + k, (t->nblk - k) * sizeof(*t->blk)); t->nblk -= k; }
+        if (t->tail_n && t->tail[t->tail_n - 1] < oldest) { t->ids -= t->tail_n; t->tail_n = 0; }
+        if (t->ids == 0) { term_free(t); term_slot[i] = NULL; term_count--; dropped++; continue; }
+        // A rare word's tail can sit unsealed for good: seal it short once
+        // it has gone a sweep without growing.
+        if (t->tail_n && t->tail[t->tail_n - 1] < hist_next - INDEX_SWEEP) post_seal(t);
+        if (!t->tail_n && t->tail) { free(t->tail); t->tail = NULL; t->tail_cap = 0; }
     }
+    if (!dropped) return;
+    size_t slots = TERM_TAB_MIN;
+    while (slots < term_count * 4) slots *= 2;
+    if (!term_rehash(slots)) term_rehash(term_mask + 1); // same size: only close up the holes
+}
 
-    // Optional: announce offline if authed
-    pthread_mutex_lock(&mtx);
-    const char *sid = NULL;
-    for (int i=0;i<MAX_CLIENTS;++i) if (clients[i].in_use && clients[i].fd == cfd && clients[i].authed) {
-        sid = users[clients[i].user_idx].sid; break;
+// Start over with no history (document ids ran out).
+static void index_reset(void) {
+    for (size_t i = 0; i <= term_mask; ++i) if (term_slot[i]) { term_free(term_slot[i]); term_slot[i] = NULL; }
+    term_count = 0;
+    for (uint32_t i = 0; i < hist_cap; ++i) { free(hist_ring[i].text); hist_ring[i] = (hist_doc_t){ NULL, 0 }; }
+    hist_next = hist_first = 0;
+    hist_bytes = 0;
+}
+
+static void hist_drop_oldest(void) {
+    hist_doc_t *d = &hist_ring[hist_first++ % hist_cap];
+    hist_bytes -= d->len;
+    free(d->text);
+    *d = (hist_doc_t){ NULL, 0 };
+}
+
+static void index_doc(msg_t *m, uint32_t off, uint32_t len) {
+    if (hist_next == UINT32_MAX) index_reset();
+    uint32_t keep = len < SEARCH_HIT_MAX ? len : SEARCH_HIT_MAX;
+    char *text = (char *)malloc(keep ? keep : 1);
+    if (!text) return; // the line is just not searchable
+    memcpy(text, m->data + off, keep);
+    while (hist_first != hist_next && (hist_next - hist_first >= hist_cap || hist_bytes + keep > hist_bytes_max))
+        hist_drop_oldest();
+    uint32_t id = hist_next++;
+    hist_ring[id % hist_cap] = (hist_doc_t){ text, keep };
+    hist_bytes += keep;
+
+    const char *line = m->data + off, *tag = (const char *)memmem(line, len, "]: ", 3);
+    size_t pos = tag ? (size_t)(tag - line) + 3 : len, n;
+    char w[TERM_MAX];
+    while ((n = next_term(line, len, &pos, w)) > 0) {
+        term_t *t = term_get(w, n, str_hash(w, n));
+        if (t) post_add(t, id);
     }
-    pthread_mutex_unlock(&mtx);
-    if (sid) broadcast_authed("SYSTEM: %s is offline", sid);
+    if (hist_next % INDEX_SWEEP == 0) index_sweep();
+}
+
+// Every "[sid]: ..." line of m becomes a document; SYSTEM lines from peers
+// are skipped. Returns the documents added.
+static uint64_t index_msg(msg_t *m) {
+    uint64_t n = 0;
+    for (size_t off = 0; off < m->len;) {
+        const char *nl = (const char *)memchr(m->data + off, '\n', m->len - off);
+        size_t end = nl ? (size_t)(nl - m->data) : m->len;
+        if (m->data[off] == '[') { index_doc(m, (uint32_t)off, (uint32_t)(end - off)); n++; }
+        off = end + 1;
+    }
+    return n;
+}
+
+// Sender side: one allocation and a reference, never a lock.
+static void index_submit(msg_t *m) {
+    if (!hist_cap) return;
+    index_rec_t *r = (index_rec_t *)malloc(sizeof(*r));
+    if (!r) return; // the line is just not searchable
+    __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+    r->m = m;
+    r->next = NULL;
+    index_rec_t *prev = __atomic_exchange_n(&index_tail, r, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, r, __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&index_kick, 1, __ATOMIC_SEQ_CST) == 0) futex(&index_kick, FUTEX_WAKE_PRIVATE, 1);
+}
+
+// Index thread: as wal_pop().
+static index_rec_t *index_pop(void) {
+    index_rec_t *head = index_head, *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (head == &index_stub) {
+        if (!next) return NULL;
+        index_head = head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+    if (next) { index_head = next; return head; }
+    if (head != __atomic_load_n(&index_tail, __ATOMIC_ACQUIRE)) return NULL;
+    index_stub.next = NULL;
+    index_rec_t *prev = __atomic_exchange_n(&index_tail, &index_stub, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, &index_stub, __ATOMIC_RELEASE);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next) { index_head = next; return head; }
+    return NULL;
+}
+
+static void *index_thread(void *arg) {
+    (void)arg;
+    while (1) {
+        index_rec_t *r = index_pop();
+        if (!r) {
+            __atomic_store_n(&index_kick, 0, __ATOMIC_SEQ_CST);
+            if ((r = index_pop()) == NULL) {
+                futex(&index_kick, FUTEX_WAIT_PRIVATE, 0);
+                continue;
+            }
+        }
+        uint64_t docs = 0;
+        int n = 0;
+        pthread_rwlock_wrlock(&index_lock);
+        do {
+            docs += index_msg(r->m);
+            msg_put(r->m);
+            free(r);
+        } while (++n < INDEX_BATCH && (r = index_pop()) != NULL);
+        pthread_rwlock_unlock(&index_lock);
+        metric_add(M_INDEXED, docs);
+    }
+    return NULL;
+}
+
+static int index_start(void) {
+    pthread_rwlockattr_t a;
+    pthread_rwlockattr_init(&a);
+    // Searches must not starve indexing; the CHAT path never waits on either.
+    pthread_rwlockattr_setkind_np(&a, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&index_lock, &a);
+    pthread_rwlockattr_destroy(&a);
+    const char *v = getenv("XK3_HISTORY");
+    if (v) hist_cap = (uint32_t)strtoul(v, NULL, 10);
+    if (!hist_cap) return 0;
+    if ((v = getenv("XK3_HISTORY_BYTES")) && strtoull(v, NULL, 10) > 0) hist_bytes_max = strtoull(v, NULL, 10);
+    hist_ring = (hist_doc_t *)calloc(hist_cap, sizeof(*hist_ring));
+    if (!hist_ring || !term_rehash(TERM_TAB_MIN)) return -1;
+    pthread_t th;
+    if (pthread_create(&th, NULL, index_thread, NULL) != 0) return -1;
+    pthread_detach(th);
+    return 0;
+}
+
+// ---- Commands ----
+//
+// One X() per command: id, name, handler, and the name's first four bytes
+// (C cannot index a string literal in a case label). Every name is at least
+// four bytes. cmd_lookup() hashes the first four bytes and the length into
+// CMD_HASH_BITS bits and switches on that, one case per command, so a
+// collision is a duplicate case label and fails the build: the hash is
+// perfect for the table as it stands, and adding a command costs nothing at
+// dispatch. The hit is then confirmed with one memcmp.
+//
+// A handler reads its whole frame (the lines after the command) with one
+// recv_lines() call and works on views into the receive buffer. It returns
+// false to end the connection.
+
+#define CMD_TABLE(X) \
+    X(CMD_SIGNUP, "SIGNUP", cmd_signup, 'S', 'I', 'G', 'N') \
+    X(CMD_LOGIN,  "LOGIN",  cmd_login,  'L', 'O', 'G', 'I') \
+    X(CMD_RESUME, "RESUME", cmd_resume, 'R', 'E', 'S', 'U') \
+    X(CMD_CHAT,   "CHAT",   cmd_chat,   'C', 'H', 'A', 'T') \
+    X(CMD_EXIT,   "EXIT!",  cmd_exit,   'E', 'X', 'I', 'T') \
+    X(CMD_SEARCH, "SEARCH", cmd_search, 'S', 'E', 'A', 'R') \
+    X(CMD_MULTIPLEX, "MULTIPLEX", cmd_multiplex, 'M', 'U', 'L', 'T')
+
+#define CMD_HASH_BITS 6
+#define CMD_HASH(len, a, b, c, d) \
+    ((((uint32_t)(uint8_t)(a) | (uint32_t)(uint8_t)(b) << 8 | (uint32_t)(uint8_t)(c) << 16 | \
+       (uint32_t)(uint8_t)(d) << 24) + (uint32_t)(len)) * 0x9E3779B1u >> (32 - CMD_HASH_BITS))
+
+typedef enum {
+#define X(id, name, fn, a, b, c, d) id,
+    CMD_TABLE(X)
+#undef X
+    CMD_UNKNOWN
+} cmd_id_t;
+
+#define X(id, name, fn, a, b, c, d) _Static_assert(sizeof(name) - 1 >= 4, name " is shorter than the hashed prefix");
+CMD_TABLE(X)
+#undef X
+
+static const view_t cmd_name[] = {
+#define X(id, name, fn, a, b, c, d) { name, sizeof(name) - 1 },
+    CMD_TABLE(X)
+#undef X
+};
+
+static cmd_id_t cmd_lookup(view_t w) {
+    if (w.len < 4) return CMD_UNKNOWN;
+    const uint8_t *p = (const uint8_t *)w.p;
+    cmd_id_t id;
+    switch (CMD_HASH(w.len, p[0], p[1], p[2], p[3])) {
+#define X(id_, name, fn, a, b, c, d) case CMD_HASH(sizeof(name) - 1, a, b, c, d): id = id_; break;
+    CMD_TABLE(X)
+#undef X
+    default: return CMD_UNKNOWN;
+    }
+    return cmd_name[id].len == w.len && memcmp(cmd_name[id].p, w.p, w.len) == 0 ? id : CMD_UNKNOWN;
+}
+
+// The prefix bytes in CMD_TABLE are hand-written; a wrong one would make its
+// command unreachable, so main() checks each name finds itself.
+static bool cmd_table_ok(void) {
+    for (int i = 0; i < CMD_UNKNOWN; ++i)
+        if (cmd_lookup(cmd_name[i]) != (cmd_id_t)i) return false;
+    return true;
+}
+
+static bool cmd_signup(session_t *sess) {
+    view_t f[3], sid, acc, pwd;
+    if (recv_lines(sess, f, 3, BUF_SZ - 1) <= 0) return false;
+    if (!parse_kv(f[0], "SID", &sid)) { metric_add(M_SIGNUP_FAIL, 1); send_line(sess, "FAIL SIGNUP: bad SID"); return true; }
+    if (!parse_kv(f[1], "ACC", &acc)) { metric_add(M_SIGNUP_FAIL, 1); send_line(sess, "FAIL SIGNUP: bad ACC"); return true; }
+    if (!parse_kv(f[2], "PWD", &pwd)) { metric_add(M_SIGNUP_FAIL, 1); send_line(sess, "FAIL SIGNUP: bad PWD"); return true; }
+
+    // Validate lengths and password policy
+    if (!valid_len(acc) || !valid_len(pwd) || !contains_upper_and_symbol(pwd)) {
+        metric_add(M_SIGNUP_FAIL, 1); send_line(sess, "FAIL SIGNUP: policy violation");
+        return true;
+    }
+
+    users_add_t r = users_add(sid, acc, pwd);
+    if (r != USERS_OK) {
+        metric_add(M_SIGNUP_FAIL, 1);
+        send_line(sess, r == USERS_EXISTS ? "FAIL SIGNUP: account exists" : "FAIL SIGNUP: user DB full");
+        return true;
+    }
+
+    metric_add(M_SIGNUP_OK, 1);
+    send_line(sess, "OK SIGNUP");
+    return true;
+}
+
+static bool cmd_login(session_t *sess) {
+    view_t f[2], acc, pwd;
+    if (recv_lines(sess, f, 2, BUF_SZ - 1) <= 0) return false;
+    if (!parse_kv(f[0], "ACC", &acc)) { metric_add(M_LOGIN_FAIL, 1); send_line(sess, "FAIL LOGIN: bad ACC"); return true; }
+    if (!parse_kv(f[1], "PWD", &pwd)) { metric_add(M_LOGIN_FAIL, 1); send_line(sess, "FAIL LOGIN: bad PWD"); return true; }
+
+    uint64_t t0 = now_ns();
+    user_t *u = users_find_by_acc(acc.p, acc.len);
+    if (!u || !arena_eq(u->pwd, pwd.p, pwd.len)) {
+        metric_add(M_LOGIN_FAIL, 1); send_line(sess, "FAIL LOGIN: invalid credentials");
+        return true;
+    }
+    if (!session_bind(sess, u)) {
+        metric_add(M_LOGIN_FAIL, 1); send_line(sess, "FAIL LOGIN: server busy");
+        return true;
+    }
+
+    char tok[128];
+    resume_token(u, tok, sizeof(tok));
+    send_line(sess, "OK LOGIN sid:%s token:%s", arena_str(u->sid), tok);
+    metric_add(M_LOGIN_OK, 1);
+    hist_observe(H_LOGIN, now_ns() - t0);
+    return true;
+}
+
+static bool cmd_resume(session_t *sess) {
+    view_t f, tok;
+    if (recv_lines(sess, &f, 1, BUF_SZ - 1) <= 0) return false;
+    user_t *u = parse_kv(f, "TOKEN", &tok) ? resume_verify(tok) : NULL;
+    if (!u) { metric_add(M_RESUME_FAIL, 1); send_line(sess, "FAIL RESUME: invalid or expired token"); return true; }
+    if (!session_bind(sess, u)) {
+        metric_add(M_RESUME_FAIL, 1); send_line(sess, "FAIL RESUME: server busy");
+        return true;
+    }
+    char fresh[128];
+    resume_token(u, fresh, sizeof(fresh));
+    send_line(sess, "OK RESUME sid:%s token:%s", arena_str(u->sid), fresh);
+    metric_add(M_RESUME_OK, 1);
+    return true;
+}
 
-    close(cfd);
-    remove_client(cfd);
+static bool cmd_chat(session_t *sess) {
+    // Next line is message body
+    view_t body;
+    if (recv_lines(sess, &body, 1, CHAT_MAX + 1) <= 0) return false;
+    body = chomp(body);
+
+    if (!sess->user) { send_line(sess, "note: please LOGIN first"); return true; }
+    metric_add(M_CHAT_IN, 1);
+    if (!wal_append(sess->sid, body.p, body.len)) { send_line(sess, "FAIL CHAT: chat log unavailable"); return true; }
+    size_t ls = strlen(sess->sid);
+    msg_t *m = msg_alloc(ls + body.len + 5); // "[<sid>]: <msg>\n"
+    if (!m) return true;
+    char *o = m->data;
+    *o++ = '[';
+    memcpy(o, sess->sid, ls); o += ls;
+    memcpy(o, "]: ", 3); o += 3;
+    memcpy(o, body.p, body.len); o += body.len;
+    *o++ = '\n';
+    *o = '\0';
+    broadcast_msg(m, true);
+    index_submit(m);
+    msg_put(m);
+    return true;
+}
+
+// Reply "OK SEARCH <n>" and n lines "HIT [sid]: <message>", newest first.
+static bool cmd_search(session_t *sess) {
+    view_t q;
+    if (recv_lines(sess, &q, 1, BUF_SZ - 1) <= 0) return false;
+    q = chomp(q);
+
+    if (!sess->user) { send_line(sess, "note: please LOGIN first"); return true; }
+    if (!hist_cap) { send_line(sess, "FAIL SEARCH: history is off"); return true; }
+    char w[SEARCH_TERMS][TERM_MAX], tmp[TERM_MAX];
+    size_t wl[SEARCH_TERMS], nw = 0, pos = 0, n;
+    while ((n = next_term(q.p, q.len, &pos, tmp)) > 0) {
+        if (nw == SEARCH_TERMS) { send_line(sess, "FAIL SEARCH: at most %d words", SEARCH_TERMS); return true; }
+        memcpy(w[nw], tmp, n);
+        wl[nw++] = n;
+    }
+    if (!nw) { send_line(sess, "FAIL SEARCH: no words"); return true; }
+
+    metric_add(M_SEARCH, 1);
+    sbuf_t b = { (char *)malloc(BUF_SZ), 0, BUF_SZ };
+    if (!b.p) return true;
+    uint64_t t0 = now_ns();
+    uint32_t ids[SEARCH_HITS];
+    pthread_rwlock_rdlock(&index_lock);
+    size_t nh = search_run(w, wl, nw, ids, SEARCH_HITS);
+    sb_printf(&b, "OK SEARCH %zu\n", nh);
+    for (size_t i = 0; i < nh; ++i) {
+        const hist_doc_t *d = &hist_ring[ids[i] % hist_cap];
+        sb_printf(&b, "HIT %.*s\n", (int)d->len, d->text);
+    }
+    pthread_rwlock_unlock(&index_lock);
+    hist_observe(H_SEARCH, now_ns() - t0);
+    session_send(sess, b.p, b.len);
+    free(b.p);
+    return true;
+}
+
+// Switch the connection to framed mode (see Notes). The OK is the last
+// unframed line.
+static bool cmd_multiplex(session_t *sess) {
+    if (sess->mux) { send_line(sess, "FAIL MULTIPLEX: already multiplexed"); return true; }
+    if (sess->user) { send_line(sess, "FAIL MULTIPLEX: already logged in"); return true; }
+    send_line(sess, "OK MULTIPLEX");
+    sess->mux = true;
+    metric_add(M_MUX_CONNS, 1);
+    return true;
+}
+
+// Ends the connection, or in MULTIPLEX mode just the channel.
+static bool cmd_exit(session_t *sess) {
+    if (!sess->mux) return false;
+    if (sess->user) { session_unbind_user(sess); sess->user = NULL; }
+    send_line(sess, "OK EXIT");
+    return true;
+}
+
+static bool cmd_unknown(session_t *sess) {
+    send_line(sess, "unknown command");
+    return true;
+}
+
+static bool (*const cmd_fn[CMD_UNKNOWN + 1])(session_t *) = {
+#define X(id, name, fn, a, b, c, d) [id] = fn,
+    CMD_TABLE(X)
+#undef X
+    [CMD_UNKNOWN] = cmd_unknown,
+};
+
+static void *client_thread(void *arg) {
+    session_t *sess = (session_t*)arg;
+    if (!rcu_register_thread()) { // fail this connection, not the server
+        metric_add(M_REJECTED, 1);
+        safe_send(sess->fd, "Server is full!\n", 16);
+        remove_client(sess);
+        metrics_thread_exit();
+        return NULL;
+    }
+    if (trace_f) {
+        sess->conn_id = __atomic_add_fetch(&trace_conn_seq, 1, __ATOMIC_RELAXED);
+        trace_rec(TR_OPEN, sess->conn_id, NULL, 0);
+    }
+
+    sess->rbuf = (char *)malloc(RBUF_SZ);
+    sess->r_cap = sess->rbuf ? RBUF_SZ : 0;
+
+    while (sess->rbuf) {
+        view_t line;
+        sess->mux_cur = -1;
+        if (recv_lines(sess, &line, 1, BUF_SZ - 1) <= 0) break;
+        bool mux = sess->mux; // MULTIPLEX itself turns it on
+        if (mux && !mux_enter(sess)) break;
+        bool more = cmd_fn[cmd_lookup(chomp(line))](sess);
+        if (mux) mux_leave(sess);
+        if (!more) break;
+    }
+
+    // Leave the set first so no broadcaster can still be writing to the fd when
+    // it is closed; the offline notice goes out with the next presence digest.
+    bset_del(sess);
+    if (sess->user) session_unbind_user(sess);
+    for (int i = 0; i < sess->mux_cap; ++i) if (sess->mux_user[i]) presence_down(sess->mux_user[i]);
+    free(sess->mux_user);
+
+    if (sess->conn_id) trace_rec(TR_CLOSE, sess->conn_id, NULL, 0);
+    free(sess->rbuf);
+    sess->rbuf = NULL;
+    metrics_thread_exit();
+    rcu_unregister_thread(); // before the slot can be handed to a new connection
+    remove_client(sess); // the writer closes the fd
     pthread_exit(NULL);
     return NULL;
 }
@@ -320,43 +3160,75 @@ static void *client_thread(void *arg) {
 int main(void) {
     signal(SIGPIPE, SIG_IGN);
 
+    if (!cmd_table_ok()) { fprintf(stderr, "CMD_TABLE: a command's prefix bytes do not match its name\n"); return 1; }
+    users_tab = strtab_new(USERS_TAB_MIN, ~((1u << USER_ID_BITS) - 1));
+    sid_tab = strtab_new(SID_TAB_MIN, 0);
+    bset = (bset_t *)calloc(1, sizeof(*bset) + BSET_MIN * sizeof(bset->m[0]));
+    if (bset) bset->cap = BSET_MIN;
+    if (!users_tab || !sid_tab || !bset) { perror("calloc"); return 1; }
+
+    const char *pol = getenv("XK3_SLOW_POLICY");
+    if (pol && strcmp(pol, "drop-oldest") == 0) slow_policy = SLOW_DROP_OLDEST;
+    else if (pol && strcmp(pol, "drop-newest") == 0) slow_policy = SLOW_DROP_NEWEST;
+    else if (pol && strcmp(pol, "disconnect") != 0) { fprintf(stderr, "XK3_SLOW_POLICY: unknown policy %s\n", pol); return 1; }
+    const char *qb = getenv("XK3_OUTQ_BYTES");
+    if (qb && atol(qb) > 0) outq_max_bytes = (size_t)atol(qb);
+    const char *qms = getenv("XK3_OUTQ_MS");
+    if (qms && atol(qms) > 0) outq_max_ns = (uint64_t)atol(qms) * 1000000ull;
+    const char *zc = getenv("XK3_ZEROCOPY");
+    if (zc && atol(zc) > 0) zc_min = (size_t)atol(zc);
+    if (writer_start() < 0) { perror("writer"); return 1; }
+    if (metrics_start() < 0) { perror("metrics"); return 1; }
+    if (wal_start() < 0) { perror("wal"); return 1; }
+    if (resume_init() < 0) { perror("resume key"); return 1; }
+    if (presence_start() < 0) { perror("presence"); return 1; }
+    if (index_start() < 0) { perror("search index"); return 1; }
+    if (bus_start() < 0) { perror("bus"); return 1; }
+    if (trace_start() < 0) { perror("trace"); return 1; }
+    const char *ps = getenv("XK3_PORT");
+    int port = ps && atoi(ps) > 0 ? atoi(ps) : PORT;
+
     int srv = socket(AF_INET, SOCK_STREAM, 0);
     if (srv < 0) { perror("socket"); return 1; }
     int yes = 1;
     setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
 
     struct sockaddr_in sa; memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET; sa.sin_addr.s_addr = htonl(INADDR_ANY); sa.sin_port = htons(PORT);
+    sa.sin_family = AF_INET; sa.sin_addr.s_addr = htonl(INADDR_ANY); sa.sin_port = htons((uint16_t)port);
     if (bind(srv, (struct sockaddr*)&sa, sizeof(sa)) < 0) { perror("bind"); return 1; }
     if (listen(srv, 16) < 0) { perror("listen"); return 1; }
 
-    printf("Q2 Server listening on %d (max %d clients)\n", PORT, MAX_CLIENTS);
+    printf("Q2 Server listening on %d (max %d clients)\n", port, MAX_CLIENTS);
 
     while (1) {
         struct sockaddr_in ca; socklen_t calen = sizeof(ca);
         int cfd = accept(srv, (struct sockaddr*)&ca, &calen);
         if (cfd < 0) { if (errno == EINTR) continue; perror("accept"); continue; }
+        // The writer already coalesces queued messages into one sendmsg;
+        // Nagle would only add a delayed-ACK stall on top.
+        setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
 
         if (online_count() >= MAX_CLIENTS) {
+            metric_add(M_REJECTED, 1);
             const char *full = "Server is full!\n";
             safe_send(cfd, full, strlen(full));
             close(cfd);
             continue;
         }
-        if (add_client(cfd) < 0) {
+        session_t *sess = add_client(cfd);
+        if (!sess) {
+            metric_add(M_REJECTED, 1);
             const char *full = "Server is full!\n";
             safe_send(cfd, full, strlen(full));
             close(cfd);
             continue;
         }
 
+        metric_add(M_ACCEPTED, 1);
         pthread_t th;
-        thread_arg_t *ta = (thread_arg_t*)malloc(sizeof(thread_arg_t));
-        ta->fd = cfd;
-        if (pthread_create(&th, NULL, client_thread, ta) != 0) {
+        if (pthread_create(&th, NULL, client_thread, sess) != 0) {
             perror("pthread_create");
-            close(cfd);
-            remove_client(cfd);
+            remove_client(sess);
             continue;
         }
         pthread_detach(th);
@@ -27,6 +27,7 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,39 +36,79 @@
 #include <unistd.h>
 
 #define PORT 5678
-#define MAX_CLIENTS 5
-#define MAX_USERS   128
-#define MAX_ROOMS   128
+#ifndef MAX_CLIENTS
+#define MAX_CLIENTS 5        // override with -DMAX_CLIENTS=N for scale runs
+#endif
+#define USER_ID_BITS 26      // user ids fit in the low bits of a hash slot
+#define MAX_USERS   ((1u<<USER_ID_BITS)-1)
+#define USER_CHUNK_BITS 16   // records per chunk of the user store
+#define ARENA_CHUNK_BITS 20  // the string arena grows 1 MiB at a time, up to 4 GiB
+#define FIELD_MAX 63         // longest SID/ACC/PWD stored; a longer SID is cut
+#define STRTAB_MIN 64        // initial hash slots (power of two)
+#define STRTAB_MIGRATE 8     // old slots moved into a grown table per add
+#define ROOM_SLOT_BITS 20    // room id-1 is generation<<ROOM_SLOT_BITS | slot
+#define MAX_ROOMS   (1u<<ROOM_SLOT_BITS)
+#define ROOM_GENS   ((1u<<(31-ROOM_SLOT_BITS))-1) // generations before a slot's ids repeat; ids stay positive ints
+#define ROOM_CHUNK_BITS 12   // rooms per chunk of the slab
+#define ROOM_SEATS  3
 #define BUF_SZ 4096
 
 typedef enum { PLACE_HALL=0, PLACE_ROOM } place_t;
 
+typedef struct { const char *p; size_t len; } view_t; // bytes inside the reader's buffer
+
+typedef struct {            // per connection, client thread only
+    int fd;
+    size_t off, len;        // buf[off, len) unread
+    char buf[3*BUF_SZ];     // room for the longest frame (SIGNUP)
+} reader_t;
+
 typedef struct {
-    char sid[64], acc[64], pwd[64];
-    bool in_use;
+    uint32_t sid, acc, pwd; // refs into the user arena; sid interned
 } user_t;
 
+// Open-addressed set of arena strings: slot values (0 = empty) that key_fn maps to the string's ref,
+// with hash bits in tag_mask. A grown table fills from the one it replaced (old) a few slots per add.
+typedef uint32_t (*strtab_key_fn)(uint32_t v);
+typedef struct strtab { unsigned mask, count, migrated; uint32_t tag_mask; struct strtab *old; uint32_t slot[]; } strtab_t;
+
+typedef struct room room_t;
+
 typedef struct {
     int fd;
     bool in_use;
     bool authed;
     int user_idx;           // users[] index
     place_t where;
-    int room_id;            // valid if where == PLACE_ROOM
+    room_t *room;           // valid if where == PLACE_ROOM
+    int seat;               // index in room->members
 } client_t;
 
-typedef struct {
+struct room {
     bool in_use;
-    int id;                 // room id
-    int members[3];         // socket fds of up to 3 users
+    int id;                 // room id; kept when freed, so the next one at this slot is a new generation
+    client_t *members[ROOM_SEATS]; // up to 3 users, each pointing back at its seat
     int mcount;
     int owner_fd;           // requester
-} room_t;
-
-static user_t users[MAX_USERS];
+    uint32_t next_free;     // slot+1 of the next free room, 0 ends the list
+};
+
+// All under mtx. Records sit in chunks that never move; strings in 1 MiB arena chunks as
+// <len byte><bytes><NUL>, a ref being chunk<<ARENA_CHUNK_BITS | offset of the first byte.
+static user_t *user_chunk[(MAX_USERS>>USER_CHUNK_BITS)+1];
+static uint32_t users_n;
+static char *arena_chunk[1u<<(32-ARENA_CHUNK_BITS)];
+static uint32_t arena_top;
+static strtab_t *users_tab, *sid_tab; // accounts (user id+1, tagged), interned SIDs (refs)
+// Clients by fd through fd_client[], slots taken from client_free[] or above client_top.
+// Rooms in chunks that never move, reached from an id in O(1): its slot picks the room and the
+// whole id must match, so an id outlives its room without reaching the slot's next one.
 static client_t clients[MAX_CLIENTS];
-static room_t rooms[MAX_ROOMS];
-static int next_room_id = 1;
+static int client_free[MAX_CLIENTS], client_nfree, client_top;
+static client_t **fd_client;
+static int fd_cap;
+static room_t *room_chunk[MAX_ROOMS>>ROOM_CHUNK_BITS];
+static uint32_t rooms_top, rooms_free;
 
 static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
 
@@ -79,106 +120,192 @@ static void send_line(int fd, const char *fmt, ...){
     size_t L=strlen(out); if(L==0||out[L-1]!='\n'){ if(L+1<sizeof(out)){ out[L]='\n'; out[L+1]='\0'; L++; } }
     safe_send(fd,out,L);
 }
-static ssize_t recv_line(int fd, char *out, size_t cap){
-    size_t pos=0; while(pos+1<cap){ char c; ssize_t n=recv(fd,&c,1,0);
-        if(n==0) return 0; if(n<0){ if(errno==EINTR) continue; return -1; } out[pos++]=c; if(c=='\n') break; }
-    out[pos]='\0'; return (ssize_t)pos;
+// The next n lines as views into r->buf, valid until the next call. Each ends with its '\n'
+// or is cut at BUF_SZ-1 bytes, the rest becoming the next line. Returns n, 0 on EOF, -1 on error.
+static int recv_lines(reader_t *r, view_t *v, int n){
+    const size_t max=BUF_SZ-1;
+    while(1){
+        size_t pos=r->off; int i=0;
+        for(; i<n; ++i){ size_t k=r->len-pos<max? r->len-pos : max; const char *nl=memchr(r->buf+pos,'\n',k);
+            if(nl) k=(size_t)(nl-(r->buf+pos))+1; else if(k<max) break;
+            v[i]=(view_t){r->buf+pos,k}; pos+=k; }
+        if(i==n){ r->off=pos; return n; }
+        memmove(r->buf,r->buf+r->off,r->len-r->off); r->len-=r->off; r->off=0;
+        ssize_t got=recv(r->fd,r->buf+r->len,sizeof(r->buf)-r->len,0);
+        if(got==0) return 0;
+        if(got<0){ if(errno==EINTR) continue; return -1; }
+        r->len+=(size_t)got;
+    }
+}
+static view_t chomp(view_t v){ while(v.len && (v.p[v.len-1]=='\n'||v.p[v.len-1]=='\r')) v.len--; return v; }
+// Splits off the next space-delimited word of *v.
+static view_t next_word(view_t *v){
+    while(v->len && *v->p==' '){ v->p++; v->len--; }
+    view_t w={v->p,0}; while(w.len<v->len && v->p[w.len]!=' ') w.len++;
+    v->p+=w.len; v->len-=w.len; return w;
+}
+// Leading decimal integer of w, like %d.
+static bool view_int(view_t w, int *out){
+    bool neg=w.len && w.p[0]=='-'; size_t i=neg; long x=0;
+    for(; i<w.len && w.p[i]>='0' && w.p[i]<='9'; ++i) if((x=x*10+(w.p[i]-'0'))>INT32_MAX) return false;
+    if(i==(size_t)neg) return false;
+    *out=(int)(neg? -x : x); return true;
+}
+static bool view_eq(view_t v, const char *s){ return strlen(s)==v.len && memcmp(s,v.p,v.len)==0; }
+static void view_copy(char *out, size_t cap, view_t v){ size_t n=v.len<cap-1? v.len : cap-1; memcpy(out,v.p,n); out[n]='\0'; }
+// client_of() to room_unseat(): caller holds mtx.
+static client_t *client_of(int fd){ return fd>=0 && fd<fd_cap ? fd_client[fd] : NULL; }
+static room_t *room_slot(uint32_t s){ return &room_chunk[s>>ROOM_CHUNK_BITS][s&((1u<<ROOM_CHUNK_BITS)-1)]; }
+static room_t *room_get(int id){
+    if(id<=0) return NULL;
+    uint32_t s=(uint32_t)(id-1)&(MAX_ROOMS-1); if(s>=rooms_top) return NULL;
+    room_t *rm=room_slot(s); return rm->in_use && rm->id==id ? rm : NULL;
+}
+// A free room: the last one freed, else a fresh slot. NULL when all MAX_ROOMS are in use.
+static room_t *room_alloc(void){
+    room_t *rm; uint32_t s, gen=0;
+    if(rooms_free){ s=rooms_free-1; rm=room_slot(s); rooms_free=rm->next_free; gen=((uint32_t)(rm->id-1)>>ROOM_SLOT_BITS)+1; if(gen==ROOM_GENS) gen=0; }
+    else{ if(rooms_top==MAX_ROOMS) return NULL; s=rooms_top;
+        room_t **chunk=&room_chunk[s>>ROOM_CHUNK_BITS];
+        if(!*chunk && !(*chunk=calloc(1u<<ROOM_CHUNK_BITS,sizeof(room_t)))) return NULL;
+        rooms_top++; rm=room_slot(s); }
+    *rm=(room_t){.in_use=true,.id=(int)((gen<<ROOM_SLOT_BITS|s)+1)}; return rm;
 }
-static int online_count(void){ int c=0; pthread_mutex_lock(&mtx);
-    for(int i=0;i<MAX_CLIENTS;++i) if(clients[i].in_use) c++; pthread_mutex_unlock(&mtx); return c; }
+static void room_seat(room_t *rm, client_t *c){ c->room=rm; c->seat=rm->mcount; c->where=PLACE_ROOM; rm->members[rm->mcount++]=c; }
+// c back to the Hall; the last seat moves into its place, and the room is freed once empty.
+static void room_unseat(client_t *c){
+    room_t *rm=c->room; if(!rm) return;
+    client_t *last=rm->members[--rm->mcount]; rm->members[c->seat]=last; last->seat=c->seat;
+    c->room=NULL; c->where=PLACE_HALL;
+    if(!rm->mcount){ rm->in_use=false; rm->next_free=rooms_free; rooms_free=((uint32_t)(rm->id-1)&(MAX_ROOMS-1))+1; }
+}
+
+static int online_count(void){ pthread_mutex_lock(&mtx); int c=client_top-client_nfree; pthread_mutex_unlock(&mtx); return c; }
 static int add_client(int fd){
     int idx=-1; pthread_mutex_lock(&mtx);
-    for(int i=0;i<MAX_CLIENTS;++i) if(!clients[i].in_use){ clients[i]=(client_t){.fd=fd,.in_use=true,.authed=false,.user_idx=-1,.where=PLACE_HALL,.room_id=-1}; idx=i; break; }
+    if(fd>=fd_cap){ int cap=fd_cap? fd_cap : 64; while(cap<=fd) cap*=2;
+        client_t **t=realloc(fd_client,(size_t)cap*sizeof(*t));
+        if(!t){ pthread_mutex_unlock(&mtx); return -1; }
+        memset(t+fd_cap,0,(size_t)(cap-fd_cap)*sizeof(*t)); fd_client=t; fd_cap=cap; }
+    if(fd_client[fd]){ pthread_mutex_unlock(&mtx); return -1; } // still mapped: its thread has not removed it yet
+    if(client_nfree) idx=client_free[--client_nfree]; else if(client_top<MAX_CLIENTS) idx=client_top++;
+    if(idx>=0){ clients[idx]=(client_t){.fd=fd,.in_use=true,.authed=false,.user_idx=-1,.where=PLACE_HALL,.room=NULL}; fd_client[fd]=&clients[idx]; }
     pthread_mutex_unlock(&mtx); return idx;
 }
 static void remove_client(int fd){
     pthread_mutex_lock(&mtx);
-    // remove from any room
-    for(int r=0;r<MAX_ROOMS;++r) if(rooms[r].in_use){
-        for(int i=0;i<rooms[r].mcount;++i){
-            if(rooms[r].members[i]==fd){
-                // shift
-                for(int j=i+1;j<rooms[r].mcount;++j) rooms[r].members[j-1]=rooms[r].members[j];
-                rooms[r].mcount--;
-                break;
-            }
-        }
-        if(rooms[r].mcount==0) rooms[r].in_use=false;
-    }
-    for(int i=0;i<MAX_CLIENTS;++i) if(clients[i].in_use && clients[i].fd==fd){
-        clients[i].in_use=false; clients[i].authed=false; clients[i].user_idx=-1; clients[i].where=PLACE_HALL; clients[i].room_id=-1; clients[i].fd=-1; break;
-    }
+    client_t *c=client_of(fd);
+    if(c){ room_unseat(c); fd_client[fd]=NULL; client_free[client_nfree++]=(int)(c-clients);
+        c->in_use=false; c->authed=false; c->user_idx=-1; c->fd=-1; }
     pthread_mutex_unlock(&mtx);
 }
-static int users_find_by_acc(const char *acc){ for(int i=0;i<MAX_USERS;++i) if(users[i].in_use && strcmp(users[i].acc,acc)==0) return i; return -1; }
-static int users_free(void){ for(int i=0;i<MAX_USERS;++i) if(!users[i].in_use) return i; return -1; }
-static bool valid_len(const char*s){ size_t L=strlen(s); return L>=8 && L<=15; }
-static bool contains_upper_and_symbol(const char*s){ bool up=false, sym=false; for(const unsigned char*p=(const unsigned char*)s; *p; ++p){
+static user_t *user_at(uint32_t id){ return &user_chunk[id>>USER_CHUNK_BITS][id&((1u<<USER_CHUNK_BITS)-1)]; }
+static const char *arena_str(uint32_t ref){ return arena_chunk[ref>>ARENA_CHUNK_BITS]+(ref&((1u<<ARENA_CHUNK_BITS)-1)); }
+static size_t arena_len(uint32_t ref){ return (unsigned char)arena_str(ref)[-1]; }
+static bool arena_eq(uint32_t ref, view_t v){ const char *a=arena_str(ref); return (unsigned char)a[-1]==v.len && memcmp(a,v.p,v.len)==0; }
+static bool arena_put(view_t v, uint32_t *ref){ // v.len <= FIELD_MAX; false when the arena is full
+    const uint32_t csz=1u<<ARENA_CHUNK_BITS; uint32_t c=arena_top>>ARENA_CHUNK_BITS, off=arena_top&(csz-1);
+    if(arena_chunk[c] && off+v.len+2>=csz){ if(++c==sizeof(arena_chunk)/sizeof(arena_chunk[0])) return false; off=0; }
+    if(!arena_chunk[c] && !(arena_chunk[c]=malloc(csz))) return false;
+    char *d=arena_chunk[c]+off; d[0]=(char)v.len; memcpy(d+1,v.p,v.len); d[v.len+1]='\0';
+    *ref=(c<<ARENA_CHUNK_BITS|off)+1; arena_top=(c<<ARENA_CHUNK_BITS|off)+(uint32_t)v.len+2; return true;
+}
+static uint64_t str_hash(view_t v){
+    uint64_t h=0xcbf29ce484222325ull; for(size_t i=0;i<v.len;++i){ h^=(unsigned char)v.p[i]; h*=0x100000001b3ull; } // FNV-1a
+    h^=h>>32; h*=0xd6e8feb86659fd93ull; h^=h>>32; return h; // tables index by low bits: mix the high ones down
+}
+static strtab_t *strtab_new(unsigned slots, uint32_t tag_mask){
+    strtab_t *t=calloc(1,sizeof(*t)+slots*sizeof(t->slot[0])); if(t){ t->mask=slots-1; t->tag_mask=tag_mask; } return t; }
+static uint32_t strtab_probe(const strtab_t *t, uint64_t h, view_t k, strtab_key_fn key){
+    uint32_t tag=(uint32_t)(h>>32)&t->tag_mask;
+    for(unsigned i=(unsigned)h&t->mask; t->slot[i]; i=(i+1)&t->mask) if((t->slot[i]&t->tag_mask)==tag && arena_eq(key(t->slot[i]),k)) return t->slot[i];
+    return 0;
+}
+static uint32_t strtab_find(const strtab_t *t, uint64_t h, view_t k, strtab_key_fn key){
+    uint32_t v=strtab_probe(t,h,k,key); return !v && t->old ? strtab_probe(t->old,h,k,key) : v; }
+static void strtab_put(strtab_t *t, uint32_t v, uint64_t h){ unsigned i=(unsigned)h&t->mask; while(t->slot[i]) i=(i+1)&t->mask; t->slot[i]=v; t->count++; }
+static void strtab_migrate(strtab_t *t, unsigned n, strtab_key_fn key){
+    for(; n && t->migrated<=t->old->mask; --n, ++t->migrated){ uint32_t v=t->old->slot[t->migrated]; if(!v) continue;
+        uint32_t r=key(v); strtab_put(t,v,str_hash((view_t){arena_str(r),arena_len(r)})); }
+    if(t->migrated>t->old->mask){ free(t->old); t->old=NULL; }
+}
+// v (not yet present) with hash h. At half full a doubled table takes over and drains the old one
+// STRTAB_MIGRATE slots per add, so no add rehashes the whole set.
+static bool strtab_add(strtab_t **tp, uint32_t v, uint64_t h, strtab_key_fn key){
+    strtab_t *t=*tp; if(t->old) strtab_migrate(t,STRTAB_MIGRATE,key);
+    if((t->count+1)*2>t->mask+1){
+        if(t->old) strtab_migrate(t,t->old->mask+1,key);
+        strtab_t *nt=strtab_new((t->mask+1)*2,t->tag_mask); if(!nt) return false;
+        nt->old=t; *tp=t=nt; strtab_migrate(t,STRTAB_MIGRATE,key);
+    }
+    strtab_put(t,(v&~t->tag_mask)|((uint32_t)(h>>32)&t->tag_mask),h); return true;
+}
+static uint32_t sid_key(uint32_t v){ return v; }
+static uint32_t user_key(uint32_t v){ return user_at((v&((1u<<USER_ID_BITS)-1))-1)->acc; }
+static int users_find_by_acc(view_t acc){
+    if(acc.len>FIELD_MAX) return -1;
+    uint32_t v=strtab_find(users_tab,str_hash(acc),acc,user_key); return v ? (int)(v&((1u<<USER_ID_BITS)-1))-1 : -1; }
+// SIGNUP; caller holds mtx and has checked acc is new. Returns the user id, -1 if the DB is full.
+static int users_add(view_t sid, view_t acc, view_t pwd){
+    if(users_n>=MAX_USERS || acc.len>FIELD_MAX || pwd.len>FIELD_MAX) return -1;
+    if(sid.len>FIELD_MAX) sid.len=FIELD_MAX;
+    uint32_t id=users_n; user_t **chunk=&user_chunk[id>>USER_CHUNK_BITS];
+    if(!*chunk && !(*chunk=calloc(1u<<USER_CHUNK_BITS,sizeof(user_t)))) return -1;
+    user_t *u=user_at(id); uint64_t hs=str_hash(sid);
+    if(!(u->sid=strtab_find(sid_tab,hs,sid,sid_key)) && !(arena_put(sid,&u->sid) && strtab_add(&sid_tab,u->sid,hs,sid_key))) return -1;
+    if(!arena_put(acc,&u->acc) || !arena_put(pwd,&u->pwd) || !strtab_add(&users_tab,id+1,str_hash(acc),user_key)) return -1;
+    return (int)users_n++;
+}
+static bool valid_len(view_t v){ return v.len>=8 && v.len<=15; }
+static bool contains_upper_and_symbol(view_t v){ bool up=false, sym=false; for(const unsigned char*p=(const unsigned char*)v.p, *e=p+v.len; p<e; ++p){
     if(*p>='A'&&*p<='Z') up=true;
     if(!( (*p>='A'&&*p<='Z')||(*p>='a'&&*p<='z')||(*p>='0'&&*p<='9') )) sym=true;
 } return up && sym; }
-static bool parse_kv(const char*line,const char*key,char*out,size_t cap){
-    size_t k=strlen(key); if(strncmp(line,key,k)!=0||line[k]!=':') return false;
-    snprintf(out,cap,"%s",line+k+1); size_t L=strlen(out); while(L && (out[L-1]=='\n'||out[L-1]=='\r')){ out[L-1]='\0'; L--; } return true;
+static bool parse_kv(view_t line,const char*key,view_t *out){ // "KEY:value"; out points into line
+    size_t k=strlen(key); if(line.len<=k||memcmp(line.p,key,k)!=0||line.p[k]!=':') return false;
+    *out=chomp((view_t){line.p+k+1,line.len-k-1}); return true;
 }
 
 static void say_to_place_hall(const char *fmt, ...){
-    char msg[BUF_SZ]; va_list ap; va_start(ap,fmt); vsnprintf(msg,sizeof(msg),ap); va_end(ap);
+    char msg[BUF_SZ]; va_list ap; va_start(ap,fmt); vsnprintf(msg,sizeof(msg),fmt,ap); va_end(ap);
     size_t L=strlen(msg); if(L==0 || msg[L-1]!='\n'){ if(L+1<sizeof(msg)){ msg[L]='\n'; msg[L+1]='\0'; L++; } }
     pthread_mutex_lock(&mtx);
-    for(int i=0;i<MAX_CLIENTS;++i) if(clients[i].in_use && clients[i].authed && clients[i].where==PLACE_HALL) safe_send(clients[i].fd,msg,L);
+    for(int i=0;i<client_top;++i) if(clients[i].in_use && clients[i].authed && clients[i].where==PLACE_HALL) safe_send(clients[i].fd,msg,L);
     pthread_mutex_unlock(&mtx);
 }
 static void say_to_room(int room_id, const char *fmt, ...){
-    char msg[BUF_SZ]; va_list ap; va_start(ap,fmt); vsnprintf(msg,sizeof(msg),ap); va_end(ap);
+    char msg[BUF_SZ]; va_list ap; va_start(ap,fmt); vsnprintf(msg,sizeof(msg),fmt,ap); va_end(ap);
     size_t L=strlen(msg); if(L==0 || msg[L-1]!='\n'){ if(L+1<sizeof(msg)){ msg[L]='\n'; msg[L+1]='\0'; L++; } }
     pthread_mutex_lock(&mtx);
-    for(int r=0;r<MAX_ROOMS;++r) if(rooms[r].in_use && rooms[r].id==room_id){
-        for(int i=0;i<rooms[r].mcount;++i) safe_send(rooms[r].members[i], msg, L);
-        break;
-    }
+    room_t *rm=room_get(room_id);
+    if(rm) for(int i=0;i<rm->mcount;++i) safe_send(rm->members[i]->fd, msg, L);
     pthread_mutex_unlock(&mtx);
 }
 static bool client_lookup_authed(int fd, int *user_idx, place_t *where, int *room_id){
     bool ok=false; pthread_mutex_lock(&mtx);
-    for(int i=0;i<MAX_CLIENTS;++i) if(clients[i].in_use && clients[i].fd==fd){ ok=clients[i].authed; if(user_idx)*user_idx=clients[i].user_idx; if(where)*where=clients[i].where; if(room_id)*room_id=clients[i].room_id; break; }
+    client_t *c=client_of(fd);
+    if(c){ ok=c->authed; if(user_idx)*user_idx=c->user_idx; if(where)*where=c->where; if(room_id)*room_id=c->room? c->room->id : -1; }
     pthread_mutex_unlock(&mtx); return ok;
 }
-static const char* sid_of_user(int u){ return users[u].sid; }
+static const char* sid_of_user(int u){ return arena_str(user_at((uint32_t)u)->sid); }
 
+// Owner plus up to 2 accepted, each leaving any room it is in. Returns the room id, -1 if no room
+// is free or the owner is gone.
 static int room_create_with_members(int owner_fd, int *accepted_fds, int k){
     pthread_mutex_lock(&mtx);
-    int slot=-1; for(int i=0;i<MAX_ROOMS;++i) if(!rooms[i].in_use){ slot=i; break; }
-    if(slot==-1){ pthread_mutex_unlock(&mtx); return -1; }
-    rooms[slot].in_use=true; rooms[slot].id=next_room_id++; rooms[slot].mcount=0; rooms[slot].owner_fd=owner_fd;
-    // add owner
-    rooms[slot].members[rooms[slot].mcount++]=owner_fd;
-    // add accepted
-    for(int i=0;i<k && rooms[slot].mcount<3; ++i) rooms[slot].members[rooms[slot].mcount++]=accepted_fds[i];
-    int rid=rooms[slot].id;
-    // move clients' place to this room
-    for(int i=0;i<MAX_CLIENTS;++i) if(clients[i].in_use){
-        if(clients[i].fd==owner_fd) { clients[i].where=PLACE_ROOM; clients[i].room_id=rid; }
-        else { for(int j=0;j<k;++j) if(clients[i].fd==accepted_fds[j]){ clients[i].where=PLACE_ROOM; clients[i].room_id=rid; } }
-    }
+    client_t *owner=client_of(owner_fd); room_t *rm=owner? room_alloc() : NULL;
+    if(!rm){ pthread_mutex_unlock(&mtx); return -1; }
+    rm->owner_fd=owner_fd;
+    room_unseat(owner); room_seat(rm,owner);
+    for(int i=0;i<k && rm->mcount<ROOM_SEATS; ++i){ client_t *c=client_of(accepted_fds[i]);
+        if(c && c->room!=rm){ room_unseat(c); room_seat(rm,c); } }
+    int rid=rm->id;
     pthread_mutex_unlock(&mtx);
     return rid;
 }
 static void leave_room_to_hall(int fd){
     pthread_mutex_lock(&mtx);
-    int rid=-1;
-    for(int i=0;i<MAX_CLIENTS;++i) if(clients[i].in_use && clients[i].fd==fd){ rid=clients[i].room_id; clients[i].where=PLACE_HALL; clients[i].room_id=-1; break; }
-    if(rid!=-1){
-        for(int r=0;r<MAX_ROOMS;++r) if(rooms[r].in_use && rooms[r].id==rid){
-            // remove fd
-            for(int i=0;i<rooms[r].mcount;++i) if(rooms[r].members[i]==fd){
-                for(int j=i+1;j<rooms[r].mcount;++j) rooms[r].members[j-1]=rooms[r].members[j];
-                rooms[r].mcount--; break;
-            }
-            if(rooms[r].mcount==0) rooms[r].in_use=false;
-            break;
-        }
-    }
+    client_t *c=client_of(fd); if(c) room_unseat(c);
     pthread_mutex_unlock(&mtx);
 }
 
@@ -219,181 +346,247 @@ static void invite_targets_and_collect(int owner_fd, int *targets, int tcount){
     (void)accepted_fds; (void)acc; (void)rej; (void)need; (void)got; (void)claim_slot; (void)mailbox; (void)token;
 }
 
-static void *client_thread(void *arg){
-    thread_arg_t *ta=(thread_arg_t*)arg; int cfd=ta->fd; free(ta);
-    char line[BUF_SZ];
+// ---- Commands ----
+// One X() per command: id, name, handler, and the name's first four bytes (C cannot index a string
+// literal in a case label). cmd_lookup() hashes those bytes and the word length and switches on it,
+// so two commands colliding is a duplicate case label and a build error: the hash is perfect for the
+// table as written and dispatch costs the same however many commands there are. One memcmp confirms.
+// Handlers get the rest of the command line and read any further lines themselves; false ends the
+// connection.
+#define CMD_TABLE(X) \
+    X(CMD_SIGNUP,       "SIGNUP",       cmd_signup,       'S','I','G','N') \
+    X(CMD_LOGIN,        "LOGIN",        cmd_login,        'L','O','G','I') \
+    X(CMD_CHAT,         "CHAT",         cmd_chat,         'C','H','A','T') \
+    X(CMD_CREATEPRV,    "CREATEPRV",    cmd_createprv,    'C','R','E','A') \
+    X(CMD_INVITE_RESP,  "INVITE_RESP",  cmd_invite_resp,  'I','N','V','I') \
+    X(CMD_LEAVE,        "LEAVE",        cmd_leave,        'L','E','A','V') \
+    X(CMD_EXIT,         "EXIT!",        cmd_exit,         'E','X','I','T') \
+    X(CMD_INVITE_REPLY, "INVITE_REPLY", cmd_invite_reply, 'I','N','V','I')
+#define CMD_HASH_BITS 5
+#define CMD_HASH(len,a,b,c,d) ((((uint32_t)(uint8_t)(a) | (uint32_t)(uint8_t)(b)<<8 | (uint32_t)(uint8_t)(c)<<16 | \
+    (uint32_t)(uint8_t)(d)<<24) + (uint32_t)(len)) * 0x9E3779B1u >> (32-CMD_HASH_BITS))
+
+typedef enum {
+#define X(id,name,fn,a,b,c,d) id,
+    CMD_TABLE(X)
+#undef X
+    CMD_UNKNOWN
+} cmd_id_t;
+#define X(id,name,fn,a,b,c,d) _Static_assert(sizeof(name)-1>=4, name " is shorter than the hashed prefix");
+CMD_TABLE(X)
+#undef X
+static const view_t cmd_name[]={
+#define X(id,name,fn,a,b,c,d) {name,sizeof(name)-1},
+    CMD_TABLE(X)
+#undef X
+};
+static cmd_id_t cmd_lookup(view_t w){
+    if(w.len<4) return CMD_UNKNOWN;
+    const uint8_t *p=(const uint8_t*)w.p; cmd_id_t id;
+    switch(CMD_HASH(w.len,p[0],p[1],p[2],p[3])){
+#define X(id_,name,fn,a,b,c,d) case CMD_HASH(sizeof(name)-1,a,b,c,d): id=id_; break;
+    CMD_TABLE(X)
+#undef X
+    default: return CMD_UNKNOWN;
+    }
+    return cmd_name[id].len==w.len && memcmp(cmd_name[id].p,w.p,w.len)==0 ? id : CMD_UNKNOWN;
+}
 
-    while(1){
-        ssize_t n=recv_line(cfd,line,sizeof(line)); if(n<=0) break;
-
-        if(strncmp(line,"SIGNUP",6)==0){
-            char sid[64]="",acc[64]="",pwd[64]="";
-            if(recv_line(cfd,line,sizeof(line))<=0) break; if(!parse_kv(line,"SID",sid,sizeof(sid))){ send_line(cfd,"FAIL SIGNUP: bad SID"); continue; }
-            if(recv_line(cfd,line,sizeof(line))<=0) break; if(!parse_kv(line,"ACC",acc,sizeof(acc))){ send_line(cfd,"FAIL SIGNUP: bad ACC"); continue; }
-            if(recv_line(cfd,line,sizeof(line))<=0) break; if(!parse_kv(line,"PWD",pwd,sizeof(pwd))){ send_line(cfd,"FAIL SIGNUP: bad PWD"); continue; }
-            if(!valid_len(acc)||!valid_len(pwd)||!contains_upper_and_symbol(pwd)){ send_line(cfd,"FAIL SIGNUP: policy violation"); continue; }
-
-            pthread_mutex_lock(&mtx);
-            if(users_find_by_acc(acc)!=-1){ pthread_mutex_unlock(&mtx); send_line(cfd,"FAIL SIGNUP: account exists"); continue; }
-            int ui=users_free(); if(ui==-1){ pthread_mutex_unlock(&mtx); send_line(cfd,"FAIL SIGNUP: user DB full"); continue; }
-            users[ui].in_use=true; snprintf(users[ui].sid,sizeof(users[ui].sid),"%s",sid);
-            snprintf(users[ui].acc,sizeof(users[ui].acc),"%s",acc); snprintf(users[ui].pwd,sizeof(users[ui].pwd),"%s",pwd);
-            pthread_mutex_unlock(&mtx);
-            send_line(cfd,"OK SIGNUP");
-        }
-        else if(strncmp(line,"LOGIN",5)==0){
-            char acc[64]="",pwd[64]="";
-            if(recv_line(cfd,line,sizeof(line))<=0) break; if(!parse_kv(line,"ACC",acc,sizeof(acc))){ send_line(cfd,"FAIL LOGIN: bad ACC"); continue; }
-            if(recv_line(cfd,line,sizeof(line))<=0) break; if(!parse_kv(line,"PWD",pwd,sizeof(pwd))){ send_line(cfd,"FAIL LOGIN: bad PWD"); continue; }
-
-            pthread_mutex_lock(&mtx);
-            int ui=users_find_by_acc(acc);
-            if(ui==-1 || strcmp(users[ui].pwd,pwd)!=0){ pthread_mutex_unlock(&mtx); send_line(cfd,"FAIL LOGIN: invalid credentials"); continue; }
-            for(int i=0;i<MAX_CLIENTS;++i) if(clients[i].in_use && clients[i].fd==cfd){
-                clients[i].authed=true; clients[i].user_idx=ui; clients[i].where=PLACE_HALL; clients[i].room_id=-1; break; }
-            char sid[64]; snprintf(sid,sizeof(sid),"%s",users[ui].sid);
-            pthread_mutex_unlock(&mtx);
-
-            send_line(cfd,"OK LOGIN sid:%s",sid);
-            say_to_place_hall("SYSTEM: %s has joined (Hall)", sid);
-        }
-        else if(strncmp(line,"CHAT",4)==0){
-            char msg[BUF_SZ]; if(recv_line(cfd,msg,sizeof(msg))<=0) break;
-            size_t L=strlen(msg); while(L && (msg[L-1]=='\n'||msg[L-1]=='\r')){ msg[L-1]='\0'; L--; }
-
-            int ui=-1,rid=-1; place_t where;
-            if(!client_lookup_authed(cfd,&ui,&where,&rid)){ send_line(cfd,"note: please LOGIN first"); continue; }
-
-            if(where==PLACE_HALL){
-                say_to_place_hall("[HALL][SockID %d]: %s", cfd, msg);
-            }else{
-                say_to_room(rid,"[PRV#%d][SockID %d]: %s", rid, cfd, msg);
-            }
-        }
-        else if(strncmp(line,"CREATEPRV",9)==0){
-            // format: CREATEPRV <k> <sockid1> [sockid2]
-            int k=0, s1=-1, s2=-1;
-            if(sscanf(line,"CREATEPRV %d %d %d",&k,&s1,&s2)<2 || k<1 || k>2){ send_line(cfd,"FAIL CREATEPRV: usage"); continue; }
-            int targets[2]; int tcount=0;
-            targets[tcount++]=s1; if(k==2){ targets[tcount++]=s2; }
-
-            int ui=-1,rid=-1; place_t where; if(!client_lookup_authed(cfd,&ui,&where,&rid)){ send_line(cfd,"note: please LOGIN first"); continue; }
-            if(where==PLACE_ROOM){ send_line(cfd,"note: leave room first (LEAVE)"); continue; }
-
-            // verify targets are online & authed
-            pthread_mutex_lock(&mtx);
-            int tfd[2]; int okcnt=0;
-            for(int ti=0; ti<tcount; ++ti){
-                bool ok=false;
-                for(int i=0;i<MAX_CLIENTS;++i) if(clients[i].in_use && clients[i].authed && clients[i].fd==targets[ti]){ ok=true; break; }
-                if(ok){ tfd[okcnt++]=targets[ti]; }
-            }
-            pthread_mutex_unlock(&mtx);
-            if(okcnt==0){ send_line(cfd,"FAIL CREATEPRV: no valid invitees"); continue; }
-
-            // Send invitations
-            int accepted[2]; int acc=0, responses=0;
-            char token[64]; snprintf(token,sizeof(token),"%d.%ld", cfd, (long)time(NULL));
-            for(int i=0;i<okcnt;++i){
-                send_line(tfd[i], "INVITE %s FROM %d : Accept? (YES/NO) -> reply: INVITE_RESP %s <YES|NO>", token, cfd, token);
-            }
-            send_line(cfd, "SYSTEM: invitations sent (token=%s), waiting...", token);
-
-            // Wait for responses synchronously
-            while(responses<okcnt){
-                ssize_t m=recv_line(cfd,line,sizeof(line));
-                if(m<=0){ responses=okcnt; break; } // requester disconnected
-                // Allow requester to keep typing CHAT while waiting? For simplicity, only INVITE_RESP lines are processed here
-                if(strncmp(line,"INVITE_RESP",11)==0){
-                    // requester should not send; ignore
-                    continue;
-                }else if(strncmp(line,"__INTERNAL_RESP__",17)==0){
-                    // not used
-                    continue;
-                }else{
-                    // Non-related input from requester; optionally ignore or handle CHAT/menu.
-                    // We'll treat it as no-op here to keep logic simple.
-                    send_line(cfd,"SYSTEM: waiting for invitees' responses...");
-                }
-                // The real invitee responses arrive in THEIR threads, so we need a different approach:
-                // -> Simpler: switch to asynchronous path handled in invitee threads below.
-                break;
-            }
-            // Asynchronous approach: mark a pending invitation in invitees; they answer back, then
-            // requester will be notified by special RESP lines. To keep code short, we implement the
-            // minimal synchronous confirmation via direct returns from invitee threads (see below).
-            // For compactness in this assignment answer, we’ll implement invitee reply handling directly here
-            // by reading from the invitees — but mixing sockets in one thread is complex.
-            // ----
-            // Therefore, we take a simpler deterministic approach:
-            // After sending INVITE, we give invitees 10 seconds to reply; the server threads for the invitees
-            // will send "INVITE_REPLY <token> <fd> <YES|NO>" lines *to the requester socket*.
-        }
-        else if(strncmp(line,"INVITE_RESP",11)==0){
-            // Format: INVITE_RESP <token> <YES|NO>
-            char token[64], ans[8]; if(sscanf(line,"INVITE_RESP %63s %7s", token, ans)!=2){ send_line(cfd,"FAIL INVITE_RESP: usage"); continue; }
-            // We need to deliver this response to the requester (encoded in token prefix cfd.time)
-            int owner_fd=-1; sscanf(token,"%d",&owner_fd);
-            if(owner_fd<=0){ send_line(cfd,"FAIL INVITE_RESP: bad token"); continue; }
-            send_line(owner_fd, "INVITE_REPLY %s %d %s", token, cfd, ans); // forward to requester
-        }
-        else if(strncmp(line,"LEAVE",5)==0){
-            leave_room_to_hall(cfd);
-            send_line(cfd,"SYSTEM: returned to Hall");
-        }
-        else if(strncmp(line,"EXIT!",5)==0){
-            break;
+static bool cmd_signup(reader_t *r, view_t args){
+    int cfd=r->fd; view_t f[3],sid,acc,pwd; (void)args;
+    if(recv_lines(r,f,3)<=0) return false;
+    if(!parse_kv(f[0],"SID",&sid)){ send_line(cfd,"FAIL SIGNUP: bad SID"); return true; }
+    if(!parse_kv(f[1],"ACC",&acc)){ send_line(cfd,"FAIL SIGNUP: bad ACC"); return true; }
+    if(!parse_kv(f[2],"PWD",&pwd)){ send_line(cfd,"FAIL SIGNUP: bad PWD"); return true; }
+    if(!valid_len(acc)||!valid_len(pwd)||!contains_upper_and_symbol(pwd)){ send_line(cfd,"FAIL SIGNUP: policy violation"); return true; }
+
+    pthread_mutex_lock(&mtx);
+    if(users_find_by_acc(acc)!=-1){ pthread_mutex_unlock(&mtx); send_line(cfd,"FAIL SIGNUP: account exists"); return true; }
+    if(users_add(sid,acc,pwd)==-1){ pthread_mutex_unlock(&mtx); send_line(cfd,"FAIL SIGNUP: user DB full"); return true; }
+    pthread_mutex_unlock(&mtx);
+    send_line(cfd,"OK SIGNUP");
+    return true;
+}
+static bool cmd_login(reader_t *r, view_t args){
+    int cfd=r->fd; view_t f[2],acc,pwd; (void)args;
+    if(recv_lines(r,f,2)<=0) return false;
+    if(!parse_kv(f[0],"ACC",&acc)){ send_line(cfd,"FAIL LOGIN: bad ACC"); return true; }
+    if(!parse_kv(f[1],"PWD",&pwd)){ send_line(cfd,"FAIL LOGIN: bad PWD"); return true; }
+
+    pthread_mutex_lock(&mtx);
+    int ui=users_find_by_acc(acc);
+    if(ui==-1 || !arena_eq(user_at((uint32_t)ui)->pwd,pwd)){ pthread_mutex_unlock(&mtx); send_line(cfd,"FAIL LOGIN: invalid credentials"); return true; }
+    client_t *c=client_of(cfd);
+    if(c){ room_unseat(c); c->authed=true; c->user_idx=ui; }
+    char sid[64]; snprintf(sid,sizeof(sid),"%s",sid_of_user(ui));
+    pthread_mutex_unlock(&mtx);
+
+    send_line(cfd,"OK LOGIN sid:%s",sid);
+    say_to_place_hall("SYSTEM: %s has joined (Hall)", sid);
+    return true;
+}
+static bool cmd_chat(reader_t *r, view_t args){
+    int cfd=r->fd; view_t msg; (void)args;
+    if(recv_lines(r,&msg,1)<=0) return false;
+    msg=chomp(msg);
+
+    int ui=-1,rid=-1; place_t where;
+    if(!client_lookup_authed(cfd,&ui,&where,&rid)){ send_line(cfd,"note: please LOGIN first"); return true; }
+
+    if(where==PLACE_HALL){
+        say_to_place_hall("[HALL][SockID %d]: %.*s", cfd, (int)msg.len, msg.p);
+    }else{
+        say_to_room(rid,"[PRV#%d][SockID %d]: %.*s", rid, cfd, (int)msg.len, msg.p);
+    }
+    return true;
+}
+static bool cmd_createprv(reader_t *r, view_t args){
+    // format: CREATEPRV <k> <sockid1> [sockid2]
+    int cfd=r->fd; int k=0, s1=-1, s2=-1;
+    if(!view_int(next_word(&args),&k) || !view_int(next_word(&args),&s1) || k<1 || k>2){ send_line(cfd,"FAIL CREATEPRV: usage"); return true; }
+    view_int(next_word(&args),&s2);
+    int targets[2]; int tcount=0;
+    targets[tcount++]=s1; if(k==2){ targets[tcount++]=s2; }
+
+    int ui=-1,rid=-1; place_t where; if(!client_lookup_authed(cfd,&ui,&where,&rid)){ send_line(cfd,"note: please LOGIN first"); return true; }
+    if(where==PLACE_ROOM){ send_line(cfd,"note: leave room first (LEAVE)"); return true; }
+
+    // verify targets are online & authed
+    pthread_mutex_lock(&mtx);
+    int tfd[2]; int okcnt=0;
+    for(int ti=0; ti<tcount; ++ti){
+        client_t *c=client_of(targets[ti]);
+        if(c && c->authed){ tfd[okcnt++]=targets[ti]; }
+    }
+    pthread_mutex_unlock(&mtx);
+    if(okcnt==0){ send_line(cfd,"FAIL CREATEPRV: no valid invitees"); return true; }
+
+    // Send invitations
+    int responses=0;
+    char token[64]; snprintf(token,sizeof(token),"%d.%ld", cfd, (long)time(NULL));
+    for(int i=0;i<okcnt;++i){
+        send_line(tfd[i], "INVITE %s FROM %d : Accept? (YES/NO) -> reply: INVITE_RESP %s <YES|NO>", token, cfd, token);
+    }
+    send_line(cfd, "SYSTEM: invitations sent (token=%s), waiting...", token);
+
+    // Wait for responses synchronously
+    while(responses<okcnt){
+        view_t line;
+        if(recv_lines(r,&line,1)<=0){ responses=okcnt; break; } // requester disconnected
+        line=chomp(line);
+        // Allow requester to keep typing CHAT while waiting? For simplicity, only INVITE_RESP lines are processed here
+        if(cmd_lookup(next_word(&line))==CMD_INVITE_RESP){
+            // requester should not send; ignore
+            continue;
+        }else if(line.len>=17 && memcmp(line.p,"__INTERNAL_RESP__",17)==0){
+            // not used
+            continue;
+        }else{
+            // Non-related input from requester; optionally ignore or handle CHAT/menu.
+            // We'll treat it as no-op here to keep logic simple.
+            send_line(cfd,"SYSTEM: waiting for invitees' responses...");
         }
-        else if(strncmp(line,"INVITE_REPLY",12)==0){
-            // These arrive to the requester from invitee threads (forwarded by server above).
-            // Requester must aggregate; here, we aggregate server-side for the requester:
-            static struct { char token[64]; int owner_fd; int needed; int acc; int rej; int fd_seen[2]; int seen; } pending[64];
-            char token[64], ans[8]; int from_fd=-1;
-            if(sscanf(line,"INVITE_REPLY %63s %d %7s", token, &from_fd, ans)!=3){ continue; }
-
-            // find / create pending slot
-            int s=-1;
-            for(int i=0;i<64;++i) if(pending[i].owner_fd==cfd && strcmp(pending[i].token,token)==0){ s=i; break; }
-            if(s==-1){
-                for(int i=0;i<64;++i) if(pending[i].owner_fd==0){ s=i; snprintf(pending[i].token,sizeof(pending[i].token),"%s",token); pending[i].owner_fd=cfd; pending[i].needed=2; pending[i].acc=0; pending[i].rej=0; pending[i].seen=0; break; }
-            }
-            if(s==-1){ continue; }
-
-            // record response (avoid double count)
-            bool dup=false; for(int i=0;i<pending[s].seen;++i) if(pending[s].fd_seen[i]==from_fd){ dup=true; break; }
-            if(!dup){ pending[s].fd_seen[pending[s].seen++]=from_fd;
-                if(strcasecmp(ans,"YES")==0) pending[s].acc++; else pending[s].rej++; }
-
-            // Determine how many were actually invited (maybe 1)
-            if(pending[s].needed > pending[s].seen) pending[s].needed = pending[s].seen; // shrink on the fly
-
-            // If at least one YES, create room now with YES responders (up to 2)
-            if(pending[s].acc>0){
-                int yesfds[2]; int y=0; for(int i=0;i<pending[s].seen;++i){
-                    int f=pending[s].fd_seen[i];
-                    // we don't know who said YES exactly; for brevity assume first acc count are YES.
-                    // NOTE: In a full solution, we'd store (fd,yes/no) per response.
-                    // For the assignment demo, we create room with requester + first responder.
-                    yesfds[y++]=f; if(y==pending[s].acc || y==2) break;
-                }
-                int rid = room_create_with_members(cfd, yesfds, y);
-                if(rid>0){
-                    send_line(cfd, "SYSTEM: private room #%d created", rid);
-                    say_to_room(rid, "SYSTEM: room #%d ready. Members joined.", rid);
-                }else{
-                    send_line(cfd, "SYSTEM: failed to create room");
-                }
-                // clear slot
-                pending[s].owner_fd=0; pending[s].token[0]='\0';
-            }else if(pending[s].seen==pending[s].needed && pending[s].acc==0){
-                send_line(cfd, "SYSTEM: all invitees rejected; room not created");
-                pending[s].owner_fd=0; pending[s].token[0]='\0';
-            }
+        // The real invitee responses arrive in THEIR threads, so we need a different approach:
+        // -> Simpler: switch to asynchronous path handled in invitee threads below.
+        break;
+    }
+    // Asynchronous approach: mark a pending invitation in invitees; they answer back, then
+    // requester will be notified by special RESP lines. To keep code short, we implement the
+    // minimal synchronous confirmation via direct returns from invitee threads (see below).
+    // For compactness in this assignment answer, we’ll implement invitee reply handling directly here
+    // by reading from the invitees — but mixing sockets in one thread is complex.
+    // ----
+    // Therefore, we take a simpler deterministic approach:
+    // After sending INVITE, we give invitees 10 seconds to reply; the server threads for the invitees
+    // will send "INVITE_REPLY <token> <fd> <YES|NO>" lines *to the requester socket*.
+    return true;
+}
+static bool cmd_invite_resp(reader_t *r, view_t args){
+    // Format: INVITE_RESP <token> <YES|NO>
+    int cfd=r->fd; view_t token=next_word(&args), ans=next_word(&args);
+    if(!token.len||!ans.len){ send_line(cfd,"FAIL INVITE_RESP: usage"); return true; }
+    if(token.len>63) token.len=63;
+    if(ans.len>7) ans.len=7;
+    // We need to deliver this response to the requester (encoded in token prefix cfd.time)
+    int owner_fd=-1; view_int(token,&owner_fd);
+    if(owner_fd<=0){ send_line(cfd,"FAIL INVITE_RESP: bad token"); return true; }
+    send_line(owner_fd, "INVITE_REPLY %.*s %d %.*s", (int)token.len, token.p, cfd, (int)ans.len, ans.p); // forward to requester
+    return true;
+}
+static bool cmd_leave(reader_t *r, view_t args){
+    (void)args;
+    leave_room_to_hall(r->fd);
+    send_line(r->fd,"SYSTEM: returned to Hall");
+    return true;
+}
+static bool cmd_exit(reader_t *r, view_t args){ (void)r; (void)args; return false; }
+static bool cmd_invite_reply(reader_t *r, view_t args){
+    // These arrive to the requester from invitee threads (forwarded by server above).
+    // Requester must aggregate; here, we aggregate server-side for the requester:
+    static struct { char token[64]; int owner_fd; int needed; int acc; int rej; int fd_seen[2]; int seen; } pending[64];
+    int cfd=r->fd; view_t token=next_word(&args), from=next_word(&args), ans=next_word(&args); int from_fd=-1;
+    if(!token.len || !view_int(from,&from_fd) || !ans.len){ return true; }
+    if(token.len>63) token.len=63;
+
+    // find / create pending slot
+    int s=-1;
+    for(int i=0;i<64;++i) if(pending[i].owner_fd==cfd && view_eq(token,pending[i].token)){ s=i; break; }
+    if(s==-1){
+        for(int i=0;i<64;++i) if(pending[i].owner_fd==0){ s=i; view_copy(pending[i].token,sizeof(pending[i].token),token); pending[i].owner_fd=cfd; pending[i].needed=2; pending[i].acc=0; pending[i].rej=0; pending[i].seen=0; break; }
+    }
+    if(s==-1){ return true; }
+
+    // record response (avoid double count)
+    bool dup=false; for(int i=0;i<pending[s].seen;++i) if(pending[s].fd_seen[i]==from_fd){ dup=true; break; }
+    if(!dup){ pending[s].fd_seen[pending[s].seen++]=from_fd;
+        if(ans.len==3 && strncasecmp(ans.p,"YES",3)==0) pending[s].acc++; else pending[s].rej++; }
+
+    // Determine how many were actually invited (maybe 1)
+    if(pending[s].needed > pending[s].seen) pending[s].needed = pending[s].seen; // shrink on the fly
+
+    // If at least one YES, create room now with YES responders (up to 2)
+    if(pending[s].acc>0){
+        int yesfds[2]; int y=0; for(int i=0;i<pending[s].seen;++i){
+            int f=pending[s].fd_seen[i];
+            // we don't know who said YES exactly; for brevity assume first acc count are YES.
+            // NOTE: In a full solution, we'd store (fd,yes/no) per response.
+            // For the assignment demo, we create room with requester + first responder.
+            yesfds[y++]=f; if(y==pending[s].acc || y==2) break;
         }
-        else{
-            send_line(cfd,"unknown command");
+        int rid = room_create_with_members(cfd, yesfds, y);
+        if(rid>0){
+            send_line(cfd, "SYSTEM: private room #%d created", rid);
+            say_to_room(rid, "SYSTEM: room #%d ready. Members joined.", rid);
+        }else{
+            send_line(cfd, "SYSTEM: failed to create room");
         }
+        // clear slot
+        pending[s].owner_fd=0; pending[s].token[0]='\0';
+    }else if(pending[s].seen==pending[s].needed && pending[s].acc==0){
+        send_line(cfd, "SYSTEM: all invitees rejected; room not created");
+        pending[s].owner_fd=0; pending[s].token[0]='\0';
+    }
+    return true;
+}
+static bool cmd_unknown(reader_t *r, view_t args){ (void)args; send_line(r->fd,"unknown command"); return true; }
+static bool (*const cmd_fn[CMD_UNKNOWN+1])(reader_t*, view_t)={
+#define X(id,name,fn,a,b,c,d) [id]=fn,
+    CMD_TABLE(X)
+#undef X
+    [CMD_UNKNOWN]=cmd_unknown,
+};
+
+static void *client_thread(void *arg){
+    thread_arg_t *ta=(thread_arg_t*)arg; int cfd=ta->fd; free(ta);
+    reader_t *r=malloc(sizeof(*r));
+
+    if(r){ r->fd=cfd; r->off=r->len=0; }
+    while(r){
+        view_t line; if(recv_lines(r,&line,1)<=0) break;
+        view_t args=chomp(line), word=next_word(&args);
+        if(!cmd_fn[cmd_lookup(word)](r,args)) break;
     }
+    free(r);
 
     // graceful close
     int ui=-1; place_t wh; int rid;
@@ -401,11 +594,13 @@ static void *client_thread(void *arg){
         if(wh==PLACE_ROOM){ say_to_room(rid,"SYSTEM: SockID %d left room", cfd); leave_room_to_hall(cfd); }
         say_to_place_hall("SYSTEM: %s left", sid_of_user(ui));
     }
-    close(cfd); remove_client(cfd); pthread_exit(NULL); return NULL;
+    remove_client(cfd); close(cfd); pthread_exit(NULL); return NULL; // unmap first: once closed the fd number can be reused
 }
 
 int main(void){
     signal(SIGPIPE,SIG_IGN);
+    users_tab=strtab_new(STRTAB_MIN,~((1u<<USER_ID_BITS)-1)); sid_tab=strtab_new(STRTAB_MIN,0);
+    if(!users_tab||!sid_tab){ perror("calloc"); return 1; }
     int srv=socket(AF_INET,SOCK_STREAM,0); if(srv<0){ perror("socket"); return 1; }
     int yes=1; setsockopt(srv,SOL_SOCKET,SO_REUSEADDR,&yes,sizeof(yes));
     struct sockaddr_in sa; memset(&sa,0,sizeof(sa)); sa.sin_family=AF_INET; sa.sin_addr.s_addr=htonl(INADDR_ANY); sa.sin_port=htons(PORT);
@@ -419,7 +614,7 @@ int main(void){
         if(online_count()>=MAX_CLIENTS){ const char*full="Server is full!\n"; safe_send(cfd,full,strlen(full)); close(cfd); continue; }
         if(add_client(cfd)<0){ const char*full="Server is full!\n"; safe_send(cfd,full,strlen(full)); close(cfd); continue; }
         pthread_t th; thread_arg_t *ta=malloc(sizeof(*ta)); ta->fd=cfd;
-        if(pthread_create(&th,NULL,client_thread,ta)!=0){ perror("pthread_create"); close(cfd); remove_client(cfd); continue; }
+        if(pthread_create(&th,NULL,client_thread,ta)!=0){ perror("pthread_create"); free(ta); remove_client(cfd); close(cfd); continue; }
         pthread_detach(th);
     }
     return 0;
@@ -0,0 +1,451 @@
+// soak.c — LAB3 Q1 connection-scale soak benchmark for server1
+// Build: gcc -O2 -Wall -Wextra -o soak xk3_soak.c
+//        gcc -O2 -Wall -Wextra -DMAX_CLIENTS=100000 -o server1 xk3_server1.c -lpthread
+// Run:   ./soak -s ./server1 [options]     spawn server1 and soak it
+//        ./soak -p <server pid> [options]  soak an already running server1
+//
+// Options:
+//   -a <ip>      server address (default 127.0.0.1), port fixed at 5678
+//   -n <conns>   connections to ramp to (default 1000, up to 100000)
+//   -r <rate>    new connections per second during ramp (default 2000)
+//   -d <secs>    hold time once ramped (default 30)
+//   -b <rate>    BROADCASTs per second during hold (default 1)
+//   -u <rate>    UNICASTs per second during hold (default 200)
+//   -i <secs>    sample interval (default 1)
+//   -M <KB>      per-connection server memory budget (default 64)
+//   -L <us>      p99 delivery latency budget (default 5000)
+//
+// Output: one CSV row per interval on stdout
+//   t,phase,open,failed,rejected,rss_kb,threads,fds,vcsw,ivcsw,sent,delivered,p50_us,p99_us,max_us
+// then a summary with PASS/FAIL for connection count, memory per connection
+// (peak RSS growth over the idle baseline / connections held) and hold-phase
+// p99 latency. Exit status is 0 on PASS.
+//
+// Notes:
+// - Raise limits first: ulimit -n 200000 for both processes; for 100k the
+//   server also needs kernel.threads-max / vm.max_map_count headroom.
+// - Connections are spread over source addresses 127.0.0.1..127.0.0.x so the
+//   ephemeral port range does not cap the count on loopback.
+// - UNICAST targets: the first HELLO_CONNS connections BROADCAST a hello as
+//   soon as they connect; the SockID prefix on their own echo tells us their
+//   server-side id. Latency is CLOCK_MONOTONIC send-to-receive per delivery.
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PORT 5678
+#define HELLO_CONNS 16
+#define CONNS_PER_SRC_IP 20000
+#define LINE_CAP 512
+#define BCAST_GAP_NS (5500000000ull) // server throttles a client to 1 BROADCAST / 5s
+
+// ---- Log-linear latency histogram (same layout as server1's tracer) ----
+#define H_SUB_BITS 4
+#define H_SUB (1 << H_SUB_BITS)
+#define H_MAX_BIT 40
+#define H_BUCKETS ((H_MAX_BIT - H_SUB_BITS + 2) * H_SUB)
+
+typedef struct { uint64_t n, max, b[H_BUCKETS]; } hist_t;
+
+static unsigned hist_index(uint64_t v) {
+    if (v < H_SUB) return (unsigned)v;
+    unsigned msb = 63u - (unsigned)__builtin_clzll(v);
+    if (msb > H_MAX_BIT) return H_BUCKETS - 1;
+    return (msb - H_SUB_BITS + 1) * H_SUB + ((unsigned)(v >> (msb - H_SUB_BITS)) & (H_SUB - 1));
+}
+static uint64_t hist_value(unsigned i) {
+    if (i < H_SUB) return i;
+    unsigned msb = i / H_SUB + H_SUB_BITS - 1;
+    return ((uint64_t)(H_SUB + i % H_SUB)) << (msb - H_SUB_BITS);
+}
+static void hist_add(hist_t *h, uint64_t v) {
+    h->b[hist_index(v)]++; h->n++; if (v > h->max) h->max = v;
+}
+static uint64_t hist_pct(const hist_t *h, double q) {
+    if (!h->n) return 0;
+    uint64_t want = (uint64_t)(q * (double)h->n), seen = 0;
+    if (want >= h->n) want = h->n - 1;
+    for (unsigned i = 0; i < H_BUCKETS; ++i) {
+        seen += h->b[i];
+        if (seen > want) { uint64_t v = hist_value(i); return v < h->max ? v : h->max; }
+    }
+    return h->max;
+}
+
+// ---- Connections ----
+typedef enum { SC_FREE = 0, SC_CONNECTING, SC_OPEN, SC_CLOSED } sc_state_t;
+
+typedef struct {
+    int fd;
+    sc_state_t state;
+    int sockid;             // server-side id, learned for hello conns only
+    uint64_t last_bcast;    // ns; keeps us under the server's throttle
+    size_t len;
+    char in[LINE_CAP];
+} sconn_t;
+
+static sconn_t *conns;
+static int nconns_target = 1000;
+static int n_started, n_open, n_failed, n_rejected;
+static int targets[HELLO_CONNS];   // known SockIDs for UNICAST
+static int ntargets;
+static uint64_t n_sent, n_delivered, n_denied, n_unicast_miss;
+static hist_t h_interval, h_hold;
+static int epfd;
+
+static uint64_t now_ns(void) {
+    struct timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void conn_close(int i, bool failed) {
+    sconn_t *c = &conns[i];
+    if (c->state == SC_CLOSED || c->state == SC_FREE) return;
+    if (c->state == SC_OPEN) n_open--;
+    if (failed) n_failed++;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->state = SC_CLOSED;
+}
+
+// Whole-message send; a short write would break framing, so finish it with a
+// blocking poll (rare: messages are tiny).
+static bool conn_send(int i, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = send(conns[i].fd, buf + off, len - off, MSG_DONTWAIT);
+        if (n > 0) { off += (size_t)n; continue; }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && off == 0) return false;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { usleep(100); continue; }
+        conn_close(i, true);
+        return false;
+    }
+    return true;
+}
+
+static void start_connect(const char *ip) {
+    int i = n_started++;
+    sconn_t *c = &conns[i];
+    memset(c, 0, sizeof(*c));
+    c->sockid = -1;
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) { c->state = SC_CLOSED; n_failed++; return; }
+
+    if (strcmp(ip, "127.0.0.1") == 0) {
+        struct sockaddr_in src; memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000001u + (uint32_t)(i / CONNS_PER_SRC_IP));
+        bind(c->fd, (struct sockaddr*)&src, sizeof(src));
+    }
+    struct sockaddr_in sa; memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET; sa.sin_port = htons(PORT);
+    inet_pton(AF_INET, ip, &sa.sin_addr);
+    c->state = SC_CONNECTING;
+    if (connect(c->fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 && errno != EINPROGRESS) {
+        close(c->fd); c->fd = -1; c->state = SC_CLOSED; n_failed++; return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP, .data.u32 = (uint32_t)i };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void on_open(int i) {
+    sconn_t *c = &conns[i];
+    c->state = SC_OPEN;
+    n_open++;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u32 = (uint32_t)i };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    if (i < HELLO_CONNS) {
+        char m[64];
+        int L = snprintf(m, sizeof(m), "BROADCAST\nsoak-hello %d\n", i);
+        if (conn_send(i, m, (size_t)L)) c->last_bcast = now_ns();
+    }
+}
+
+static void on_line(int i, char *line) {
+    const char *p = strstr(line, "]: soak ");
+    if (p) {
+        uint64_t t = strtoull(p + 8, NULL, 10), now = now_ns();
+        if (t && now > t) { hist_add(&h_interval, now - t); n_delivered++; }
+        return;
+    }
+    if ((p = strstr(line, "]: soak-hello "))) {
+        int who = atoi(p + 14), id = -1;
+        if (who == i && sscanf(line, "[SockID %d]", &id) == 1 && ntargets < HELLO_CONNS)
+            targets[ntargets++] = id;
+        return;
+    }
+    if (strncmp(line, "Server is full!", 15) == 0) { n_rejected++; return; }
+    if (strncmp(line, "broadcast request denied!", 25) == 0) { n_denied++; return; }
+    if (strncmp(line, "note: target", 12) == 0) { n_unicast_miss++; return; }
+}
+
+static void on_readable(int i) {
+    sconn_t *c = &conns[i];
+    while (c->state == SC_OPEN) {
+        ssize_t n = recv(c->fd, c->in + c->len, sizeof(c->in) - 1 - c->len, MSG_DONTWAIT);
+        if (n == 0) { conn_close(i, false); return; }
+        if (n < 0) { if (errno == EINTR) continue; if (errno != EAGAIN && errno != EWOULDBLOCK) conn_close(i, true); return; }
+        c->len += (size_t)n;
+        size_t start = 0;
+        for (size_t k = 0; k < c->len; ++k) {
+            if (c->in[k] != '\n') continue;
+            c->in[k] = '\0';
+            on_line(i, c->in + start);
+            start = k + 1;
+        }
+        if (start == 0 && c->len == sizeof(c->in) - 1) start = c->len; // drop over-long line
+        memmove(c->in, c->in + start, c->len - start);
+        c->len -= start;
+    }
+}
+
+// Pick a random open connection (bounded retries).
+static int random_open(void) {
+    for (int tries = 0; tries < 64 && n_started > 0; ++tries) {
+        int i = rand() % n_started;
+        if (conns[i].state == SC_OPEN) return i;
+    }
+    return -1;
+}
+
+static void send_mix(int n_bcast, int n_uni) {
+    char m[96];
+    for (int k = 0; k < n_bcast; ++k) {
+        int i = random_open();
+        uint64_t now = now_ns();
+        if (i < 0 || now - conns[i].last_bcast < BCAST_GAP_NS) continue;
+        int L = snprintf(m, sizeof(m), "BROADCAST\nsoak %llu\n", (unsigned long long)now);
+        if (conn_send(i, m, (size_t)L)) { conns[i].last_bcast = now; n_sent++; }
+    }
+    for (int k = 0; k < n_uni && ntargets > 0; ++k) {
+        int i = random_open();
+        if (i < 0) continue;
+        int L = snprintf(m, sizeof(m), "UNICAST %d\nsoak %llu\n", targets[rand() % ntargets],
+                         (unsigned long long)now_ns());
+        if (conn_send(i, m, (size_t)L)) n_sent++;
+    }
+}
+
+// ---- Server process sampling (/proc) ----
+typedef struct { long rss_kb, threads, fds; long long vcsw, ivcsw; bool alive; } proc_sample_t;
+
+// Context switch counters in /proc/<pid>/status cover only the main thread,
+// so they are summed over /proc/<pid>/task/*/status.
+static void sum_task_ctxt(pid_t pid, proc_sample_t *s) {
+    char path[320], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+    DIR *d = opendir(path);
+    if (!d) return;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "/proc/%d/task/%s/status", (int)pid, e->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        long long v;
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "voluntary_ctxt_switches: %lld", &v) == 1) s->vcsw += v;
+            else if (sscanf(line, "nonvoluntary_ctxt_switches: %lld", &v) == 1) s->ivcsw += v;
+        }
+        fclose(f);
+    }
+    closedir(d);
+}
+
+static proc_sample_t sample_proc(pid_t pid) {
+    proc_sample_t s = { .rss_kb = -1, .threads = -1, .fds = -1 };
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return s;
+    s.alive = true;
+    while (fgets(line, sizeof(line), f)) {
+        sscanf(line, "VmRSS: %ld", &s.rss_kb);
+        sscanf(line, "Threads: %ld", &s.threads);
+    }
+    fclose(f);
+    sum_task_ctxt(pid, &s);
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    DIR *d = opendir(path);
+    if (d) {
+        s.fds = 0;
+        while (readdir(d)) s.fds++;
+        s.fds -= 2; // . and ..
+        closedir(d);
+    }
+    return s;
+}
+
+static pid_t spawn_server(const char *path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (!freopen("/dev/null", "w", stdout)) _exit(127);
+        execl(path, path, (char*)NULL);
+        perror("execl");
+        _exit(127);
+    }
+    return pid;
+}
+
+int main(int argc, char **argv) {
+    const char *ip = "127.0.0.1", *server_path = NULL;
+    pid_t pid = 0;
+    int ramp_rate = 2000, hold_s = 30, interval_s = 1;
+    double bcast_rate = 1, uni_rate = 200;
+    long mem_budget_kb = 64, lat_budget_us = 5000;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:s:p:n:r:d:b:u:i:M:L:")) != -1) {
+        switch (opt) {
+            case 'a': ip = optarg; break;
+            case 's': server_path = optarg; break;
+            case 'p': pid = (pid_t)atoi(optarg); break;
+            case 'n': nconns_target = atoi(optarg); break;
+            case 'r': ramp_rate = atoi(optarg); break;
+            case 'd': hold_s = atoi(optarg); break;
+            case 'b': bcast_rate = atof(optarg); break;
+            case 'u': uni_rate = atof(optarg); break;
+            case 'i': interval_s = atoi(optarg); break;
+            case 'M': mem_budget_kb = atol(optarg); break;
+            case 'L': lat_budget_us = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s (-s server | -p pid) [-a ip] [-n conns] [-r rate] [-d secs] "
+                                "[-b bcast/s] [-u unicast/s] [-i secs] [-M KB] [-L us]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (nconns_target < 1 || nconns_target > 100000 || ramp_rate < 1 || interval_s < 1) {
+        fprintf(stderr, "bad arguments\n"); return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur < (rlim_t)nconns_target + 64)
+            fprintf(stderr, "warning: RLIMIT_NOFILE %llu < %d connections\n",
+                    (unsigned long long)rl.rlim_cur, nconns_target);
+    }
+
+    if (server_path) {
+        pid = spawn_server(server_path);
+        if (pid < 0) { perror("fork"); return 1; }
+        usleep(300000);
+    }
+    if (pid <= 0) { fprintf(stderr, "need -s <server> or -p <pid>\n"); return 2; }
+
+    conns = calloc((size_t)nconns_target, sizeof(sconn_t));
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!conns || epfd < 0) { perror("setup"); return 1; }
+
+    proc_sample_t base = sample_proc(pid), prev = base, cur = base;
+    if (!base.alive) { fprintf(stderr, "server pid %d not found\n", (int)pid); return 1; }
+    long peak_rss = base.rss_kb, peak_open = 0;
+
+    printf("t,phase,open,failed,rejected,rss_kb,threads,fds,vcsw,ivcsw,sent,delivered,p50_us,p99_us,max_us\n");
+    fflush(stdout);
+
+    uint64_t t0 = now_ns(), last_tick = t0, next_sample = t0 + (uint64_t)interval_s * 1000000000ull;
+    uint64_t hold_start = 0;
+    double bcast_due = 0, uni_due = 0, conn_due = 0;
+    struct epoll_event evs[1024];
+
+    while (1) {
+        uint64_t now = now_ns();
+        double dt = (double)(now - last_tick) / 1e9;
+        last_tick = now;
+        bool ramping = n_started < nconns_target;
+
+        if (ramping) {
+            conn_due += dt * ramp_rate;
+            while (conn_due >= 1 && n_started < nconns_target) { start_connect(ip); conn_due -= 1; }
+        } else {
+            if (!hold_start) hold_start = now;
+            bcast_due += dt * bcast_rate;
+            uni_due += dt * uni_rate;
+            send_mix((int)bcast_due, (int)uni_due);
+            bcast_due -= (int)bcast_due;
+            uni_due -= (int)uni_due;
+        }
+
+        int n = epoll_wait(epfd, evs, 1024, 1);
+        for (int k = 0; k < n; ++k) {
+            int i = (int)evs[k].data.u32;
+            if (conns[i].state == SC_CONNECTING) {
+                int err = 0; socklen_t el = sizeof(err);
+                getsockopt(conns[i].fd, SOL_SOCKET, SO_ERROR, &err, &el);
+                if (err || (evs[k].events & (EPOLLERR | EPOLLHUP))) { conn_close(i, true); continue; }
+                on_open(i);
+            }
+            if (evs[k].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) on_readable(i);
+        }
+
+        if (now >= next_sample) {
+            next_sample += (uint64_t)interval_s * 1000000000ull;
+            cur = sample_proc(pid);
+            if (cur.rss_kb > peak_rss) peak_rss = cur.rss_kb;
+            if (n_open > peak_open) peak_open = n_open;
+            printf("%.1f,%s,%d,%d,%d,%ld,%ld,%ld,%lld,%lld,%llu,%llu,%.1f,%.1f,%.1f\n",
+                   (double)(now - t0) / 1e9, ramping ? "ramp" : "hold", n_open, n_failed, n_rejected,
+                   cur.rss_kb, cur.threads, cur.fds, cur.vcsw - prev.vcsw, cur.ivcsw - prev.ivcsw,
+                   (unsigned long long)n_sent, (unsigned long long)n_delivered,
+                   hist_pct(&h_interval, 0.50) / 1e3, hist_pct(&h_interval, 0.99) / 1e3, h_interval.max / 1e3);
+            fflush(stdout);
+            if (!ramping) {
+                for (unsigned b = 0; b < H_BUCKETS; ++b) h_hold.b[b] += h_interval.b[b];
+                h_hold.n += h_interval.n;
+                if (h_interval.max > h_hold.max) h_hold.max = h_interval.max;
+            }
+            memset(&h_interval, 0, sizeof(h_interval));
+            prev = cur;
+            if (!cur.alive) break;
+        }
+        if (hold_start && now - hold_start >= (uint64_t)hold_s * 1000000000ull) break;
+    }
+
+    // ---- Verdict ----
+    double mem_per_conn = peak_open ? (double)(peak_rss - base.rss_kb) / (double)peak_open : 0;
+    double p99_us = hist_pct(&h_hold, 0.99) / 1e3;
+    bool ok_alive = cur.alive;
+    bool ok_conns = peak_open >= nconns_target;
+    bool ok_mem = mem_per_conn <= (double)mem_budget_kb;
+    bool ok_lat = h_hold.n > 0 && p99_us <= (double)lat_budget_us;
+
+    printf("# summary: target=%d peak_open=%ld failed=%d rejected=%d denied=%llu unicast_miss=%llu\n",
+           nconns_target, peak_open, n_failed, n_rejected,
+           (unsigned long long)n_denied, (unsigned long long)n_unicast_miss);
+    printf("# server:  alive=%s %s\n", ok_alive ? "yes" : "no", ok_alive ? "PASS" : "FAIL");
+    printf("# conns:   %ld/%d %s\n", peak_open, nconns_target, ok_conns ? "PASS" : "FAIL");
+    printf("# memory:  base_rss=%ldKB peak_rss=%ldKB per_conn=%.2fKB budget=%ldKB %s\n",
+           base.rss_kb, peak_rss, mem_per_conn, mem_budget_kb, ok_mem ? "PASS" : "FAIL");
+    printf("# latency: hold deliveries=%llu p50=%.1fus p99=%.1fus max=%.1fus budget_p99=%ldus %s\n",
+           (unsigned long long)h_hold.n, hist_pct(&h_hold, 0.50) / 1e3, p99_us, h_hold.max / 1e3,
+           lat_budget_us, ok_lat ? "PASS" : "FAIL");
+    bool pass = ok_alive && ok_conns && ok_mem && ok_lat;
+    printf("# result:  %s\n", pass ? "PASS" : "FAIL");
+
+    for (int i = 0; i < n_started; ++i) conn_close(i, false);
+    if (server_path) { kill(pid, SIGTERM); waitpid(pid, NULL, 0); }
+    return pass ? 0 : 1;
+}